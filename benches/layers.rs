@@ -0,0 +1,170 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Cost of a span enter/exit and of an event through each layer. Every sample runs inside a root
+//! span, so that the tree layer prints one aggregated tree per sample rather than one per span.
+//! `PrintPerfCountersLayer` prints every span when it closes, redirect stdout when running it.
+
+use std::{
+    sync::Barrier,
+    thread,
+    time::{Duration, Instant},
+};
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion};
+use tracing::{dispatcher, event, info_span, Dispatch, Level};
+use tracing_subscriber::layer::SubscriberExt;
+
+const THREAD_COUNTS: [usize; 4] = [1, 2, 4, 8];
+
+/// Run `iters` spans inside a root span on the current thread, returns the time of the spans.
+fn run_spans(dispatch: &Dispatch, iters: u64) -> Duration {
+    dispatcher::with_default(dispatch, || {
+        let root = info_span!("bench root");
+        let _root = root.enter();
+
+        let start = Instant::now();
+        for index in 0..iters {
+            let span = info_span!("bench span", index);
+            let _span = span.enter();
+        }
+        start.elapsed()
+    })
+}
+
+/// Run `iters` spans on each of `threads` threads at once, returns the wall time.
+fn run_contended_spans(dispatch: &Dispatch, threads: usize, iters: u64) -> Duration {
+    let barrier = Barrier::new(threads + 1);
+    thread::scope(|scope| {
+        for _ in 0..threads {
+            scope.spawn(|| {
+                dispatcher::with_default(dispatch, || {
+                    let root = info_span!("bench root");
+                    let _root = root.enter();
+
+                    barrier.wait();
+                    for index in 0..iters {
+                        let span = info_span!("bench span", index);
+                        let _span = span.enter();
+                    }
+                    barrier.wait();
+                })
+            });
+        }
+
+        barrier.wait();
+        let start = Instant::now();
+        barrier.wait();
+        start.elapsed()
+    })
+}
+
+fn bench_layer(c: &mut Criterion, name: &str, dispatch: Dispatch) {
+    let mut group = c.benchmark_group(name);
+    group.bench_function("span", |b| {
+        b.iter_custom(|iters| run_spans(&dispatch, iters))
+    });
+    group.bench_function("event", |b| {
+        b.iter_custom(|iters| {
+            dispatcher::with_default(&dispatch, || {
+                let root = info_span!("bench root");
+                let _root = root.enter();
+
+                let start = Instant::now();
+                for index in 0..iters {
+                    event!(name: "bench event", Level::INFO, index);
+                }
+                start.elapsed()
+            })
+        })
+    });
+    group.bench_function("counter", |b| {
+        b.iter_custom(|iters| {
+            dispatcher::with_default(&dispatch, || {
+                let root = info_span!("bench root");
+                let _root = root.enter();
+
+                let start = Instant::now();
+                for index in 0..iters {
+                    event!(name: "bench counter", Level::INFO, counter = true, value = index);
+                }
+                start.elapsed()
+            })
+        })
+    });
+    for threads in THREAD_COUNTS {
+        group.bench_with_input(
+            BenchmarkId::new("contended span", threads),
+            &threads,
+            |b, &threads| b.iter_custom(|iters| run_contended_spans(&dispatch, threads, iters)),
+        );
+    }
+    group.finish();
+}
+
+fn bench_graph(c: &mut Criterion) {
+    let (layer, _guard) =
+        tracing_profile::PrintTreeLayer::new(tracing_profile::PrintTreeConfig::default());
+    bench_layer(
+        c,
+        "graph",
+        Dispatch::new(tracing_subscriber::registry().with(layer)),
+    );
+}
+
+#[cfg(feature = "perfetto")]
+fn bench_perfetto(c: &mut Criterion) {
+    let _dir = tracing_profile::test_utils::PerfettoTestDir::new();
+    let (layer, _guard) = tracing_profile::PerfettoLayer::new_from_env().unwrap();
+    bench_layer(
+        c,
+        "perfetto",
+        Dispatch::new(tracing_subscriber::registry().with(layer)),
+    );
+}
+
+#[cfg(not(feature = "perfetto"))]
+fn bench_perfetto(_c: &mut Criterion) {}
+
+#[cfg(feature = "perf_counters")]
+fn bench_perf_counters(c: &mut Criterion) {
+    let layer = tracing_profile::PrintPerfCountersLayer::new(vec![
+        (
+            "instructions".to_string(),
+            tracing_profile::PerfHardwareEvent::INSTRUCTIONS.into(),
+        ),
+        (
+            "cycles".to_string(),
+            tracing_profile::PerfHardwareEvent::CPU_CYCLES.into(),
+        ),
+    ])
+    .unwrap();
+    bench_layer(
+        c,
+        "perf_counters",
+        Dispatch::new(tracing_subscriber::registry().with(layer)),
+    );
+}
+
+#[cfg(not(feature = "perf_counters"))]
+fn bench_perf_counters(_c: &mut Criterion) {}
+
+#[cfg(feature = "ittapi")]
+fn bench_ittapi(c: &mut Criterion) {
+    bench_layer(
+        c,
+        "ittapi",
+        Dispatch::new(tracing_subscriber::registry().with(tracing_profile::IttApiLayer::new())),
+    );
+}
+
+#[cfg(not(feature = "ittapi"))]
+fn bench_ittapi(_c: &mut Criterion) {}
+
+criterion_group!(
+    benches,
+    bench_graph,
+    bench_perfetto,
+    bench_perf_counters,
+    bench_ittapi
+);
+criterion_main!(benches);
@@ -0,0 +1,190 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Cost of the FFI entry points per event. The disabled benchmarks run before tracing starts,
+//! the other ones with an in-process session writing into a temporary file.
+
+use std::{
+    hint::black_box,
+    sync::Barrier,
+    thread,
+    time::{Duration, Instant},
+};
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion};
+use tracing_profile_perfetto_sys::{
+    create_instant_event, is_category_enabled, set_counter_f64, set_counter_u64, BackendConfig,
+    CounterHandle, EventData, PerfettoGuard, ProducerConfig, TraceCompression, TraceEvent,
+};
+
+const KEYS: [&str; 16] = [
+    "arg0", "arg1", "arg2", "arg3", "arg4", "arg5", "arg6", "arg7", "arg8", "arg9", "arg10",
+    "arg11", "arg12", "arg13", "arg14", "arg15",
+];
+const ARG_COUNTS: [usize; 3] = [0, 4, 16];
+const THREAD_COUNTS: [usize; 4] = [1, 2, 4, 8];
+
+#[derive(Debug, Clone, Copy)]
+enum ArgKind {
+    U64,
+    I64,
+    F64,
+    Bool,
+    String,
+    Debug,
+}
+
+const ARG_KINDS: [ArgKind; 6] = [
+    ArgKind::U64,
+    ArgKind::I64,
+    ArgKind::F64,
+    ArgKind::Bool,
+    ArgKind::String,
+    ArgKind::Debug,
+];
+
+fn event_data(kind: ArgKind, arg_count: usize) -> EventData {
+    let mut event_data = EventData::new_interned("bench event");
+    for (index, key) in KEYS.iter().take(arg_count).enumerate() {
+        match kind {
+            ArgKind::U64 => event_data.add_u64_field(key, index as u64),
+            ArgKind::I64 => event_data.add_i64_field(key, -(index as i64)),
+            ArgKind::F64 => event_data.add_f64_field(key, index as f64),
+            ArgKind::Bool => event_data.add_bool_field(key, index % 2 == 0),
+            ArgKind::String => event_data.add_string_arg(key, "some string value"),
+            ArgKind::Debug => event_data.add_debug_arg(key, &(index, "value")),
+        }
+    }
+    event_data
+}
+
+fn start_tracing() -> (PerfettoGuard, tempfile::TempDir) {
+    let dir = tempfile::tempdir().expect("failed to create a temporary directory");
+    let path = dir.path().join("bench.perfetto-trace");
+    let guard = PerfettoGuard::new(
+        BackendConfig::InProcess {
+            buffer_size_kb: 64 * 1024,
+            // keeps the buffer from filling up during the long runs
+            file_write_period_ms: Some(1000),
+            ring_buffer: false,
+            compression: TraceCompression::None,
+            flush_period_ms: Some(2000),
+            category_buffers: Vec::new(),
+            producer: ProducerConfig {
+                shmem_size_hint_kb: 4096,
+                shmem_page_size_hint_kb: 0,
+            },
+            thread_time: false,
+            rotation: None,
+        },
+        path.to_str().expect("invalid temporary path"),
+    )
+    .expect("failed to start tracing");
+
+    (guard, dir)
+}
+
+/// Run `f` `iters` times on each of `threads` threads at once, returns the wall time.
+fn run_contended(threads: usize, iters: u64, f: impl Fn() + Sync) -> Duration {
+    let barrier = Barrier::new(threads + 1);
+    thread::scope(|scope| {
+        for _ in 0..threads {
+            scope.spawn(|| {
+                barrier.wait();
+                for _ in 0..iters {
+                    f();
+                }
+                barrier.wait();
+            });
+        }
+
+        barrier.wait();
+        let start = Instant::now();
+        barrier.wait();
+        start.elapsed()
+    })
+}
+
+fn bench_disabled(c: &mut Criterion) {
+    let mut group = c.benchmark_group("disabled");
+    group.bench_function("is_category_enabled", |b| {
+        b.iter(|| is_category_enabled(black_box(Some("bench"))))
+    });
+    group.bench_function("span", |b| {
+        b.iter(|| drop(TraceEvent::new(event_data(ArgKind::U64, 4))))
+    });
+    group.bench_function("instant", |b| {
+        b.iter(|| create_instant_event(event_data(ArgKind::U64, 4)))
+    });
+    group.finish();
+}
+
+fn bench_enabled(c: &mut Criterion) {
+    let (_guard, _dir) = start_tracing();
+
+    let mut group = c.benchmark_group("span");
+    for kind in ARG_KINDS {
+        for arg_count in ARG_COUNTS {
+            group.bench_with_input(
+                BenchmarkId::new(format!("{kind:?}"), arg_count),
+                &arg_count,
+                |b, &arg_count| b.iter(|| drop(TraceEvent::new(event_data(kind, arg_count)))),
+            );
+        }
+    }
+    group.bench_function("dynamic name", |b| {
+        b.iter(|| drop(TraceEvent::new(EventData::new(black_box("bench event")))))
+    });
+    group.bench_function("dynamic category", |b| {
+        b.iter(|| {
+            let mut event_data = EventData::new_interned("bench event");
+            event_data.set_category(black_box("bench"));
+            drop(TraceEvent::new(event_data))
+        })
+    });
+    group.finish();
+
+    let mut group = c.benchmark_group("instant");
+    for arg_count in ARG_COUNTS {
+        group.bench_with_input(
+            BenchmarkId::from_parameter(arg_count),
+            &arg_count,
+            |b, &arg_count| b.iter(|| create_instant_event(event_data(ArgKind::U64, arg_count))),
+        );
+    }
+    group.finish();
+
+    let mut group = c.benchmark_group("counter");
+    group.bench_function("update_counter_u64", |b| {
+        b.iter(|| set_counter_u64("bench counter", None, false, black_box(1)))
+    });
+    group.bench_function("update_counter_f64", |b| {
+        b.iter(|| set_counter_f64("bench counter f64", None, false, black_box(1.0)))
+    });
+    let counter = CounterHandle::new(None, "bench registered counter", None, false);
+    group.bench_function("registered u64", |b| {
+        b.iter(|| counter.set_u64(black_box(1)))
+    });
+    group.bench_function("registered f64", |b| {
+        b.iter(|| counter.set_f64(black_box(1.0)))
+    });
+    group.finish();
+
+    let mut group = c.benchmark_group("contended span");
+    for threads in THREAD_COUNTS {
+        group.bench_with_input(
+            BenchmarkId::from_parameter(threads),
+            &threads,
+            |b, &threads| {
+                b.iter_custom(|iters| {
+                    run_contended(threads, iters, || {
+                        drop(TraceEvent::new(event_data(ArgKind::U64, 4)))
+                    })
+                })
+            },
+        );
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_disabled, bench_enabled);
+criterion_main!(benches);
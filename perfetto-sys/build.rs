@@ -1,5 +1,92 @@
 // Copyright 2024-2025 Irreducible Inc.
 
+use std::{
+    env, fs,
+    path::{Path, PathBuf},
+    process::Command,
+};
+
+/// Always the first static category, the handle `0` refers to it.
+const DEFAULT_CATEGORY: &str = "default";
+const DEFAULT_CATEGORY_DESCRIPTION: &str = "Default category for the case when not specified.";
+
+/// Collect the static categories from the environment of the build.
+/// A crate depending on us can set the variables in the `[env]` section of its `.cargo/config.toml`:
+/// - `PERFETTO_CATEGORIES`: comma-separated list of category names.
+/// - `PERFETTO_CATEGORIES_FILE`: path to a file with one category name per line. Empty lines and
+///   lines starting with `#` are ignored.
+fn static_categories() -> Vec<String> {
+    println!("cargo::rerun-if-env-changed=PERFETTO_CATEGORIES");
+    println!("cargo::rerun-if-env-changed=PERFETTO_CATEGORIES_FILE");
+
+    let mut names = Vec::new();
+    if let Ok(list) = env::var("PERFETTO_CATEGORIES") {
+        names.extend(list.split(',').map(|name| name.trim().to_string()));
+    }
+    if let Ok(path) = env::var("PERFETTO_CATEGORIES_FILE") {
+        println!("cargo::rerun-if-changed={path}");
+        let content = fs::read_to_string(&path)
+            .unwrap_or_else(|e| panic!("failed to read PERFETTO_CATEGORIES_FILE '{path}': {e}"));
+        names.extend(
+            content
+                .lines()
+                .map(str::trim)
+                .filter(|line| !line.starts_with('#'))
+                .map(str::to_string),
+        );
+    }
+
+    let mut categories = vec![DEFAULT_CATEGORY.to_string()];
+    for name in names.into_iter().filter(|name| !name.is_empty()) {
+        assert!(
+            name.chars()
+                .all(|c| c.is_ascii_graphic() && c != '"' && c != '\\' && c != ','),
+            "invalid perfetto category name: '{name}'"
+        );
+        if !categories.contains(&name) {
+            categories.push(name);
+        }
+    }
+
+    categories
+}
+
+/// Generate the header with the static categories for `trace_categories.h` and `wrapper.cc`.
+fn write_categories_header(categories: &[String]) -> PathBuf {
+    let definitions = categories
+        .iter()
+        .map(|name| match name.as_str() {
+            DEFAULT_CATEGORY => format!(
+                "\tperfetto::Category(\"{name}\").SetDescription(\"{DEFAULT_CATEGORY_DESCRIPTION}\")"
+            ),
+            _ => format!("\tperfetto::Category(\"{name}\")"),
+        })
+        .collect::<Vec<_>>()
+        .join(", \\\n");
+    let cases = categories
+        .iter()
+        .enumerate()
+        .map(|(index, name)| format!("\tX({index}, \"{name}\", __VA_ARGS__)"))
+        .collect::<Vec<_>>()
+        .join(" \\\n");
+
+    let header = format!(
+        "// Generated by build.rs from PERFETTO_CATEGORIES and PERFETTO_CATEGORIES_FILE.\n\
+         #pragma once\n\n\
+         #define WRAPPER_STATIC_CATEGORY_COUNT {count}\n\n\
+         #define WRAPPER_STATIC_CATEGORY_DEFINITIONS \\\n{definitions}\n\n\
+         // X(index, name, ...) for each static category\n\
+         #define WRAPPER_STATIC_CATEGORIES(X, ...) \\\n{cases}\n",
+        count = categories.len(),
+    );
+
+    let out_dir = PathBuf::from(env::var("OUT_DIR").expect("OUT_DIR is not set"));
+    fs::write(out_dir.join("generated_categories.h"), header)
+        .expect("failed to write generated_categories.h");
+
+    out_dir
+}
+
 //https://android.googlesource.com/platform/external/perfetto/+/refs/tags/android-14.0.0_r50/examples/sdk/
 //https://perfetto.dev/docs/instrumentation/tracing-sdk
 fn main() {
@@ -15,20 +102,127 @@ fn main() {
     println!("cargo::rerun-if-changed=build.rs");
     println!("cargo::rerun-if-changed=cpp");
 
-    cc::Build::new()
-        .cpp(true)
-        .opt_level(
-            std::env::var("CARGO_OPT_LEVEL")
-                .unwrap_or_else(|_| "2".to_string())
-                .parse()
-                .unwrap(),
-        )
-        .flag("-std=c++20")
+    let generated_dir = write_categories_header(&static_categories());
+    let opt_level: u32 = env::var("CARGO_OPT_LEVEL")
+        .unwrap_or_else(|_| "2".to_string())
+        .parse()
+        .unwrap();
+    let lto = lto_enabled();
+
+    let mut wrapper = cpp_build(opt_level, lto);
+    wrapper
         .file("cpp/wrapper.cc")
         .file("cpp/trace_categories.cc")
-        // TODO: extract perfetto to a static library
-        .file("cpp/perfetto/sdk/perfetto.cc")
-        .include("cpp")
-        .include("cpp/perfetto/sdk")
+        .include(generated_dir)
         .compile("perfettoWrapper");
+
+    // after the wrapper, which depends on it
+    match prebuilt_perfetto_dir() {
+        Some(lib_dir) => {
+            println!("cargo::rustc-link-search=native={}", lib_dir.display());
+            println!("cargo::rustc-link-lib=static=perfetto");
+        }
+        None => build_perfetto_sdk(opt_level, lto),
+    }
+
+    // used by wrapper.cc for the trace compression
+    println!("cargo::rustc-link-lib=z");
+}
+
+/// `PERFETTO_SYS_LTO` compiles the C++ code to LLVM bitcode for the cross-language thin LTO,
+/// so that the small wrapper functions can be inlined into the Rust callers. It requires clang
+/// matching the LLVM version of rustc and the `-Clinker-plugin-lto` rustc flag, see README.md.
+fn lto_enabled() -> bool {
+    println!("cargo::rerun-if-env-changed=PERFETTO_SYS_LTO");
+    env::var("PERFETTO_SYS_LTO").is_ok_and(|value| value != "0")
+}
+
+/// `PERFETTO_LIB_DIR` is a directory with a prebuilt `libperfetto.a` of the same SDK version as
+/// `cpp/perfetto/sdk`, which is then linked instead of compiling the SDK.
+fn prebuilt_perfetto_dir() -> Option<PathBuf> {
+    println!("cargo::rerun-if-env-changed=PERFETTO_LIB_DIR");
+    let lib_dir = PathBuf::from(env::var_os("PERFETTO_LIB_DIR")?);
+    assert!(
+        lib_dir.join("libperfetto.a").is_file(),
+        "PERFETTO_LIB_DIR '{}' doesn't contain libperfetto.a",
+        lib_dir.display()
+    );
+    Some(lib_dir)
+}
+
+fn cpp_build(opt_level: u32, lto: bool) -> cc::Build {
+    let mut build = cc::Build::new();
+    build
+        .cpp(true)
+        .opt_level(opt_level)
+        .flag("-std=c++20")
+        .include("cpp")
+        .include("cpp/perfetto/sdk");
+    if lto {
+        if env::var_os("CXX").is_none() {
+            build.compiler("clang++");
+        }
+        build.flag("-flto=thin");
+    }
+    build
+}
+
+/// Compile the SDK amalgamation into `libperfetto.a`. It is the slowest part of the build by far
+/// and rarely changes, so the library is kept in `OUT_DIR` and only rebuilt when the SDK sources
+/// are newer or the compilation has changed, see `compilation_stamp`.
+fn build_perfetto_sdk(opt_level: u32, lto: bool) {
+    const SDK_SOURCES: [&str; 2] = [
+        "cpp/perfetto/sdk/perfetto.cc",
+        "cpp/perfetto/sdk/perfetto.h",
+    ];
+
+    let out_dir = PathBuf::from(env::var("OUT_DIR").expect("OUT_DIR is not set"));
+    let library = out_dir.join("libperfetto.a");
+    let stamp = out_dir.join("libperfetto.stamp");
+    let build = cpp_build(opt_level, lto);
+    let compilation = compilation_stamp(&build, opt_level, lto);
+    let modified = |path: &Path| {
+        fs::metadata(path)
+            .and_then(|metadata| metadata.modified())
+            .ok()
+    };
+
+    let up_to_date = modified(&library).is_some_and(|built| {
+        SDK_SOURCES
+            .iter()
+            .all(|source| modified(Path::new(source)).is_some_and(|changed| changed <= built))
+    }) && fs::read_to_string(&stamp).is_ok_and(|built| built == compilation);
+
+    if up_to_date {
+        println!("cargo::rustc-link-search=native={}", out_dir.display());
+        println!("cargo::rustc-link-lib=static=perfetto");
+        return;
+    }
+
+    build
+        .clone()
+        .file("cpp/perfetto/sdk/perfetto.cc")
+        .compile("perfetto");
+    fs::write(&stamp, compilation).expect("failed to write the stamp of libperfetto");
+}
+
+/// Description of how the SDK is compiled: the compiler with its version, the flags, including
+/// the ones of `CXXFLAGS`, the optimization level and the LTO mode.
+fn compilation_stamp(build: &cc::Build, opt_level: u32, lto: bool) -> String {
+    let compiler = build.get_compiler();
+    let version = Command::new(compiler.path())
+        .arg("--version")
+        .output()
+        .map(|output| {
+            let version = String::from_utf8_lossy(&output.stdout);
+            version.lines().next().unwrap_or_default().to_string()
+        })
+        .unwrap_or_default();
+
+    format!(
+        "compiler: {}\nversion: {}\nflags: {:?}\nopt-level: {opt_level}\nlto: {lto}\n",
+        compiler.path().display(),
+        version,
+        compiler.args(),
+    )
 }
@@ -0,0 +1,170 @@
+// Copyright 2025 Irreducible Inc.
+
+// Microbenchmark of the wrapper alone, without the Rust bindings. Build it from
+// the perfetto-sys directory with the categories header generated by build.rs:
+//
+//   c++ -std=c++20 -O2 -Icpp -Icpp/perfetto/sdk -I$OUT_DIR -o wrapper_bench
+//       cpp/bench/wrapper_bench.cc cpp/wrapper.cc cpp/trace_categories.cc
+//       cpp/perfetto/sdk/perfetto.cc -lz -lpthread
+//
+// where $OUT_DIR is the build script output directory of perfetto-sys, e.g.
+// target/release/build/tracing-profile-perfetto-sys-*/out. Prints the time per
+// call in nanoseconds.
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "perfetto/sdk/perfetto.h"
+#include "wrapper.h"
+
+namespace {
+
+constexpr size_t kIterations = 1'000'000;
+
+const char* const kKeys[] = {
+	"arg0", "arg1", "arg2", "arg3", "arg4", "arg5", "arg6", "arg7",
+	"arg8", "arg9", "arg10", "arg11", "arg12", "arg13", "arg14", "arg15",
+};
+
+template <typename F>
+double ns_per_call(F&& f) {
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < kIterations; ++i) {
+		f(i);
+	}
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / kIterations;
+}
+
+template <typename F>
+void report(const char* name, F&& f) {
+	std::printf("%-40s %8.1f ns\n", name, ns_per_call(f));
+}
+
+std::vector<PerfettoEventArg> make_args(ArgType type, size_t count) {
+	static const char kString[] = "some string value";
+	std::vector<PerfettoEventArg> args;
+	for (size_t i = 0; i < count; ++i) {
+		PerfettoEventArg arg{.data = {.u64 = 0}, .type = type};
+		switch (type) {
+			case ArgType::U64KeyValue:
+				arg.data.u64_key_value = {kKeys[i], i};
+				break;
+			case ArgType::I64KeyValue:
+				arg.data.i64_key_value = {kKeys[i], -static_cast<int64_t>(i)};
+				break;
+			case ArgType::F64KeyValue:
+				arg.data.f64_key_value = {kKeys[i], static_cast<double>(i)};
+				break;
+			case ArgType::BoolKeyValue:
+				arg.data.bool_key_value = {kKeys[i], i % 2 == 0};
+				break;
+			case ArgType::StringKeyValue:
+				arg.data.string_key_value = {kKeys[i], kString};
+				break;
+			case ArgType::StringViewKeyValue:
+				arg.data.string_view_key_value = {kKeys[i], {kString, sizeof(kString) - 1}};
+				break;
+			case ArgType::FlowID:
+				break;
+		}
+		args.push_back(arg);
+	}
+	return args;
+}
+
+void bench_spans(const char* label, uint64_t category, uint64_t name) {
+	const std::pair<const char*, ArgType> types[] = {
+		{"u64", ArgType::U64KeyValue},
+		{"i64", ArgType::I64KeyValue},
+		{"f64", ArgType::F64KeyValue},
+		{"bool", ArgType::BoolKeyValue},
+		{"string", ArgType::StringKeyValue},
+		{"string view", ArgType::StringViewKeyValue},
+	};
+	for (const auto& [type_name, type]: types) {
+		for (size_t count: {0, 4, 16}) {
+			const auto args = make_args(type, count);
+			char bench_name[64];
+			std::snprintf(bench_name, sizeof(bench_name), "%s span %zu %s args", label, count, type_name);
+			report(bench_name, [&](size_t) {
+				create_event_interned(EventType::Span, category, name, nullptr, args.data(), args.size());
+				destroy_event_interned(category, nullptr);
+			});
+		}
+	}
+}
+
+void bench_contended(uint64_t category, uint64_t name) {
+	for (size_t thread_count: {1, 2, 4, 8}) {
+		const auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < thread_count; ++t) {
+			threads.emplace_back([&] {
+				for (size_t i = 0; i < kIterations; ++i) {
+					create_event_interned(EventType::Span, category, name, nullptr, nullptr, 0);
+					destroy_event_interned(category, nullptr);
+				}
+			});
+		}
+		for (auto& thread: threads) {
+			thread.join();
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - start;
+		std::printf("contended span, %zu threads %19.1f ns\n", thread_count,
+			    std::chrono::duration<double, std::nano>(elapsed).count() / kIterations);
+	}
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	const char* output_file = argc > 1 ? argv[1] : "wrapper_bench.perfetto-trace";
+
+	const uint64_t category = register_category(nullptr);
+	const uint64_t dynamic_category = register_category("bench");
+	const uint64_t name = register_event_name("bench event");
+
+	// before tracing starts every category is disabled
+	bench_spans("disabled", category, name);
+
+	const ProducerConfig producer{.shmem_size_hint_kb = 4096, .shmem_page_size_hint_kb = 0};
+	const InProcessConfig config{
+		.buffer_size_kb = 64 * 1024,
+		.file_write_period_ms = 1000,
+		.ring_buffer = false,
+		.compression = TraceCompression::None,
+		.flush_period_ms = 2000,
+		.category_buffers = nullptr,
+		.category_buffer_count = 0,
+		.thread_time = false,
+		.incremental_state_clear_period_ms = 0,
+	};
+	void* guard = init_perfetto(static_cast<uint32_t>(perfetto::BackendType::kInProcessBackend), output_file, &producer, &config, nullptr);
+
+	bench_spans("static category", category, name);
+	bench_spans("dynamic category", dynamic_category, name);
+	report("span with a dynamic name", [&](size_t) {
+		create_event(EventType::Span, nullptr, "bench event", nullptr, nullptr, 0);
+		destroy_event(nullptr, nullptr);
+	});
+	report("instant", [&](size_t) {
+		create_event_interned(EventType::Instant, category, name, nullptr, nullptr, 0);
+	});
+	report("update_counter_u64", [&](size_t i) {
+		update_counter_u64(nullptr, "bench counter", nullptr, false, i);
+	});
+	report("update_counter_f64", [&](size_t i) {
+		update_counter_f64(nullptr, "bench counter f64", nullptr, false, static_cast<double>(i));
+	});
+	const uint64_t counter = register_counter(nullptr, "bench registered counter", nullptr, false);
+	report("update_registered_counter_u64", [&](size_t i) {
+		update_registered_counter_u64(counter, i);
+	});
+	bench_contended(category, name);
+
+	deinit_perfetto(guard, 5000, nullptr);
+	return 0;
+}
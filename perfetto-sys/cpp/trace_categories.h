@@ -4,8 +4,9 @@
 
 #include "perfetto/sdk/perfetto.h"
 
+// generated by build.rs, see `PERFETTO_CATEGORIES` and `PERFETTO_CATEGORIES_FILE`
+#include "generated_categories.h"
+
 PERFETTO_DEFINE_CATEGORIES(
-    perfetto::Category("default").SetDescription("Default category fo the case when not specified.")
+    WRAPPER_STATIC_CATEGORY_DEFINITIONS
 );
-
-
@@ -3,10 +3,22 @@
 #include "wrapper.h"
 
 #include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <condition_variable>
+#include <cstring>
 #include <fstream>
+#include <mutex>
 #include <span>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include "trace_categories.h"
 
@@ -16,8 +28,266 @@
 struct TracingSessionGuard {
 	// ensure the constructor of the derived class is called
 	virtual ~TracingSessionGuard() {}
+
+	// flushes the trace data and stops tracing. returns false if the flush
+	// has not completed within `flush_timeout_ms`. the remaining data is
+	// written into `output_file` if it is not null, `written` is set to
+	// false if writing the trace has failed. called once before the
+	// destruction.
+	virtual bool stop(uint32_t flush_timeout_ms, const char* output_file, bool& written) = 0;
+
+	// writes the current trace data into `output_file`, returns false if not
+	// supported by the session
+	virtual bool snapshot(const char* output_file) {
+		(void)output_file;
+		return false;
+	}
+
+	// fills `stats` with the statistics of the session, returns false if
+	// not supported by the session
+	virtual bool stats(PerfettoStats& stats) {
+		(void)stats;
+		return false;
+	}
+};
+
+namespace {
+
+// trace output file, compressed as it is written
+class TraceFileWriter {
+public:
+	TraceFileWriter(const char* path, const TraceCompression compression) {
+		if (compression == TraceCompression::Gzip) {
+			gz_file = gzopen(path, "wb");
+		} else {
+			file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+		}
+	}
+	~TraceFileWriter() { close(); }
+
+	bool write(const char* data, size_t size) {
+		if (!gz_file) {
+			file.write(data, size);
+			return !file.fail();
+		}
+
+		// gzwrite takes the size as unsigned int
+		while (size > 0) {
+			const auto chunk = std::min<size_t>(size, 1 << 30);
+			if (gzwrite(gz_file, data, static_cast<unsigned>(chunk)) != static_cast<int>(chunk)) {
+				return false;
+			}
+			data += chunk;
+			size -= chunk;
+		}
+		return true;
+	}
+
+	bool close() {
+		if (!gz_file) {
+			file.close();
+			return !file.fail();
+		}
+
+		const auto result = gzclose(gz_file);
+		gz_file = nullptr;
+		return result == Z_OK;
+	}
+
+private:
+	std::ofstream file;
+	gzFile gz_file = nullptr;
+};
+
+// writes the data in trace buffer chunk by chunk, without copying the whole
+// trace into memory first
+bool write_trace(perfetto::TracingSession& session, const char* output_file, const TraceCompression compression) {
+	TraceFileWriter writer(output_file, compression);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	bool success = true;
+	session.ReadTrace([&](perfetto::TracingSession::ReadTraceCallbackArgs args) {
+		success = writer.write(args.data, args.size) && success;
+		if (!args.has_more) {
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+			cv.notify_one();
+		}
+	});
+
+	std::unique_lock<std::mutex> lock(mutex);
+	cv.wait(lock, [&] { return done; });
+	return writer.close() && success;
+}
+
+// pipe the tracing service streams the trace into. a thread compresses the
+// data into the output file as it arrives.
+class CompressingPipe {
+public:
+	CompressingPipe(const char* output_file, const TraceCompression compression) : writer(output_file, compression) {
+		if (pipe(fds) != 0) {
+			fds[0] = fds[1] = -1;
+			return;
+		}
+
+		thread = std::thread([this] {
+			char buffer[64 * 1024];
+			while (true) {
+				const auto size = read(fds[0], buffer, sizeof(buffer));
+				if (size < 0 && errno == EINTR) {
+					continue;
+				}
+				if (size <= 0) {
+					break;
+				}
+				// the rest of the data is still read, so that the
+				// service doesn't block on the pipe
+				if (!failed && !writer.write(buffer, size)) {
+					failed = true;
+				}
+			}
+			if (!writer.close()) {
+				failed = true;
+			}
+		});
+	}
+
+	// the write end of the pipe, -1 if the pipe could not be created
+	int write_fd() const { return fds[1]; }
+
+	// waits until all the data is written, returns false if writing it has
+	// failed. the tracing service must have closed its copy of the write end.
+	bool finish() {
+		if (fds[1] < 0) {
+			return !failed;
+		}
+
+		close(fds[1]);
+		fds[1] = -1;
+		thread.join();
+		close(fds[0]);
+		return !failed;
+	}
+
+	~CompressingPipe() { finish(); }
+
+private:
+	TraceFileWriter writer;
+	int fds[2];
+	std::thread thread;
+	// set by the thread, read after it is joined
+	bool failed = false;
+};
+
+perfetto::TracingInitArgs init_args(const perfetto::BackendType backend, const ProducerConfig& producer) {
+	perfetto::TracingInitArgs args;
+	args.backends = backend;
+	args.enable_system_consumer = false;
+	// 0 keeps the defaults of the SDK
+	args.shmem_size_hint_kb = producer.shmem_size_hint_kb;
+	args.shmem_page_size_hint_kb = producer.shmem_page_size_hint_kb;
+	return args;
+}
+
+// queries and decodes the statistics of `session` from the tracing service
+bool read_stats(perfetto::TracingSession& session, PerfettoStats& stats) {
+	const auto result = session.GetTraceStatsBlocking();
+	perfetto::protos::gen::TraceStats trace_stats;
+	if (!result.success || !trace_stats.ParseFromArray(result.trace_stats_data.data(), result.trace_stats_data.size())) {
+		return false;
+	}
+
+	stats = {};
+	stats.chunks_discarded = trace_stats.chunks_discarded();
+	stats.patches_discarded = trace_stats.patches_discarded();
+	stats.flushes_succeeded = trace_stats.flushes_succeeded();
+	stats.flushes_failed = trace_stats.flushes_failed();
+	stats.buffer_count = std::min(trace_stats.buffer_stats().size(), kPerfettoStatsMaxBuffers);
+	for (size_t i = 0; i < stats.buffer_count; ++i) {
+		const auto& buffer = trace_stats.buffer_stats()[i];
+		stats.buffers[i] = PerfettoBufferStats{
+			.buffer_size = buffer.buffer_size(),
+			.bytes_written = buffer.bytes_written(),
+			.bytes_overwritten = buffer.bytes_overwritten(),
+			.bytes_read = buffer.bytes_read(),
+			.chunks_written = buffer.chunks_written(),
+			.chunks_discarded = buffer.chunks_discarded(),
+			.chunks_overwritten = buffer.chunks_overwritten(),
+			.trace_writer_packet_loss = buffer.trace_writer_packet_loss(),
+		};
+	}
+	return true;
+}
+
+} // namespace
+
+namespace {
+
+// one flag per static category and a last one set while any session is
+// running, see `enabled_category_flags`
+std::atomic<uint8_t> g_enabled_flags[WRAPPER_STATIC_CATEGORY_COUNT + 1];
+
+// keeps `g_enabled_flags` in sync with the track event sessions. the flags of
+// a stopping session are only cleared once no session is left, until then
+// they may stay set, which is harmless: the SDK checks the categories anyway.
+class EnabledFlagsObserver : public perfetto::TrackEventSessionObserver {
+public:
+	void OnStart(const perfetto::DataSourceBase::StartArgs &) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		++active_instances;
+		update();
+		notify();
+	}
+	void OnStop(const perfetto::DataSourceBase::StopArgs &) override {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--active_instances == 0) {
+			for (auto& flag: g_enabled_flags) {
+				flag.store(0, std::memory_order_relaxed);
+			}
+		} else {
+			update();
+		}
+		notify();
+	}
+
+	void set_callback(void (*callback)()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		on_change = callback;
+	}
+
+private:
+	void update() {
+#define WRAPPER_UPDATE_ENABLED_FLAG(index, name, ...) \
+	g_enabled_flags[index].store(TRACE_EVENT_CATEGORY_ENABLED(name), std::memory_order_relaxed);
+		WRAPPER_STATIC_CATEGORIES(WRAPPER_UPDATE_ENABLED_FLAG)
+#undef WRAPPER_UPDATE_ENABLED_FLAG
+		g_enabled_flags[WRAPPER_STATIC_CATEGORY_COUNT].store(1, std::memory_order_relaxed);
+	}
+	void notify() {
+		if (on_change) {
+			on_change();
+		}
+	}
+
+	std::mutex mutex;
+	size_t active_instances = 0;
+	void (*on_change)() = nullptr;
 };
 
+EnabledFlagsObserver& enabled_flags_observer() {
+	// registered once and never removed, the SDK keeps the pointer
+	static auto* observer = [] {
+		auto* observer = new EnabledFlagsObserver();
+		perfetto::TrackEvent::AddSessionObserver(observer);
+		return observer;
+	}();
+	return *observer;
+}
+
+} // namespace
+
 // ensures the program blocks until a connection is established with the traced
 // service. basically copied from here:
 // https://android.googlesource.com/platform/external/perfetto/+/sdk-release/examples/sdk/example_system_wide.cc
@@ -31,11 +301,19 @@ public:
 		std::unique_lock<std::mutex> lock(mutex);
 		cv.notify_one();
 	}
-	void WaitForTracingStart() {
+	// returns false if tracing has not started within `timeout_ms`, 0
+	// waits indefinitely
+	bool WaitForTracingStart(uint32_t timeout_ms) {
 		PERFETTO_LOG("Waiting for tracing to start...");
 		std::unique_lock<std::mutex> lock(mutex);
-		cv.wait(lock, [] { return perfetto::TrackEvent::IsEnabled(); });
+		const auto started = [] { return perfetto::TrackEvent::IsEnabled(); };
+		if (timeout_ms == 0) {
+			cv.wait(lock, started);
+		} else if (!cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), started)) {
+			return false;
+		}
 		PERFETTO_LOG("Tracing started");
+		return true;
 	}
 
 private:
@@ -45,183 +323,592 @@ private:
 
 // used to create a fused system wide trace
 struct SdkTracingSession : TracingSessionGuard {
-	SdkTracingSession() {
-		perfetto::TracingInitArgs args;
-		args.backends = perfetto::BackendType::kSystemBackend;
-		args.enable_system_consumer = false;
-		perfetto::Tracing::Initialize(args);
+	SdkTracingSession(const ProducerConfig& producer, const SystemConfig& config) {
+		perfetto::Tracing::Initialize(init_args(perfetto::BackendType::kSystemBackend, producer));
 		perfetto::TrackEvent::Register();
+		enabled_flags_observer();
+
+		if (config.startup_tracing) {
+			// the data source starts locally right away, the session
+			// of the perfetto command adopts it once it connects
+			perfetto::TraceConfig cfg;
+			cfg.add_buffers()->set_size_kb(1024);
+			auto *ds_cfg = cfg.add_data_sources()->mutable_config();
+			ds_cfg->set_name("track_event");
+			ds_cfg->set_track_event_config_raw(
+			    perfetto::protos::gen::TrackEventConfig().SerializeAsString());
+
+			perfetto::Tracing::SetupStartupTracingOpts opts;
+			opts.backend = perfetto::BackendType::kSystemBackend;
+			if (config.start_timeout_ms != 0) {
+				opts.timeout_ms = config.start_timeout_ms;
+			}
+			this->startup_session = perfetto::Tracing::SetupStartupTracingBlocking(cfg, opts);
+			return;
+		}
 
 		SessionObserver sessionObserver;
-		sessionObserver.WaitForTracingStart();
+		if (!sessionObserver.WaitForTracingStart(config.start_timeout_ms)) {
+			PERFETTO_ELOG("tracing has not started in %u ms, the events are dropped until it starts", config.start_timeout_ms);
+		}
 	}
 	~SdkTracingSession() override {
-		perfetto::TrackEvent::Flush();
 		perfetto::Tracing::Shutdown();
 	}
+
+	// the session is owned by the perfetto process, which collects the data
+	// of all producers when it stops. it has already stopped here, the data of
+	// the stopping thread is committed by `commit_thread_trace_data` before.
+	// nothing is measured, see `deinit_perfetto`.
+	bool stop(uint32_t flush_timeout_ms, const char* output_file, bool& written) override {
+		(void)flush_timeout_ms;
+		(void)output_file;
+		written = true;
+		return true;
+	}
+
+private:
+	// set with startup tracing, the local session waiting to be adopted
+	std::unique_ptr<perfetto::StartupTracingSession> startup_session;
 };
 
 // used for in-process monitoring
 struct ApiTracingSession : TracingSessionGuard {
-	ApiTracingSession(std::string output_file, const size_t buffer_size_kb) : output_file(std::move(output_file)) {
-		perfetto::TracingInitArgs args;
-		args.backends = perfetto::BackendType::kInProcessBackend;
-		args.enable_system_consumer = false;
-		// defaults to 256
-		args.shmem_size_hint_kb = 4096;
-		perfetto::Tracing::Initialize(args);
+	ApiTracingSession(std::string output_file, const ProducerConfig& producer, const InProcessConfig& config) : output_file(std::move(output_file)), compression(config.compression) {
+		perfetto::Tracing::Initialize(init_args(perfetto::BackendType::kInProcessBackend, producer));
 		perfetto::TrackEvent::Register();
-
-		// by default all non debug categories are enabled in
-		// TrackEventConfig
-		perfetto::protos::gen::TrackEventConfig track_event_cfg;
+		enabled_flags_observer();
 
 		// https://perfetto.dev/docs/reference/trace-config-proto
 		perfetto::TraceConfig cfg;
 		// https://perfetto.dev/docs/concepts/buffers
-		// this is probably larger than needed but the space is
-		// available
-		cfg.add_buffers()->set_size_kb(buffer_size_kb);
+		const auto add_buffer = [&](size_t size_kb) {
+			auto* buffer = cfg.add_buffers();
+			buffer->set_size_kb(size_kb);
+			if (config.ring_buffer) {
+				buffer->set_fill_policy(perfetto::TraceConfig::BufferConfig::RING_BUFFER);
+			}
+		};
+		if (config.incremental_state_clear_period_ms != 0) {
+			// every snapshot starts without the interned data of the
+			// previous ones, re-emit it regularly
+			cfg.mutable_incremental_state_config()->set_clear_period_ms(config.incremental_state_clear_period_ms);
+		} else if (config.ring_buffer) {
+			// the oldest packets get overwritten together with the
+			// interned data they depend on. re-emit the incremental
+			// state regularly so that a snapshot can be decoded.
+			cfg.mutable_incremental_state_config()->set_clear_period_ms(1000);
+		}
 
 		// tells how often the producer should send data to the tracing
 		// service
-		cfg.set_flush_period_ms(2000);
+		if (config.flush_period_ms != 0) {
+			cfg.set_flush_period_ms(config.flush_period_ms);
+		}
+
+		// one track event data source per buffer. by default all non
+		// debug categories are enabled in TrackEventConfig, the main
+		// buffer gets all but the categories of the other buffers.
+		const auto add_data_source = [&](perfetto::protos::gen::TrackEventConfig track_event_cfg, uint32_t target_buffer) {
+			if (config.thread_time) {
+				track_event_cfg.set_enable_thread_time_sampling(true);
+			}
+			auto *ds_cfg = cfg.add_data_sources()->mutable_config();
+			ds_cfg->set_name("track_event");
+			ds_cfg->set_target_buffer(target_buffer);
+			ds_cfg->set_track_event_config_raw(
+			    track_event_cfg.SerializeAsString());
+		};
+
+		add_buffer(config.buffer_size_kb);
+		perfetto::protos::gen::TrackEventConfig main_cfg;
+		uint32_t target_buffer = 1;
+		for (const auto& category_buffer: std::span{config.category_buffers, config.category_buffer_count}) {
+			perfetto::protos::gen::TrackEventConfig track_event_cfg;
+			track_event_cfg.add_disabled_categories("*");
+			for (const char* category: std::span{category_buffer.categories, category_buffer.category_count}) {
+				track_event_cfg.add_enabled_categories(category);
+				main_cfg.add_disabled_categories(category);
+			}
 
-		auto *ds_cfg = cfg.add_data_sources()->mutable_config();
-		ds_cfg->set_name("track_event");
-		ds_cfg->set_track_event_config_raw(
-		    track_event_cfg.SerializeAsString());
+			add_data_source(track_event_cfg, target_buffer++);
+			add_buffer(category_buffer.size_kb);
+		}
+		add_data_source(main_cfg, 0);
 
 		std::unique_ptr<perfetto::TracingSession> tracing_session(
 		    perfetto::Tracing::NewTrace(
 			perfetto::BackendType::kInProcessBackend));
 		this->tracing_session = std::move(tracing_session);
 
-		this->tracing_session->Setup(cfg);
+		// in the streaming mode the service periodically moves the
+		// buffer contents into the file, so the buffer can be small
+		if (config.file_write_period_ms != 0 && !config.ring_buffer) {
+			if (config.compression == TraceCompression::None) {
+				// same permissions as the files written by ofstream and gzopen, subject to the umask
+				this->output_fd = open(this->output_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+			} else {
+				this->compressing_pipe = std::make_unique<CompressingPipe>(this->output_file.c_str(), config.compression);
+				this->output_fd = this->compressing_pipe->write_fd();
+			}
+			if (this->output_fd < 0) {
+				PERFETTO_ELOG("failed to open %s, the trace will be written on exit", this->output_file.c_str());
+				this->compressing_pipe.reset();
+			}
+		}
+		if (this->output_fd >= 0) {
+			cfg.set_write_into_file(true);
+			cfg.set_file_write_period_ms(config.file_write_period_ms);
+		}
+
+		this->tracing_session->Setup(cfg, this->output_fd);
 		this->tracing_session->StartBlocking();
 	}
 
-	~ApiTracingSession() {
-		this->tracing_session->FlushBlocking(100);
+	bool stop(uint32_t flush_timeout_ms, const char* output_file, bool& written) override {
+		// commit the chunk of the current thread, then wait until the
+		// service has received the data of all trace writers
+		perfetto::TrackEvent::Flush();
+		const bool flushed = this->tracing_session->FlushBlocking(flush_timeout_ms);
+		if (!flushed) {
+			PERFETTO_ELOG("trace flush has not completed in %u ms, some data may be missing", flush_timeout_ms);
+		}
 		this->tracing_session->StopBlocking();
-		std::vector<char> trace_data(
-		    tracing_session->ReadTraceBlocking());
 
-		std::ofstream output;
-		output.open(output_file.c_str(),
-			    std::ios::out | std::ios::binary | std::ios::trunc);
-		output.write(&trace_data[0], trace_data.size());
-		output.close();
+		if (this->compressing_pipe) {
+			// the remaining data is written by the service on stop.
+			// destroying the session closes its copy of the pipe.
+			this->tracing_session.reset();
+			written = this->compressing_pipe->finish();
+			if (!written) {
+				PERFETTO_ELOG("failed to write %s", this->output_file.c_str());
+			}
+			return flushed;
+		}
+		if (this->output_fd >= 0) {
+			// the remaining data is written by the service on stop
+			written = close(this->output_fd) == 0;
+			if (!written) {
+				PERFETTO_ELOG("failed to close %s: %s", this->output_file.c_str(), strerror(errno));
+			}
+			return flushed;
+		}
+
+		std::lock_guard<std::mutex> lock(read_mutex);
+		written = write_trace(*tracing_session, output_file ? output_file : this->output_file.c_str(), compression);
+		return flushed;
+	}
+
+	bool snapshot(const char* snapshot_file) override {
+		// the buffer is not readable when it is streamed into the file
+		if (this->output_fd >= 0) {
+			return false;
+		}
+
+		// move the data from the per-thread chunks into the buffer
+		perfetto::TrackEvent::Flush();
+		this->tracing_session->FlushBlocking(kSnapshotFlushTimeoutMs);
+		std::lock_guard<std::mutex> lock(read_mutex);
+		return write_trace(*tracing_session, snapshot_file, compression);
+	}
+
+	bool stats(PerfettoStats& stats) override {
+		return read_stats(*tracing_session, stats);
 	}
 
 private:
 	std::unique_ptr<perfetto::TracingSession> tracing_session;
 	std::string output_file;
+	TraceCompression compression;
+	// output file descriptor in the streaming mode, -1 otherwise
+	int output_fd = -1;
+	// owns `output_fd` when streaming with compression
+	std::unique_ptr<CompressingPipe> compressing_pipe;
+	// serializes the reads of the buffer
+	std::mutex read_mutex;
+
+	static constexpr uint32_t kSnapshotFlushTimeoutMs = 1000;
 };
 
-void *init_perfetto(uint32_t backend, const char* output_file, size_t buffer_size_kb) {
+void *init_perfetto(uint32_t backend, const char* output_file, const ProducerConfig* producer, const InProcessConfig* config, const SystemConfig* system_config) {
 	assert(output_file);
+	assert(producer);
 	
 	auto backend_type = static_cast<perfetto::BackendType>(backend);
 	TracingSessionGuard *ptr = nullptr;
 	if (backend_type == perfetto::BackendType::kSystemBackend) {
-		ptr = new SdkTracingSession();
+		assert(system_config);
+		ptr = new SdkTracingSession(*producer, *system_config);
 	} else {
 		// warning: silently refuses custom backend
-		ptr = new ApiTracingSession(output_file, buffer_size_kb);
+		assert(config);
+		ptr = new ApiTracingSession(output_file, *producer, *config);
 	}
 	auto p = (void *)(ptr);
 	return p;
 }
 
-void deinit_perfetto(void *guard) {
+const uint8_t* enabled_category_flags(size_t* static_category_count) {
+	assert(static_category_count);
+
+	static_assert(sizeof(std::atomic<uint8_t>) == sizeof(uint8_t) && std::atomic<uint8_t>::is_always_lock_free);
+	*static_category_count = WRAPPER_STATIC_CATEGORY_COUNT;
+	return reinterpret_cast<const uint8_t*>(g_enabled_flags);
+}
+
+void set_enabled_flags_callback(void (*callback)()) {
+	enabled_flags_observer().set_callback(callback);
+}
+
+bool snapshot_perfetto(void *guard, const char* output_file) {
+	assert(guard);
+	assert(output_file);
+
+	auto* p = reinterpret_cast<TracingSessionGuard*>(guard);
+	return p->snapshot(output_file);
+}
+
+bool get_perfetto_stats(void *guard, PerfettoStats* stats) {
+	assert(guard);
+	assert(stats);
+
+	auto* p = reinterpret_cast<TracingSessionGuard*>(guard);
+	return p->stats(*stats);
+}
+
+bool deinit_perfetto(void *guard, uint32_t flush_timeout_ms, const char* output_file, bool* written) {
 	assert(guard);
+	assert(written);
 
-	const auto* p = reinterpret_cast<TracingSessionGuard*>(guard);
+	auto* p = reinterpret_cast<TracingSessionGuard*>(guard);
+	const bool flushed = p->stop(flush_timeout_ms, output_file, *written);
 	delete p;
+	return flushed;
 }
 
-void create_event(EventType event_type, const char* category, const char* name, const uint64_t* track_id, const PerfettoEventArg* args, size_t arg_count) {
-	assert(name);
-	assert(args || arg_count == 0);
-	
-	auto set_props = [&](perfetto::EventContext ctx) {
-		for (const auto& arg: std::span{args, arg_count}) {
-			switch (arg.type) {
-				case ArgType::FlowID:
-					ctx.event()->add_flow_ids(arg.data.u64);
-					break;
-				case ArgType::StringKeyValue:
-					ctx.AddDebugAnnotation(arg.data.string_key_value.key, arg.data.string_key_value.value);
-					break;
-				case ArgType::F64KeyValue:
-					ctx.AddDebugAnnotation(arg.data.f64_key_value.key, arg.data.f64_key_value.value);
-					break;
-				case ArgType::I64KeyValue:
-					ctx.AddDebugAnnotation(arg.data.i64_key_value.key, arg.data.i64_key_value.value);
-					break;
-				case ArgType::U64KeyValue:
-					ctx.AddDebugAnnotation(arg.data.u64_key_value.key, arg.data.u64_key_value.value);
-					break;
-				case ArgType::BoolKeyValue:
-					ctx.AddDebugAnnotation(arg.data.bool_key_value.key, arg.data.bool_key_value.value);
-					break;
+void commit_thread_trace_data() {
+	perfetto::TrackEvent::Flush();
+}
+
+namespace {
+
+// the keys are static strings, so their names are interned: written once per
+// trace writer and referenced by ID afterwards
+void write_args(perfetto::EventContext& ctx, const PerfettoEventArg* args, size_t arg_count) {
+	for (const auto& arg: std::span{args, arg_count}) {
+		switch (arg.type) {
+			case ArgType::FlowID:
+				ctx.event()->add_flow_ids(arg.data.u64);
+				break;
+			case ArgType::StringKeyValue:
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.string_key_value.key), arg.data.string_key_value.value);
+				break;
+			case ArgType::F64KeyValue:
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.f64_key_value.key), arg.data.f64_key_value.value);
+				break;
+			case ArgType::I64KeyValue:
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.i64_key_value.key), arg.data.i64_key_value.value);
+				break;
+			case ArgType::U64KeyValue:
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.u64_key_value.key), arg.data.u64_key_value.value);
+				break;
+			case ArgType::BoolKeyValue:
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.bool_key_value.key), arg.data.bool_key_value.value);
+				break;
+			case ArgType::StringViewKeyValue: {
+				const auto value = arg.data.string_view_key_value.value;
+				ctx.AddDebugAnnotation(perfetto::StaticString(arg.data.string_view_key_value.key), [value](perfetto::TracedValue context) {
+					std::move(context).WriteString(value.ptr, value.len);
+				});
+				break;
 			}
 		}
-	};
+	}
+}
 
-	auto name_str = perfetto::DynamicString{name};
-	auto category_str = category ? perfetto::DynamicCategory{category} : perfetto::DynamicCategory{"default"};
+// strings registered via `register_event_name` and `register_category`. the
+// handles are pointers into this set, so the strings are never removed.
+// unordered_set is node based, so the element addresses survive rehashing.
+class InternedStrings {
+public:
+	const std::string& intern(const char* value) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return *strings.emplace(value).first;
+	}
 
-	if (event_type == EventType::Span) {
-		if (track_id) {
-			TRACE_EVENT_BEGIN(category_str, name_str, perfetto::Track(*track_id), set_props);
-		} else {
-			TRACE_EVENT_BEGIN(category_str, name_str, set_props);
-		}
-	} else if (event_type == EventType::Instant) {
-		if (track_id) {
-			TRACE_EVENT_INSTANT(category_str, name_str, perfetto::Track(*track_id), set_props);
-		} else {
-			TRACE_EVENT_INSTANT(category_str, name_str, set_props);
+private:
+	std::mutex mutex;
+	std::unordered_set<std::string> strings;
+};
+
+// leaked on purpose: events may still be emitted from static destructors
+InternedStrings& interned_event_names() {
+	static auto* names = new InternedStrings();
+	return *names;
+}
+
+InternedStrings& interned_categories() {
+	static auto* categories = new InternedStrings();
+	return *categories;
+}
+
+// handles below this value are indices of the static categories defined in
+// trace_categories.h, the rest point into `interned_categories()`
+constexpr uint64_t kStaticCategoryCount = WRAPPER_STATIC_CATEGORY_COUNT;
+
+// returns the index of the static category named `category` or
+// `kStaticCategoryCount` if there is no such category
+uint64_t find_static_category(const char* category) {
+#define WRAPPER_CATEGORY_NAME(index, name, ...) name,
+	static constexpr const char* kNames[] = {WRAPPER_STATIC_CATEGORIES(WRAPPER_CATEGORY_NAME)};
+#undef WRAPPER_CATEGORY_NAME
+
+	for (uint64_t i = 0; i < kStaticCategoryCount; ++i) {
+		if (std::strcmp(kNames[i], category) == 0) {
+			return i;
 		}
 	}
+	return kStaticCategoryCount;
 }
 
-void destroy_event(const char* category, const uint64_t* track_id) {
-	if (category) {
-		perfetto::DynamicCategory category_name{category};
-		if (track_id) {
-			TRACE_EVENT_END(category_name, perfetto::Track(*track_id));
-		} else {
-			TRACE_EVENT_END(category_name);
-		}
+// name of a category registered via `register_category` or null if the
+// handle is a static category index
+const char* dynamic_category_name(uint64_t category) {
+	if (category < kStaticCategoryCount) {
+		return nullptr;
+	}
+	return reinterpret_cast<const std::string*>(category)->c_str();
+}
+
+} // namespace
+
+#define WRAPPER_CATEGORY_CASE(index, name, BODY) \
+	case index:                              \
+		BODY(name);                      \
+		break;
+
+// expands `BODY(category)` with the static category `static_index` as a
+// literal, so that the perfetto macros resolve it at compile time and use the
+// cheap enabled check. any other index falls back to the dynamic category
+// `dynamic_name`.
+#define WRAPPER_WITH_CATEGORY(static_index, dynamic_name, BODY)				\
+	do {										\
+		switch (static_index) {							\
+			WRAPPER_STATIC_CATEGORIES(WRAPPER_CATEGORY_CASE, BODY)		\
+			default: {							\
+				perfetto::DynamicCategory category_{dynamic_name};	\
+				BODY(category_);					\
+			}								\
+		}									\
+	} while (0)
+
+// emits a begin or an instant event. the category must be a literal or a
+// local variable for the perfetto macros to resolve it at compile time. the
+// variadic arguments are an optional track, an optional timestamp and the
+// lambda setting the event properties.
+#define WRAPPER_TRACE_EVENT(event_type, category, name, ...)		\
+	do {								\
+		if (event_type == EventType::Span) {			\
+			TRACE_EVENT_BEGIN(category, name, __VA_ARGS__);	\
+		} else if (event_type == EventType::Instant) {		\
+			TRACE_EVENT_INSTANT(category, name, __VA_ARGS__);	\
+		}							\
+	} while (0)
+
+namespace {
+
+// `track_and_timestamp` is an optional track followed by an optional
+// `perfetto::TraceTimestamp`. without a track the event goes to the current
+// thread track, without a timestamp perfetto reads the clock itself.
+template <typename Name, typename... TrackAndTimestamp>
+void trace_event(EventType event_type, uint64_t static_category, const char* dynamic_category, Name name, const PerfettoEventArg* args, size_t arg_count, const TrackAndTimestamp&... track_and_timestamp) {
+	static_assert(sizeof...(TrackAndTimestamp) <= 2);
+	assert(args || arg_count == 0);
+
+	auto set_props = [&](perfetto::EventContext ctx) {
+		write_args(ctx, args, arg_count);
+	};
+
+#define WRAPPER_EMIT_EVENT(category) WRAPPER_TRACE_EVENT(event_type, category, name, track_and_timestamp..., set_props)
+	WRAPPER_WITH_CATEGORY(static_category, dynamic_category, WRAPPER_EMIT_EVENT);
+#undef WRAPPER_EMIT_EVENT
+}
+
+template <typename... TrackAndTimestamp>
+void trace_event_end(uint64_t static_category, const char* dynamic_category, const TrackAndTimestamp&... track_and_timestamp) {
+	static_assert(sizeof...(TrackAndTimestamp) <= 2);
+
+#define WRAPPER_END_EVENT(category) TRACE_EVENT_END(category, track_and_timestamp...)
+	WRAPPER_WITH_CATEGORY(static_category, dynamic_category, WRAPPER_END_EVENT);
+#undef WRAPPER_END_EVENT
+}
+
+// emits the event either on the custom track `track_id` or on the current
+// thread track. `timestamp` is empty or a single `perfetto::TraceTimestamp`.
+template <typename Name, typename... Timestamp>
+void emit_event(EventType event_type, uint64_t static_category, const char* dynamic_category, Name name, const uint64_t* track_id, const PerfettoEventArg* args, size_t arg_count, const Timestamp&... timestamp) {
+	static_assert(sizeof...(Timestamp) <= 1);
+
+	if (track_id) {
+		trace_event(event_type, static_category, dynamic_category, name, args, arg_count, perfetto::Track(*track_id), timestamp...);
 	} else {
-		if (track_id) {
-			TRACE_EVENT_END("default", perfetto::Track(*track_id));
-		} else {
-			TRACE_EVENT_END("default");
-		}
+		trace_event(event_type, static_category, dynamic_category, name, args, arg_count, timestamp...);
+	}
+}
+
+template <typename... Timestamp>
+void end_event(uint64_t static_category, const char* dynamic_category, const uint64_t* track_id, const Timestamp&... timestamp) {
+	static_assert(sizeof...(Timestamp) <= 1);
+
+	if (track_id) {
+		trace_event_end(static_category, dynamic_category, perfetto::Track(*track_id), timestamp...);
+	} else {
+		trace_event_end(static_category, dynamic_category, timestamp...);
+	}
+}
+
+perfetto::TraceTimestamp trace_timestamp(uint64_t timestamp) {
+	return perfetto::TraceTimestamp{perfetto::TrackEvent::GetTraceClockId(), timestamp};
+}
+
+} // namespace
+
+void create_event(EventType event_type, const char* category, const char* name, const uint64_t* track_id, const PerfettoEventArg* args, size_t arg_count) {
+	assert(name);
+
+	auto static_category = category ? find_static_category(category) : kDefaultCategory;
+	emit_event(event_type, static_category, category, perfetto::DynamicString{name}, track_id, args, arg_count);
+}
+
+void destroy_event(const char* category, const uint64_t* track_id) {
+	auto static_category = category ? find_static_category(category) : kDefaultCategory;
+	end_event(static_category, category, track_id);
+}
+
+void create_event_at(EventType event_type, const char* category, const char* name, const uint64_t* track_id, uint64_t timestamp, const PerfettoEventArg* args, size_t arg_count) {
+	assert(name);
+
+	auto static_category = category ? find_static_category(category) : kDefaultCategory;
+	emit_event(event_type, static_category, category, perfetto::DynamicString{name}, track_id, args, arg_count, trace_timestamp(timestamp));
+}
+
+void destroy_event_at(const char* category, const uint64_t* track_id, uint64_t timestamp) {
+	auto static_category = category ? find_static_category(category) : kDefaultCategory;
+	end_event(static_category, category, track_id, trace_timestamp(timestamp));
+}
+
+uint64_t get_trace_time_ns() {
+	return perfetto::TrackEvent::GetTraceTimeNs();
+}
+
+uint64_t register_event_name(const char* name) {
+	assert(name);
+
+	return reinterpret_cast<uint64_t>(interned_event_names().intern(name).c_str());
+}
+
+uint64_t register_category(const char* category) {
+	if (!category) {
+		return kDefaultCategory;
+	}
+
+	auto static_category = find_static_category(category);
+	if (static_category != kStaticCategoryCount) {
+		return static_category;
 	}
+
+	return reinterpret_cast<uint64_t>(&interned_categories().intern(category));
+}
+
+void create_event_interned(EventType event_type, uint64_t category, uint64_t name, const uint64_t* track_id, const PerfettoEventArg* args, size_t arg_count) {
+	assert(name);
+
+	// perfetto interns static strings by their address
+	auto name_str = perfetto::StaticString{reinterpret_cast<const char*>(name)};
+	emit_event(event_type, category, dynamic_category_name(category), name_str, track_id, args, arg_count);
+}
+
+void destroy_event_interned(uint64_t category, const uint64_t* track_id) {
+	end_event(category, dynamic_category_name(category), track_id);
+}
+
+void create_event_interned_at(EventType event_type, uint64_t category, uint64_t name, const uint64_t* track_id, uint64_t timestamp, const PerfettoEventArg* args, size_t arg_count) {
+	assert(name);
+
+	auto name_str = perfetto::StaticString{reinterpret_cast<const char*>(name)};
+	emit_event(event_type, category, dynamic_category_name(category), name_str, track_id, args, arg_count, trace_timestamp(timestamp));
+}
+
+void destroy_event_interned_at(uint64_t category, const uint64_t* track_id, uint64_t timestamp) {
+	end_event(category, dynamic_category_name(category), track_id, trace_timestamp(timestamp));
+}
+
+uint64_t register_thread_track() {
+	// leaked: the events of a thread may be replayed after it has exited
+	auto* thread_track = new perfetto::ThreadTrack(perfetto::ThreadTrack::Current());
+	// the descriptor includes the thread name, so it must be serialized on this
+	// thread rather than on the one replaying the events
+	perfetto::TrackEvent::SetTrackDescriptor(*thread_track, thread_track->Serialize());
+	return reinterpret_cast<uint64_t>(thread_track);
+}
+
+void register_async_track(uint64_t track_id, const char* name) {
+	assert(name);
+
+	// same track as the one of the events with this `track_id`
+	const perfetto::Track track(track_id);
+	auto descriptor = track.Serialize();
+	descriptor.set_name(name);
+	perfetto::TrackEvent::SetTrackDescriptor(track, std::move(descriptor));
+}
+
+void unregister_async_track(uint64_t track_id) {
+	perfetto::TrackEvent::EraseTrackDescriptor(perfetto::Track(track_id));
 }
 
 namespace {
 
+// the track keeps the `name` and `unit` pointers. note that the setters return
+// a modified copy of the track.
+perfetto::CounterTrack make_counter_track(
+	const char* name,
+	const char* unit,
+	const bool is_incremental,
+	const perfetto::Track& parent = perfetto::Track::MakeProcessTrack()
+) {
+	const auto counter_track = perfetto::CounterTrack(name, parent).set_is_incremental(is_incremental);
+	return unit ? counter_track.set_unit_name(unit) : counter_track;
+}
+
 template <typename T>
 void update_counter(const char* category, const char* name, const char* unit, const bool is_incremental, const T value) {
 	assert(name);
-	
-	perfetto::CounterTrack memory_track = perfetto::CounterTrack(name);
-	if (unit) {
-		memory_track.set_unit_name(unit);
-	}
-	memory_track.set_is_incremental(is_incremental);
-	if (category) {
-		perfetto::DynamicCategory category_name{category};
-		TRACE_COUNTER(category_name, memory_track, value);
-	} else {
-		TRACE_COUNTER("default", memory_track, value);
-	}
+
+	const auto counter_track = make_counter_track(name, unit, is_incremental);
+
+	auto static_category = category ? find_static_category(category) : kDefaultCategory;
+#define WRAPPER_UPDATE_COUNTER(category_name) TRACE_COUNTER(category_name, counter_track, value)
+	WRAPPER_WITH_CATEGORY(static_category, category, WRAPPER_UPDATE_COUNTER);
+#undef WRAPPER_UPDATE_COUNTER
+}
+
+// counter track created once by `register_counter`. the name and the unit are
+// interned, so the track can keep pointers to them.
+struct RegisteredCounter {
+	uint64_t category;
+	perfetto::CounterTrack track;
+};
+
+template <typename T, typename... Timestamp>
+void update_registered_counter(uint64_t counter, const T value, Timestamp... timestamp) {
+	static_assert(sizeof...(Timestamp) <= 1);
+	assert(counter);
+
+	const auto* registered = reinterpret_cast<const RegisteredCounter*>(counter);
+	const auto& counter_track = registered->track;
+#define WRAPPER_UPDATE_COUNTER(category_name) TRACE_COUNTER(category_name, counter_track, timestamp..., value)
+	WRAPPER_WITH_CATEGORY(registered->category, dynamic_category_name(registered->category), WRAPPER_UPDATE_COUNTER);
+#undef WRAPPER_UPDATE_COUNTER
 }
 
 } // namespace
@@ -232,4 +919,106 @@ void update_counter_u64(const char* category, const char* name, const char* unit
 
 void update_counter_f64(const char* category, const char* name, const char* unit, const bool is_incremental, const double value) {
 	update_counter(category, name, unit, is_incremental, value);
-}
\ No newline at end of file
+}
+
+namespace {
+
+// the parent of the registered counter track, the track keeps a copy of it
+uint64_t register_counter_on(
+	const char* category,
+	const char* name,
+	const char* unit,
+	const bool is_incremental,
+	const perfetto::Track& parent
+) {
+	assert(name);
+
+	// the strings and the counters are leaked on purpose, see `interned_event_names`
+	const char* interned_unit = unit ? interned_event_names().intern(unit).c_str() : nullptr;
+	auto* registered = new RegisteredCounter{
+		register_category(category),
+		make_counter_track(interned_event_names().intern(name).c_str(), interned_unit, is_incremental, parent),
+	};
+	return reinterpret_cast<uint64_t>(registered);
+}
+
+} // namespace
+
+uint64_t register_counter(const char* category, const char* name, const char* unit, const bool is_incremental) {
+	return register_counter_on(category, name, unit, is_incremental, perfetto::Track::MakeProcessTrack());
+}
+
+uint64_t register_thread_counter(const char* category, const char* name, const char* unit, const bool is_incremental) {
+	return register_counter_on(category, name, unit, is_incremental, perfetto::ThreadTrack::Current());
+}
+
+void update_registered_counter_u64(uint64_t counter, const uint64_t value) {
+	update_registered_counter(counter, value);
+}
+
+void update_registered_counter_f64(uint64_t counter, const double value) {
+	update_registered_counter(counter, value);
+}
+
+void update_registered_counter_u64_at(uint64_t counter, uint64_t timestamp, const uint64_t value) {
+	update_registered_counter(counter, value, trace_timestamp(timestamp));
+}
+
+void update_registered_counter_f64_at(uint64_t counter, uint64_t timestamp, const double value) {
+	update_registered_counter(counter, value, trace_timestamp(timestamp));
+}
+
+namespace {
+
+// `thread_track` is the track of the events without a custom track ID, either
+// a `perfetto::ThreadTrack` or nothing for the current thread track
+template <typename... ThreadTrack>
+void emit_packed_events(const PackedEvent* events, size_t count, const ThreadTrack&... thread_track) {
+	static_assert(sizeof...(ThreadTrack) <= 1);
+	assert(events || count == 0);
+
+	for (const auto& event: std::span{events, count}) {
+		assert(event.arg_count <= kPackedEventMaxArgs);
+
+		const auto* dynamic_category = dynamic_category_name(event.category);
+		const auto timestamp = trace_timestamp(event.timestamp);
+		auto emit = [&](const auto&... track) {
+			switch (event.type) {
+				case PackedEventType::Begin:
+				case PackedEventType::Instant: {
+					auto event_type = event.type == PackedEventType::Begin ? EventType::Span : EventType::Instant;
+					auto name = perfetto::StaticString{reinterpret_cast<const char*>(event.name)};
+					trace_event(event_type, event.category, dynamic_category, name, event.args, event.arg_count, track..., timestamp);
+					break;
+				}
+				case PackedEventType::End:
+					trace_event_end(event.category, dynamic_category, track..., timestamp);
+					break;
+				case PackedEventType::CounterU64:
+					update_registered_counter(event.name, event.value.u64, timestamp);
+					break;
+				case PackedEventType::CounterF64:
+					update_registered_counter(event.name, event.value.f64, timestamp);
+					break;
+			}
+		};
+
+		if (event.has_track_id) {
+			emit(perfetto::Track(event.track_id));
+		} else {
+			emit(thread_track...);
+		}
+	}
+}
+
+} // namespace
+
+void create_events_batch(const PackedEvent* events, size_t count) {
+	emit_packed_events(events, count);
+}
+
+void replay_deferred_events(uint64_t thread_track, const PackedEvent* events, size_t count) {
+	assert(thread_track);
+
+	emit_packed_events(events, count, *reinterpret_cast<const perfetto::ThreadTrack*>(thread_track));
+}
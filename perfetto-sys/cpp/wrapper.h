@@ -13,6 +13,8 @@ enum class ArgType : uint8_t {
     I64KeyValue,
     U64KeyValue,
     BoolKeyValue,
+    /// String value with an explicit length, doesn't have to be NUL-terminated.
+    StringViewKeyValue,
 };
 
 /// Event types for the PerfettoEventArg struct.
@@ -28,6 +30,17 @@ struct KeyValue {
     T value;
 };
 
+/// String that is not necessarily NUL-terminated.
+struct StringView {
+    const char* ptr;
+    size_t len;
+};
+
+/// Handle of the default category, see `register_category`.
+constexpr uint64_t kDefaultCategory = 0;
+
+/// Argument of an event. The keys are interned by address, so they must stay valid and
+/// unchanged until tracing stops.
 struct PerfettoEventArg {
     union {
         const uint64_t u64;
@@ -36,21 +49,189 @@ struct PerfettoEventArg {
         KeyValue<int64_t> i64_key_value;
         KeyValue<uint64_t> u64_key_value;
         KeyValue<bool> bool_key_value;
+        KeyValue<StringView> string_view_key_value;
     } data;
     ArgType type;
 };
 
+/// Record types for the PackedEvent struct.
+enum class PackedEventType : uint8_t {
+	Begin,
+	End,
+	Instant,
+	CounterU64,
+	CounterF64,
+};
+
+/// Maximum number of arguments of a PackedEvent.
+constexpr size_t kPackedEventMaxArgs = 4;
+
+/// Fixed-size event record for `create_events_batch` and `replay_deferred_events`.
+struct PackedEvent {
+    /// Event time in nanoseconds of the trace clock, see `get_trace_time_ns`.
+    uint64_t timestamp;
+    /// Category handle returned by `register_category`. Unused for counters.
+    uint64_t category;
+    /// Name handle returned by `register_event_name` for `Begin` and `Instant`,
+    /// counter handle returned by `register_counter` for counters. Unused for `End`.
+    uint64_t name;
+    /// Custom track ID, used only if `has_track_id` is set. Unused for counters.
+    uint64_t track_id;
+    /// Counter value.
+    union {
+        uint64_t u64;
+        double f64;
+    } value;
+    PackedEventType type;
+    bool has_track_id;
+    uint8_t arg_count;
+    PerfettoEventArg args[kPackedEventMaxArgs];
+};
+
+/// Compression of the trace file.
+enum class TraceCompression : uint8_t {
+	None,
+	/// The file is a gzip stream, the Perfetto UI and trace processor open it directly.
+	Gzip,
+};
+
+/// Shared memory between this process and the tracing service, used by both backends.
+/// Events are lost when a producer runs out of shared memory before the service has copied
+/// the chunks into the central buffer, see `PerfettoBufferStats::trace_writer_packet_loss`.
+struct ProducerConfig {
+    /// Size hint of the shared memory buffer in kilobytes. 0 keeps the SDK default (256 KB).
+    uint32_t shmem_size_hint_kb;
+    /// Page size hint of the shared memory buffer in kilobytes. 0 keeps the SDK default (4 KB).
+    uint32_t shmem_page_size_hint_kb;
+};
+
+/// Additional trace buffer holding only the events of the given categories.
+/// Keeps low-rate categories from being overwritten or discarded because of high-rate ones.
+struct CategoryBufferConfig {
+    /// Size of the buffer in kilobytes.
+    size_t size_kb;
+    /// Names of the categories written into this buffer instead of the main one.
+    const char* const* categories;
+    /// Number of elements in `categories`.
+    size_t category_count;
+};
+
+/// Options of the in-process backend.
+struct InProcessConfig {
+    /// Size of the trace buffer in kilobytes.
+    size_t buffer_size_kb;
+    /// If not zero, the trace is streamed into the output file with this period in milliseconds,
+    /// so the buffer only has to hold the data produced between two writes.
+    /// Otherwise the whole trace is kept in the buffer and written when tracing stops.
+    uint32_t file_write_period_ms;
+    /// Flight recorder mode: the buffer is a ring overwriting the oldest data, which can be
+    /// written at any time by `snapshot_perfetto`. Cannot be combined with streaming.
+    bool ring_buffer;
+    /// Compression of the output file and the snapshots. The data is compressed as it is written.
+    TraceCompression compression;
+    /// How often the producers commit their data into the central buffer, in milliseconds.
+    /// 0 disables the periodic flush, the data is then committed only when a chunk is full.
+    uint32_t flush_period_ms;
+    /// Additional buffers, the main buffer holds the events of all the other categories.
+    const CategoryBufferConfig* category_buffers;
+    /// Number of elements in `category_buffers`.
+    size_t category_buffer_count;
+    /// Record the CPU time of the thread (`CLOCK_THREAD_CPUTIME_ID`) with every slice begin and
+    /// end, so that the slices show how long the thread was actually running.
+    bool thread_time;
+    /// If not zero, the interned data and the track descriptors are emitted again with this
+    /// period in milliseconds, so that a part of the trace read by `snapshot_perfetto` can be
+    /// decoded on its own. 0 keeps the default: 1000 ms in the ring buffer mode, never otherwise.
+    uint32_t incremental_state_clear_period_ms;
+};
+
+/// Options of the system backend.
+struct SystemConfig {
+    /// Start the session locally without waiting for the `traced` service: the events are kept
+    /// in the shared memory buffer and adopted by the session of the perfetto command once it
+    /// starts. The categories enabled in the perfetto config should be the default ones.
+    bool startup_tracing;
+    /// With `startup_tracing`, how long to keep the events if no session adopts them, in
+    /// milliseconds. 0 keeps the SDK default (10 s).
+    /// Otherwise how long to wait for the session to start. 0 waits indefinitely.
+    uint32_t start_timeout_ms;
+};
+
+/// Maximum number of buffers reported by `get_perfetto_stats`.
+constexpr size_t kPerfettoStatsMaxBuffers = 8;
+
+/// Statistics of a trace buffer, see `TraceStats.BufferStats` in the Perfetto protos.
+struct PerfettoBufferStats {
+    /// Size of the buffer in bytes.
+    uint64_t buffer_size;
+    /// Bytes written into the buffer, including the overwritten ones.
+    uint64_t bytes_written;
+    /// Bytes overwritten by newer data in the ring buffer mode.
+    uint64_t bytes_overwritten;
+    /// Bytes read from the buffer, i.e. written into the trace file.
+    uint64_t bytes_read;
+    uint64_t chunks_written;
+    /// Chunks dropped because the buffer was full in the discard mode.
+    uint64_t chunks_discarded;
+    /// Chunks overwritten by newer data in the ring buffer mode.
+    uint64_t chunks_overwritten;
+    /// Packets lost by the producers because the shared memory was full.
+    uint64_t trace_writer_packet_loss;
+};
+
+/// Health of the tracing session, see `TraceStats` in the Perfetto protos.
+struct PerfettoStats {
+    /// Chunks dropped by the service before they reached a buffer.
+    uint64_t chunks_discarded;
+    uint64_t patches_discarded;
+    uint64_t flushes_succeeded;
+    uint64_t flushes_failed;
+    /// Number of valid elements in `buffers`, in the order of the buffers in the trace config:
+    /// the main buffer first, then the category buffers.
+    size_t buffer_count;
+    PerfettoBufferStats buffers[kPerfettoStatsMaxBuffers];
+};
+
 extern "C" {
 /// @brief Initialize the Perfetto tracing system.
 /// @param backend_type is the type of backend to use. See `perfetto::BackendType` for possible values.
 /// @param output_file is the path to the file to write the trace to. Must not be null if `backend_type` is not "System".
-/// @param buffer_size_kb is the size of the buffer to use in kilobytes for non-system backend.
-void *init_perfetto(uint32_t backend_type, const char* output_file, size_t buffer_size_kb);
+/// @param producer is the shared memory configuration of this process. Must not be null.
+/// @param config is the configuration of the non-system backend. Must not be null if `backend_type` is not "System".
+/// @param system_config is the configuration of the system backend. Must not be null if `backend_type` is "System".
+/// The buffers and the flush period of the system backend are set in the config of the perfetto command.
+void *init_perfetto(uint32_t backend_type, const char* output_file, const ProducerConfig* producer, const InProcessConfig* config, const SystemConfig* system_config);
 
 /// @brief Deinitialize the Perfetto tracing system.
+/// Flushes the data of all trace writers, waits for the tracing service to acknowledge it and then stops tracing.
 /// @param guard is the pointer returned by `init_perfetto`, must not be null.
+/// @param flush_timeout_ms is the maximum time to wait for the flush in milliseconds.
+/// @param output_file if not null, the remaining trace data of the in-process backend is written there instead of
+/// the output file given to `init_perfetto`. Ignored when the trace is streamed into the file.
+/// @param written is set to false if the trace could not be written, must not be null.
+/// @return true if the flush has completed, false if it has timed out.
+/// With the system backend the session is owned by the perfetto command, which collects the data when it stops,
+/// so nothing is flushed here and both results are always true: only the wait for the perfetto command tells whether
+/// the data has been written. Call `commit_thread_trace_data` before stopping the command.
 /// This function will free the resources allocated by `init_perfetto` and cannot be called twice for the same `guard`.
-void deinit_perfetto(void *guard);
+bool deinit_perfetto(void *guard, uint32_t flush_timeout_ms, const char* output_file, bool* written);
+
+/// @brief Commit the trace data of the calling thread into the shared memory, so that the tracing service collects it
+/// when the session stops.
+void commit_thread_trace_data();
+
+/// @brief Write the data currently in the trace buffer into a file without stopping tracing.
+/// The data is consumed, so consecutive snapshots don't overlap.
+/// @param guard is the pointer returned by `init_perfetto`, must not be null.
+/// @param output_file is the path to the file to write the snapshot to. Must not be null.
+/// @return true on success, false if the backend doesn't support snapshots or the file cannot be written.
+bool snapshot_perfetto(void *guard, const char* output_file);
+
+/// @brief Query the statistics of the tracing session from the tracing service.
+/// @param guard is the pointer returned by `init_perfetto`, must not be null.
+/// @param stats receives the statistics. Must not be null.
+/// @return true on success, false if the backend doesn't own the session or the query failed.
+bool get_perfetto_stats(void *guard, PerfettoStats* stats);
 
 /// @brief Start a new tracking event.
 /// @param event_type Event type.
@@ -66,6 +247,98 @@ void create_event(EventType event_type, const char* category, const char* name,
 /// @param track_id Track ID for the event. If null, no explicit track ID will be used. This value must correspond to the track ID used in `create_event`.
 void destroy_event(const char* category, const uint64_t* track_id);
 
+/// @brief Start a new tracking event at the given time instead of the time of the call.
+/// Same as `create_event` otherwise.
+/// @param timestamp Event time in nanoseconds of the trace clock (boot time on Linux and Android), see `get_trace_time_ns`.
+void create_event_at(EventType event_type, const char* category, const char* name, const uint64_t* track_id, uint64_t timestamp, const PerfettoEventArg* args, size_t arg_count);
+
+/// @brief End the most recent tracking event at the given time instead of the time of the call.
+/// Same as `destroy_event` otherwise.
+/// @param timestamp Event time in nanoseconds of the trace clock, see `get_trace_time_ns`. Must not be smaller than the begin time.
+void destroy_event_at(const char* category, const uint64_t* track_id, uint64_t timestamp);
+
+/// @brief Current time of the clock used for the trace events, in nanoseconds.
+/// Use it to get timestamps for the `*_at` functions.
+uint64_t get_trace_time_ns();
+
+/// @brief Flags telling which categories are enabled, readable without calling into the wrapper.
+/// Element `i` is non-zero while the static category `i` is enabled by a session, the last one,
+/// at index `*static_category_count`, while any session is running. Dynamic categories are
+/// enabled at most while it is set. The flags are updated atomically when the sessions start and
+/// stop, read them with relaxed atomic loads. They may stay set while a session stops.
+/// @param static_category_count Set to the number of static categories. Must not be null.
+/// @return Pointer to `*static_category_count + 1` flags, valid for the lifetime of the process.
+const uint8_t* enabled_category_flags(size_t* static_category_count);
+
+/// @brief Set the function called after the flags of `enabled_category_flags` change.
+/// It is called from a thread of the SDK, and must not call into the wrapper.
+/// @param callback Function to call, null to remove it.
+void set_enabled_flags_callback(void (*callback)());
+
+/// @brief Register an event name to be emitted as Perfetto interned data.
+/// @param name Event name. Must not be null. The string is copied.
+/// @return Handle to pass to `create_event_interned`. The same name always yields the same handle.
+/// Registered names are never freed, so the set of registered names should be bounded.
+uint64_t register_event_name(const char* name);
+
+/// @brief Register an event category.
+/// @param category Category name. If null or "default", `kDefaultCategory` is returned.
+/// @return Handle to pass to `create_event_interned` and `destroy_event_interned`.
+uint64_t register_category(const char* category);
+
+/// @brief Start a new tracking event using the handles returned by `register_event_name` and `register_category`.
+/// The event name is written to the trace only once per trace writer and referenced by ID afterwards.
+/// @param event_type Event type.
+/// @param category Category handle.
+/// @param name Event name handle.
+/// @param track_id Track ID for the event. If null, no explicit track ID will be used.
+/// @param args Information about tracking, flow and additional fields.
+/// @param arg_count Number of elements in `args`.
+void create_event_interned(EventType event_type, uint64_t category, uint64_t name, const uint64_t* track_id, const PerfettoEventArg* args, size_t arg_count);
+
+/// @brief End the most recent tracking event started by `create_event_interned`.
+/// @param category Category handle.
+/// @param track_id Track ID for the event. If null, no explicit track ID will be used. This value must correspond to the track ID used in `create_event_interned`.
+void destroy_event_interned(uint64_t category, const uint64_t* track_id);
+
+/// @brief Start a new tracking event like `create_event_interned` but at the given time.
+/// @param timestamp Event time in nanoseconds of the trace clock, see `get_trace_time_ns`.
+void create_event_interned_at(EventType event_type, uint64_t category, uint64_t name, const uint64_t* track_id, uint64_t timestamp, const PerfettoEventArg* args, size_t arg_count);
+
+/// @brief End the most recent tracking event started by `create_event_interned` at the given time.
+/// @param timestamp Event time in nanoseconds of the trace clock, see `get_trace_time_ns`.
+void destroy_event_interned_at(uint64_t category, const uint64_t* track_id, uint64_t timestamp);
+
+/// @brief Emit a batch of events of the current thread with a single call.
+/// Events without a custom track ID go to the current thread track.
+/// @param events Events in the order they happened. String arguments must stay valid during the call only.
+/// @param count Number of elements in `events`.
+void create_events_batch(const PackedEvent* events, size_t count);
+
+/// @brief Register the track of the current thread for `replay_deferred_events`.
+/// Must be called on the thread the events are recorded on. The track is never freed.
+/// @return Thread track handle.
+uint64_t register_thread_track();
+
+/// @brief Emit events recorded by another thread.
+/// Events without a custom track ID go to the track of the thread that registered `thread_track`.
+/// @param thread_track Handle returned by `register_thread_track`.
+/// @param events Recorded events, in the order they were recorded. The arguments must not have string values,
+/// the records may outlive them.
+/// @param count Number of elements in `events`.
+void replay_deferred_events(uint64_t thread_track, const PackedEvent* events, size_t count);
+
+/// @brief Name the track of the events with the custom track ID `track_id`, e.g. the track of an
+/// asynchronous task whose events are emitted from several threads.
+/// The descriptor is written once per trace writer, not with every event.
+/// @param track_id Track ID passed to the events of the track.
+/// @param name Track name. Must not be null. The string is copied.
+void register_async_track(uint64_t track_id, const char* name);
+
+/// @brief Forget the descriptor written by `register_async_track` once the track has no more events.
+/// @param track_id Track ID passed to `register_async_track`.
+void unregister_async_track(uint64_t track_id);
+
 /// @brief  Update a counter with an unsigned 64-bit integer value.
 /// @param category Counter category. If null, the default category will be used.
 /// @param name Counter name. Must not be null.
@@ -81,4 +354,45 @@ void update_counter_u64(const char* category, const char* name, const char* unit
 /// @param is_incremental If counter is incremental.
 /// @param value Value of the counter.
 void update_counter_f64(const char* category, const char* name, const char* unit, bool is_incremental, double value);
+
+/// @brief Register a counter track, so that updates don't have to rebuild it.
+/// @param category Counter category. If null, the default category will be used.
+/// @param name Counter name. Must not be null. The string is copied.
+/// @param unit Unit of the counter. If null, no unit will be used. The string is copied.
+/// @param is_incremental If counter is incremental.
+/// @return Handle to pass to `update_registered_counter_u64` and `update_registered_counter_f64`.
+/// Registered counters are never freed, register each counter once.
+uint64_t register_counter(const char* category, const char* name, const char* unit, bool is_incremental);
+
+/// @brief Register a counter track of the current thread, e.g. for per-thread hardware counters.
+/// The track is shown under the thread track and must only be updated from this thread.
+/// @param category Counter category. If null, the default category will be used.
+/// @param name Counter name. Must not be null. The string is copied.
+/// @param unit Unit of the counter. If null, no unit will be used. The string is copied.
+/// @param is_incremental If counter is incremental.
+/// @return Handle to pass to `update_registered_counter_u64` and `update_registered_counter_f64`.
+/// Registered counters are never freed, register each counter once per thread.
+uint64_t register_thread_counter(const char* category, const char* name, const char* unit, bool is_incremental);
+
+/// @brief Update a registered counter with an unsigned 64-bit integer value.
+/// @param counter Handle returned by `register_counter`.
+/// @param value Value of the counter.
+void update_registered_counter_u64(uint64_t counter, uint64_t value);
+
+/// @brief Update a registered counter with an 64-bit floating point value.
+/// @param counter Handle returned by `register_counter`.
+/// @param value Value of the counter.
+void update_registered_counter_f64(uint64_t counter, double value);
+
+/// @brief Update a registered counter with an unsigned 64-bit integer value at the given time.
+/// @param counter Handle returned by `register_counter`.
+/// @param timestamp Sample time in nanoseconds of the trace clock, see `get_trace_time_ns`.
+/// @param value Value of the counter.
+void update_registered_counter_u64_at(uint64_t counter, uint64_t timestamp, uint64_t value);
+
+/// @brief Update a registered counter with an 64-bit floating point value at the given time.
+/// @param counter Handle returned by `register_counter`.
+/// @param timestamp Sample time in nanoseconds of the trace clock, see `get_trace_time_ns`.
+/// @param value Value of the counter.
+void update_registered_counter_f64_at(uint64_t counter, uint64_t timestamp, double value);
 }
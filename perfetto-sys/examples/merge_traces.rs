@@ -0,0 +1,64 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Merge the traces of several processes into one timeline:
+//!
+//! ```sh
+//! cargo run --example merge_traces -- merged.perfetto-trace \
+//!     node0.perfetto-trace,host=node0 node1.perfetto-trace,host=node1,offset_ns=-1500
+//! ```
+//!
+//! Every input is a path, optionally followed by the host it was recorded on and the correction
+//! of the wall clock of the host, see `MergeInput`.
+
+use std::process::ExitCode;
+
+use tracing_profile_perfetto_sys::{merge_traces, MergeInput};
+
+fn parse_input(arg: &str) -> Result<MergeInput, String> {
+    let mut parts = arg.split(',');
+    let mut input = MergeInput::new(parts.next().unwrap_or_default());
+    for option in parts {
+        input = match option.split_once('=') {
+            Some(("host", host)) => input.host(host),
+            Some(("offset_ns", offset)) => input.clock_offset_ns(
+                offset
+                    .parse()
+                    .map_err(|e| format!("invalid offset_ns in '{arg}': {e}"))?,
+            ),
+            _ => return Err(format!("unknown option '{option}' in '{arg}'")),
+        };
+    }
+    Ok(input)
+}
+
+fn main() -> ExitCode {
+    let args = std::env::args().skip(1).collect::<Vec<_>>();
+    let Some((output, inputs)) = args.split_first().filter(|(_, inputs)| !inputs.is_empty()) else {
+        eprintln!("usage: merge_traces OUTPUT INPUT[,host=NAME][,offset_ns=N]...");
+        return ExitCode::FAILURE;
+    };
+
+    let inputs = match inputs
+        .iter()
+        .map(|arg| parse_input(arg))
+        .collect::<Result<Vec<_>, _>>()
+    {
+        Ok(inputs) => inputs,
+        Err(e) => {
+            eprintln!("{e}");
+            return ExitCode::FAILURE;
+        }
+    };
+    match merge_traces(&inputs, output) {
+        Ok(shifts) => {
+            for (arg, shift) in args[1..].iter().zip(shifts) {
+                println!("{arg}: shifted by {shift} ns");
+            }
+            ExitCode::SUCCESS
+        }
+        Err(e) => {
+            eprintln!("failed to merge the traces: {e}");
+            ExitCode::FAILURE
+        }
+    }
+}
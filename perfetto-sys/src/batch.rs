@@ -0,0 +1,329 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Batched mode: the events of a thread are gathered into a small per-thread buffer and emitted
+//! with a single `create_events_batch` call when a span ends or when the buffer is full.
+
+use std::{
+    cell::RefCell,
+    thread::{self, ThreadId},
+};
+
+use crate::{
+    event::{trace_time_ns, PerfettoArg},
+    pool, CounterHandle, EventData, TraceEvent,
+};
+
+/// Maximum number of arguments of a packed event, see `kPackedEventMaxArgs` in wrapper.h.
+pub(crate) const PACKED_EVENT_MAX_ARGS: usize = 4;
+
+/// Number of events after which the batch of a thread is emitted.
+const BATCH_CAPACITY: usize = 64;
+
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum PackedEventType {
+    Begin,
+    End,
+    Instant,
+    CounterU64,
+    CounterF64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+union PackedValue {
+    u64: u64,
+    f64: f64,
+}
+
+/// Fixed-size event record, see `PackedEvent` in wrapper.h.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub(crate) struct PackedEvent {
+    pub(crate) timestamp: u64,
+    category: u64,
+    name: u64,
+    track_id: u64,
+    value: PackedValue,
+    pub(crate) event_type: PackedEventType,
+    has_track_id: bool,
+    pub(crate) arg_count: u8,
+    pub(crate) args: [PerfettoArg; PACKED_EVENT_MAX_ARGS],
+}
+
+impl PackedEvent {
+    pub(crate) fn new(
+        event_type: PackedEventType,
+        category: u64,
+        name: u64,
+        track_id: Option<u64>,
+    ) -> Self {
+        Self {
+            timestamp: 0,
+            category,
+            name,
+            track_id: track_id.unwrap_or_default(),
+            value: PackedValue { u64: 0 },
+            event_type,
+            has_track_id: track_id.is_some(),
+            arg_count: 0,
+            args: [PerfettoArg::EMPTY; PACKED_EVENT_MAX_ARGS],
+        }
+    }
+
+    /// End of the span started by this begin event.
+    pub(crate) fn end_event(&self) -> Self {
+        let mut event = Self::new(PackedEventType::End, self.category, 0, None);
+        event.track_id = self.track_id;
+        event.has_track_id = self.has_track_id;
+        event
+    }
+
+    fn counter_u64(counter: &CounterHandle, value: u64) -> Self {
+        let mut event = Self::new(PackedEventType::CounterU64, 0, counter.handle(), None);
+        event.value = PackedValue { u64: value };
+        event
+    }
+
+    fn counter_f64(counter: &CounterHandle, value: f64) -> Self {
+        let mut event = Self::new(PackedEventType::CounterF64, 0, counter.handle(), None);
+        event.value = PackedValue { f64: value };
+        event
+    }
+}
+
+// Safety: the pointers in the events are field keys which have a static lifetime and string
+// values, which are kept alive by the owner of the event.
+unsafe impl Send for PackedEvent {}
+unsafe impl Sync for PackedEvent {}
+
+extern "C" {
+    fn create_events_batch(events: *const PackedEvent, count: usize);
+}
+
+#[derive(Default)]
+struct EventBatch {
+    events: Vec<PackedEvent>,
+    /// Storage for the string arguments of `events`.
+    strings_storage: Vec<String>,
+    /// Number of entered batched spans. Events outside of any span are emitted immediately,
+    /// since there is no span end to flush them.
+    open_spans: usize,
+}
+
+impl EventBatch {
+    fn push(&mut self, mut event: PackedEvent, strings: String) {
+        event.timestamp = trace_time_ns();
+        self.events.push(event);
+        if !strings.is_empty() {
+            self.strings_storage.push(strings);
+        }
+
+        self.flush_if_needed();
+    }
+
+    /// Push the begin and the end of a slice with their timestamps.
+    fn push_slice(&mut self, mut begin: PackedEvent, strings: String, begin_ns: u64, end_ns: u64) {
+        let mut end = begin.end_event();
+        begin.timestamp = begin_ns;
+        end.timestamp = end_ns;
+        self.events.extend([begin, end]);
+        if !strings.is_empty() {
+            self.strings_storage.push(strings);
+        }
+
+        self.flush_if_needed();
+    }
+
+    fn flush_if_needed(&mut self) {
+        if self.open_spans == 0 || self.events.len() >= BATCH_CAPACITY {
+            self.flush();
+        }
+    }
+
+    fn flush(&mut self) {
+        if self.events.is_empty() {
+            return;
+        }
+
+        unsafe { create_events_batch(self.events.as_ptr(), self.events.len()) };
+        self.events.clear();
+        for strings in self.strings_storage.drain(..) {
+            pool::release_strings(strings);
+        }
+    }
+}
+
+impl Drop for EventBatch {
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+thread_local! {
+    static BATCH: RefCell<EventBatch> = RefCell::new(EventBatch::default());
+}
+
+fn push_batched(event: PackedEvent, strings: String) {
+    _ = BATCH.try_with(|batch| batch.borrow_mut().push(event, strings));
+}
+
+fn with_batch(f: impl FnOnce(&mut EventBatch)) {
+    _ = BATCH.try_with(|batch| f(&mut batch.borrow_mut()));
+}
+
+/// Emit the events gathered by the current thread.
+pub fn flush_event_batch() {
+    _ = BATCH.try_with(|batch| batch.borrow_mut().flush());
+}
+
+/// Span emitted through the batch of the current thread. The batch is flushed when the span
+/// is exited. Enter and exit have to happen on the same thread.
+pub struct BatchedSpan(BatchedSpanState);
+
+enum BatchedSpanState {
+    Packed {
+        event: PackedEvent,
+        strings_storage: String,
+        entered: Option<ThreadId>,
+    },
+    /// Events that don't fit into a packed event are emitted directly.
+    Direct {
+        event_data: Option<EventData>,
+        trace_event: Option<TraceEvent>,
+    },
+    /// Nothing is emitted, see `set_sampling_rules`.
+    SampledOut,
+}
+
+impl BatchedSpan {
+    /// Dynamic names and categories are interned.
+    /// The span is not emitted if it is sampled out, see `set_sampling_rules`.
+    pub fn new(event_data: EventData) -> Self {
+        if !event_data.sample() {
+            return Self(BatchedSpanState::SampledOut);
+        }
+
+        match event_data.into_batched_event(PackedEventType::Begin) {
+            Ok((event, strings_storage)) => Self(BatchedSpanState::Packed {
+                event,
+                strings_storage,
+                entered: None,
+            }),
+            Err(event_data) => Self(BatchedSpanState::Direct {
+                event_data: Some(event_data),
+                trace_event: None,
+            }),
+        }
+    }
+
+    /// Record the begin of the span. Cannot be called more than once.
+    pub fn enter(&mut self) {
+        match &mut self.0 {
+            BatchedSpanState::Packed {
+                event,
+                strings_storage,
+                entered,
+            } => {
+                assert!(entered.is_none(), "span is already entered");
+                with_batch(|batch| {
+                    batch.open_spans += 1;
+                    batch.push(*event, std::mem::take(strings_storage));
+                });
+                // the string arguments are released with the batch, the end doesn't need them
+                event.arg_count = 0;
+                *entered = Some(thread::current().id());
+            }
+            BatchedSpanState::Direct {
+                event_data,
+                trace_event,
+            } => {
+                // keep the order with the gathered events
+                with_batch(|batch| {
+                    batch.flush();
+                    batch.open_spans += 1;
+                });
+                *trace_event = Some(TraceEvent::new_unsampled(
+                    event_data.take().expect("span is already entered"),
+                ));
+            }
+            BatchedSpanState::SampledOut => {}
+        }
+    }
+
+    /// Record the end of the span and flush the batch of the current thread.
+    pub fn exit(&mut self) {
+        match &mut self.0 {
+            BatchedSpanState::Packed { event, entered, .. } => {
+                if let Some(thread_id) = entered.take() {
+                    assert!(thread_id == thread::current().id());
+                    with_batch(|batch| {
+                        batch.push(event.end_event(), String::new());
+                        batch.open_spans -= 1;
+                        batch.flush();
+                    });
+                }
+            }
+            BatchedSpanState::Direct { trace_event, .. } => {
+                if trace_event.is_some() {
+                    with_batch(|batch| {
+                        batch.flush();
+                        batch.open_spans -= 1;
+                    });
+                    *trace_event = None;
+                }
+            }
+            BatchedSpanState::SampledOut => {}
+        }
+    }
+}
+
+/// Emit the given `EventData` as a slice from `begin` to `end` (see `trace_time_ns`) through the
+/// batch of the current thread, e.g. for a span that is only emitted once it has ended.
+/// Dynamic names and categories are interned.
+/// The slice is not emitted if it is sampled out, see `set_sampling_rules`.
+pub fn create_batched_slice(event_data: EventData, begin: u64, end: u64) {
+    if !event_data.sample() {
+        return;
+    }
+
+    match event_data.into_batched_event(PackedEventType::Begin) {
+        Ok((event, strings_storage)) => {
+            with_batch(|batch| batch.push_slice(event, strings_storage, begin, end))
+        }
+        Err(event_data) => {
+            flush_event_batch();
+            TraceEvent::new_unsampled_at(event_data, begin).end_at(end);
+        }
+    }
+}
+
+/// Emit the given `EventData` as an instant event through the batch of the current thread.
+/// Dynamic names and categories are interned.
+pub fn create_batched_instant_event(event_data: EventData) {
+    if !event_data.sample() {
+        return;
+    }
+
+    match event_data.into_batched_event(PackedEventType::Instant) {
+        Ok((event, strings_storage)) => push_batched(event, strings_storage),
+        Err(event_data) => {
+            flush_event_batch();
+            event_data.emit_instant();
+        }
+    }
+}
+
+impl CounterHandle {
+    /// Update the value of the counter through the batch of the current thread
+    /// with a 64-bit unsigned integer.
+    pub fn set_u64_batched(&self, value: u64) {
+        push_batched(PackedEvent::counter_u64(self, value), String::new());
+    }
+
+    /// Update the value of the counter through the batch of the current thread
+    /// with a 64-bit floating point number.
+    pub fn set_f64_batched(&self, value: f64) {
+        push_batched(PackedEvent::counter_f64(self, value), String::new());
+    }
+}
@@ -7,19 +7,35 @@ use std::{
 
 extern "C" {
     fn update_counter_u64(
-        category: u32,
+        category: *const c_char,
         name: *const c_char,
         unit: *const c_char,
         is_increment: bool,
         value: u64,
     );
     fn update_counter_f64(
-        category: u32,
+        category: *const c_char,
         name: *const c_char,
         unit: *const c_char,
         is_increment: bool,
         value: f64,
     );
+    fn register_counter(
+        category: *const c_char,
+        name: *const c_char,
+        unit: *const c_char,
+        is_increment: bool,
+    ) -> u64;
+    fn register_thread_counter(
+        category: *const c_char,
+        name: *const c_char,
+        unit: *const c_char,
+        is_increment: bool,
+    ) -> u64;
+    fn update_registered_counter_u64(counter: u64, value: u64);
+    fn update_registered_counter_f64(counter: u64, value: f64);
+    fn update_registered_counter_u64_at(counter: u64, timestamp: u64, value: u64);
+    fn update_registered_counter_f64_at(counter: u64, timestamp: u64, value: f64);
 }
 
 /// Update the value of a counter with a 64-bit unsigned integer.
@@ -28,7 +44,7 @@ pub fn set_counter_u64(name: &str, unit: Option<&str>, is_incremental: bool, val
     let unit = unit.map(|s| CString::new(s).unwrap());
     unsafe {
         update_counter_u64(
-            0,
+            null(),
             name.as_ptr(),
             unit.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
             is_incremental,
@@ -43,7 +59,7 @@ pub fn set_counter_f64(name: &str, unit: Option<&str>, is_incremental: bool, val
     let unit = unit.map(|s| CString::new(s).unwrap());
     unsafe {
         update_counter_f64(
-            0,
+            null(),
             name.as_ptr(),
             unit.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
             is_incremental,
@@ -51,3 +67,87 @@ pub fn set_counter_f64(name: &str, unit: Option<&str>, is_incremental: bool, val
         )
     }
 }
+
+/// Counter track registered once. Updating it is a single FFI call without allocations,
+/// use it for counters that are sampled frequently.
+///
+/// Registered counters are never freed, so create one handle per counter and reuse it.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct CounterHandle(u64);
+
+impl CounterHandle {
+    /// Register a counter track.
+    /// If `category` is None the default category will be used.
+    pub fn new(
+        category: Option<&str>,
+        name: &str,
+        unit: Option<&str>,
+        is_incremental: bool,
+    ) -> Self {
+        Self::register(register_counter, category, name, unit, is_incremental)
+    }
+
+    /// Register a counter track of the current thread, shown under its thread track.
+    /// Use it for per-thread values, e.g. hardware counters, and only update it from this thread.
+    /// If `category` is None the default category will be used.
+    pub fn new_for_current_thread(
+        category: Option<&str>,
+        name: &str,
+        unit: Option<&str>,
+        is_incremental: bool,
+    ) -> Self {
+        Self::register(
+            register_thread_counter,
+            category,
+            name,
+            unit,
+            is_incremental,
+        )
+    }
+
+    fn register(
+        register: unsafe extern "C" fn(*const c_char, *const c_char, *const c_char, bool) -> u64,
+        category: Option<&str>,
+        name: &str,
+        unit: Option<&str>,
+        is_incremental: bool,
+    ) -> Self {
+        let category = category.map(|s| CString::new(s).expect("category is not a valid string"));
+        let name = CString::new(name).expect("name is not a valid string");
+        let unit = unit.map(|s| CString::new(s).expect("unit is not a valid string"));
+        let handle = unsafe {
+            register(
+                category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                name.as_ptr(),
+                unit.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                is_incremental,
+            )
+        };
+
+        Self(handle)
+    }
+
+    pub(crate) fn handle(&self) -> u64 {
+        self.0
+    }
+
+    /// Update the value of the counter with a 64-bit unsigned integer.
+    pub fn set_u64(&self, value: u64) {
+        unsafe { update_registered_counter_u64(self.0, value) }
+    }
+
+    /// Update the value of the counter with a 64-bit floating point number.
+    pub fn set_f64(&self, value: f64) {
+        unsafe { update_registered_counter_f64(self.0, value) }
+    }
+
+    /// Update the value of the counter at `timestamp` (see `trace_time_ns`) with a 64-bit unsigned integer.
+    pub fn set_u64_at(&self, timestamp: u64, value: u64) {
+        unsafe { update_registered_counter_u64_at(self.0, timestamp, value) }
+    }
+
+    /// Update the value of the counter at `timestamp` (see `trace_time_ns`) with a 64-bit floating point number.
+    pub fn set_f64_at(&self, timestamp: u64, value: f64) {
+        unsafe { update_registered_counter_f64_at(self.0, timestamp, value) }
+    }
+}
@@ -0,0 +1,511 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Deferred mode: instead of emitting every event through the Perfetto SDK on the calling
+//! thread, the threads push fixed-size records into their own single-producer single-consumer
+//! ring, and a drain thread replays them into Perfetto in bulk with the recorded timestamps.
+
+use std::{
+    cell::{RefCell, UnsafeCell},
+    mem::MaybeUninit,
+    sync::{
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+        Arc, Condvar, Mutex,
+    },
+    thread::{self, JoinHandle, ThreadId},
+    time::Duration,
+};
+
+use crate::{
+    batch::{PackedEvent, PackedEventType},
+    event::trace_time_ns,
+    CounterHandle, EventData, TraceEvent,
+};
+
+/// Name of the counter track with the total number of dropped records.
+const DROPPED_COUNTER_NAME: &str = "deferred_dropped_events";
+
+extern "C" {
+    fn register_thread_track() -> u64;
+    fn replay_deferred_events(thread_track: u64, events: *const PackedEvent, count: usize);
+}
+
+/// Configuration of the deferred mode.
+#[derive(Debug, Clone)]
+pub struct DeferredConfig {
+    /// Number of records in the ring of each thread. Rounded up to a power of two.
+    pub ring_capacity: usize,
+    /// How often the drain thread replays the recorded events.
+    pub drain_period: Duration,
+}
+
+impl Default for DeferredConfig {
+    fn default() -> Self {
+        Self {
+            ring_capacity: 4096,
+            drain_period: Duration::from_millis(10),
+        }
+    }
+}
+
+/// Capacity of the rings created from now on.
+static RING_CAPACITY: AtomicUsize = AtomicUsize::new(4096);
+/// Rings of all threads that have recorded events. Locked by the producers only once per thread.
+static RINGS: Mutex<Vec<Arc<ThreadRing>>> = Mutex::new(Vec::new());
+/// Dropped records of the threads that have exited.
+static RETIRED_DROPPED: AtomicU64 = AtomicU64::new(0);
+
+struct ThreadRing {
+    records: Box<[UnsafeCell<MaybeUninit<PackedEvent>>]>,
+    /// Position of the next record to write, modified only by the producer.
+    head: AtomicUsize,
+    /// Position of the next record to read, modified only by the drain thread.
+    tail: AtomicUsize,
+    dropped: AtomicU64,
+    /// Handle returned by `register_thread_track`.
+    thread_track: u64,
+}
+
+// Safety: a slot is written only by the producer before `head` is published and read only by
+// the drain thread before `tail` is published.
+unsafe impl Sync for ThreadRing {}
+
+impl ThreadRing {
+    fn new(capacity: usize, thread_track: u64) -> Self {
+        Self {
+            records: (0..capacity)
+                .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+                .collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            dropped: AtomicU64::new(0),
+            thread_track,
+        }
+    }
+
+    fn capacity(&self) -> usize {
+        self.records.len()
+    }
+
+    fn is_empty(&self) -> bool {
+        self.head.load(Ordering::Acquire) == self.tail.load(Ordering::Acquire)
+    }
+
+    /// Replay all the published records. Must be called only from the drain thread.
+    fn drain(&self) {
+        self.drain_with(|records| unsafe {
+            replay_deferred_events(self.thread_track, records.as_ptr(), records.len())
+        });
+    }
+
+    /// Pass the published records to `replay`, in one or two slices.
+    fn drain_with(&self, mut replay: impl FnMut(&[PackedEvent])) {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let head = self.head.load(Ordering::Acquire);
+        if head == tail {
+            return;
+        }
+
+        // replay the records in place, the ring wraps around at most once
+        let start = tail % self.capacity();
+        let count = head - tail;
+        let first = count.min(self.capacity() - start);
+        unsafe {
+            let records = self.records.as_ptr() as *const PackedEvent;
+            replay(std::slice::from_raw_parts(records.add(start), first));
+            if count > first {
+                replay(std::slice::from_raw_parts(records, count - first));
+            }
+        }
+
+        self.tail.store(head, Ordering::Release);
+    }
+}
+
+/// Producer side of the ring of the current thread.
+struct Producer {
+    ring: Arc<ThreadRing>,
+    /// Last observed value of `ring.tail`.
+    cached_tail: usize,
+    /// Number of recorded begins without an end. A slot is reserved for each of their ends,
+    /// so that an end is never dropped after its begin was recorded.
+    open_spans: usize,
+}
+
+impl Producer {
+    fn new() -> Self {
+        let capacity = RING_CAPACITY.load(Ordering::Relaxed);
+        let ring = Arc::new(ThreadRing::new(capacity, unsafe {
+            register_thread_track()
+        }));
+        RINGS.lock().unwrap().push(ring.clone());
+
+        Self::with_ring(ring)
+    }
+
+    fn with_ring(ring: Arc<ThreadRing>) -> Self {
+        Self {
+            ring,
+            cached_tail: 0,
+            open_spans: 0,
+        }
+    }
+
+    /// Push `record` unless the ring is full, keeping room for the ends of the open spans.
+    fn record(&mut self, record: &PackedEvent) -> bool {
+        match record.event_type {
+            PackedEventType::Begin => {
+                let recorded = self.push(record, self.open_spans + 1);
+                self.open_spans += recorded as usize;
+                recorded
+            }
+            PackedEventType::End => {
+                self.open_spans = self.open_spans.saturating_sub(1);
+                self.push(record, self.open_spans)
+            }
+            PackedEventType::Instant
+            | PackedEventType::CounterU64
+            | PackedEventType::CounterF64 => self.push(record, self.open_spans),
+        }
+    }
+
+    /// Push `record` if there is room for it and for `reserved` more records afterwards.
+    fn push(&mut self, record: &PackedEvent, reserved: usize) -> bool {
+        let head = self.ring.head.load(Ordering::Relaxed);
+        let capacity = self.ring.capacity();
+        if head - self.cached_tail + 1 + reserved > capacity {
+            self.cached_tail = self.ring.tail.load(Ordering::Acquire);
+            if head - self.cached_tail + 1 + reserved > capacity {
+                self.ring.dropped.fetch_add(1, Ordering::Relaxed);
+                return false;
+            }
+        }
+
+        unsafe { (*self.ring.records[head % capacity].get()).write(*record) };
+        self.ring.head.store(head + 1, Ordering::Release);
+        true
+    }
+}
+
+thread_local! {
+    static PRODUCER: RefCell<Option<Producer>> = const { RefCell::new(None) };
+}
+
+// Record `record` into the ring of the current thread, returns false if the record was dropped.
+fn record(record: PackedEvent) -> bool {
+    record_at(record, trace_time_ns())
+}
+
+fn record_at(mut record: PackedEvent, timestamp: u64) -> bool {
+    record.timestamp = timestamp;
+    PRODUCER
+        .try_with(|producer| {
+            let mut producer = producer.borrow_mut();
+            producer.get_or_insert_with(Producer::new).record(&record)
+        })
+        .unwrap_or(false)
+}
+
+/// Total number of records dropped because the ring of the thread was full.
+pub fn deferred_dropped_events() -> u64 {
+    let rings = RINGS.lock().unwrap();
+    rings
+        .iter()
+        .map(|ring| ring.dropped.load(Ordering::Relaxed))
+        .sum::<u64>()
+        + RETIRED_DROPPED.load(Ordering::Relaxed)
+}
+
+/// Replay the records of all threads and forget the rings of the threads that have exited.
+fn drain_all() {
+    let rings = RINGS.lock().unwrap().clone();
+    for ring in &rings {
+        ring.drain();
+    }
+    drop(rings);
+
+    RINGS.lock().unwrap().retain(|ring| {
+        // the ring is referenced by the producer as long as the thread is alive
+        let retired = Arc::strong_count(ring) == 1 && ring.is_empty();
+        if retired {
+            RETIRED_DROPPED.fetch_add(ring.dropped.load(Ordering::Relaxed), Ordering::Relaxed);
+        }
+        !retired
+    });
+}
+
+/// Span recorded in the deferred mode. Enter and exit have to happen on the same thread.
+///
+/// The record has a fixed size and may outlive the fields of the span, so string arguments are
+/// not recorded and only the first `PACKED_EVENT_MAX_ARGS` of the other arguments are kept.
+/// Flow IDs count as arguments.
+///
+/// The spans with a dynamic name that cannot be interned, because the thread has interned too
+/// many names already, are emitted directly instead, with all their arguments.
+pub struct DeferredSpan(DeferredSpanState);
+
+enum DeferredSpanState {
+    Recorded {
+        record: PackedEvent,
+        /// Thread of the recorded begin, if the span is entered and the begin was not dropped.
+        entered: Option<ThreadId>,
+    },
+    /// Events that cannot be recorded are emitted directly.
+    Direct {
+        event_data: Option<EventData>,
+        trace_event: Option<TraceEvent>,
+    },
+    /// Nothing is recorded, see `set_sampling_rules`.
+    SampledOut,
+}
+
+impl DeferredSpan {
+    /// See the type documentation for what is recorded.
+    pub fn new(event_data: EventData) -> Self {
+        if !event_data.sample() {
+            return Self(DeferredSpanState::SampledOut);
+        }
+
+        match event_data.into_deferred_event(PackedEventType::Begin) {
+            Ok(record) => Self(DeferredSpanState::Recorded {
+                record,
+                entered: None,
+            }),
+            Err(event_data) => Self(DeferredSpanState::Direct {
+                event_data: Some(event_data),
+                trace_event: None,
+            }),
+        }
+    }
+
+    /// Record the begin of the span.
+    pub fn enter(&mut self) {
+        match &mut self.0 {
+            DeferredSpanState::Recorded {
+                record: begin,
+                entered,
+            } => {
+                assert!(entered.is_none(), "span is already entered");
+                if record(*begin) {
+                    *entered = Some(thread::current().id());
+                }
+            }
+            DeferredSpanState::Direct {
+                event_data,
+                trace_event,
+            } => {
+                *trace_event = Some(TraceEvent::new_unsampled(
+                    event_data.take().expect("span is already entered"),
+                ));
+            }
+            DeferredSpanState::SampledOut => {}
+        }
+    }
+
+    /// Record the end of the span. Does nothing if the begin was dropped.
+    pub fn exit(&mut self) {
+        match &mut self.0 {
+            DeferredSpanState::Recorded {
+                record: begin,
+                entered,
+            } => {
+                if let Some(thread_id) = entered.take() {
+                    assert!(thread_id == thread::current().id());
+                    record(begin.end_event());
+                }
+            }
+            DeferredSpanState::Direct { trace_event, .. } => *trace_event = None,
+            DeferredSpanState::SampledOut => {}
+        }
+    }
+}
+
+/// Record the given `EventData` as a slice from `begin` to `end` (see `trace_time_ns`) in the
+/// deferred mode, e.g. for a span that is only recorded once it has ended. The arguments are
+/// truncated as for `DeferredSpan`. Nothing is recorded if the slice is sampled out.
+pub fn record_deferred_slice(event_data: EventData, begin: u64, end: u64) {
+    if !event_data.sample() {
+        return;
+    }
+    match event_data.into_deferred_event(PackedEventType::Begin) {
+        Ok(begin_record) => {
+            if record_at(begin_record, begin) {
+                record_at(begin_record.end_event(), end);
+            }
+        }
+        Err(event_data) => TraceEvent::new_unsampled_at(event_data, begin).end_at(end),
+    }
+}
+
+/// Record the given `EventData` as an instant event of the deferred mode.
+/// The arguments are truncated as for `DeferredSpan`.
+pub fn record_deferred_instant_event(event_data: EventData) {
+    if !event_data.sample() {
+        return;
+    }
+    match event_data.into_deferred_event(PackedEventType::Instant) {
+        Ok(instant) => _ = record(instant),
+        Err(event_data) => event_data.emit_instant(),
+    }
+}
+
+/// Background thread replaying the deferred records into Perfetto.
+pub(crate) struct Drainer {
+    /// Set to true to stop the thread.
+    stop: Arc<(Mutex<bool>, Condvar)>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Drainer {
+    pub(crate) fn start(config: DeferredConfig) -> Self {
+        RING_CAPACITY.store(
+            config.ring_capacity.max(2).next_power_of_two(),
+            Ordering::Relaxed,
+        );
+
+        let stop = Arc::new((Mutex::new(false), Condvar::new()));
+        let thread = thread::Builder::new()
+            .name("perfetto-drain".to_string())
+            .spawn({
+                let stop = stop.clone();
+                move || {
+                    let dropped_counter =
+                        CounterHandle::new(None, DROPPED_COUNTER_NAME, None, false);
+                    let mut last_dropped = 0;
+
+                    let (stopped, condvar) = &*stop;
+                    let mut stopped = stopped.lock().unwrap();
+                    loop {
+                        (stopped, _) = condvar.wait_timeout(stopped, config.drain_period).unwrap();
+                        drain_all();
+
+                        let dropped = deferred_dropped_events();
+                        if dropped != last_dropped {
+                            dropped_counter.set_u64(dropped);
+                            last_dropped = dropped;
+                        }
+
+                        if *stopped {
+                            break;
+                        }
+                    }
+                }
+            })
+            .expect("failed to spawn the drain thread");
+
+        Self {
+            stop,
+            thread: Some(thread),
+        }
+    }
+}
+
+impl Drop for Drainer {
+    fn drop(&mut self) {
+        // the thread drains everything recorded so far before exiting
+        let (stopped, condvar) = &*self.stop;
+        *stopped.lock().unwrap() = true;
+        condvar.notify_one();
+
+        if let Some(thread) = self.thread.take() {
+            _ = thread.join();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn event(event_type: PackedEventType, timestamp: u64) -> PackedEvent {
+        let mut event = PackedEvent::new(event_type, 0, 0, None);
+        event.timestamp = timestamp;
+        event
+    }
+
+    /// Types and timestamps of the drained records.
+    fn drain(ring: &ThreadRing) -> Vec<(PackedEventType, u64)> {
+        let mut drained = Vec::new();
+        ring.drain_with(|records| {
+            drained.extend(
+                records
+                    .iter()
+                    .map(|record| (record.event_type, record.timestamp)),
+            )
+        });
+        drained
+    }
+
+    #[test]
+    fn test_ring_wraparound() {
+        let ring = Arc::new(ThreadRing::new(4, 0));
+        let mut producer = Producer::with_ring(ring.clone());
+
+        for timestamp in 0..3 {
+            assert!(producer.record(&event(PackedEventType::Instant, timestamp)));
+        }
+        assert_eq!(drain(&ring).len(), 3);
+        assert!(ring.is_empty());
+
+        // the next records start at the last slot and wrap around to the first ones
+        let mut slices = 0;
+        for timestamp in 3..7 {
+            assert!(producer.record(&event(PackedEventType::Instant, timestamp)));
+        }
+        assert!(!producer.record(&event(PackedEventType::Instant, 7)));
+        let mut drained = Vec::new();
+        ring.drain_with(|records| {
+            slices += 1;
+            drained.extend(records.iter().map(|record| record.timestamp));
+        });
+        assert_eq!(slices, 2);
+        assert_eq!(drained, vec![3, 4, 5, 6]);
+        assert_eq!(ring.dropped.load(Ordering::Relaxed), 1);
+    }
+
+    #[test]
+    fn test_overflow_drops_whole_spans() {
+        use PackedEventType::*;
+
+        let ring = Arc::new(ThreadRing::new(4, 0));
+        let mut producer = Producer::with_ring(ring.clone());
+
+        // the begins keep a slot for the ends of all the open spans
+        assert!(producer.record(&event(Begin, 0)));
+        assert!(producer.record(&event(Begin, 1)));
+        assert!(!producer.record(&event(Begin, 2)));
+        assert!(!producer.record(&event(Instant, 3)));
+        assert!(producer.record(&event(End, 4)));
+        assert!(producer.record(&event(End, 5)));
+        assert_eq!(
+            drain(&ring),
+            vec![(Begin, 0), (Begin, 1), (End, 4), (End, 5)]
+        );
+        assert_eq!(ring.dropped.load(Ordering::Relaxed), 2);
+
+        // once drained there is room again
+        assert!(producer.record(&event(Begin, 6)));
+        assert!(producer.record(&event(Instant, 7)));
+        assert!(producer.record(&event(End, 8)));
+        assert_eq!(drain(&ring), vec![(Begin, 6), (Instant, 7), (End, 8)]);
+    }
+
+    #[test]
+    fn test_dropped_events() {
+        let ring = Arc::new(ThreadRing::new(2, 0));
+        let mut producer = Producer::with_ring(ring.clone());
+        let before = deferred_dropped_events();
+        RINGS.lock().unwrap().push(ring.clone());
+
+        for timestamp in 0..5 {
+            producer.record(&event(PackedEventType::Instant, timestamp));
+        }
+        assert_eq!(deferred_dropped_events(), before + 3);
+
+        // the drops of the exited threads are still counted
+        drain(&ring);
+        drop(producer);
+        drop(ring);
+        drain_all();
+        assert_eq!(deferred_dropped_events(), before + 3);
+    }
+}
@@ -0,0 +1,58 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Enabled state of the categories, readable without calling into the SDK. Use it to skip
+//! building the events that would be discarded anyway, e.g. while tracing is stopped.
+
+use std::sync::{
+    atomic::{AtomicU8, Ordering},
+    OnceLock,
+};
+
+use crate::event::{get_category_handle, DEFAULT_CATEGORY};
+
+extern "C" {
+    fn enabled_category_flags(static_category_count: *mut usize) -> *const u8;
+    fn set_enabled_flags_callback(callback: Option<extern "C" fn()>);
+}
+
+/// Flags of the static categories followed by the one of the running sessions,
+/// see `enabled_category_flags` in wrapper.h.
+fn flags() -> &'static [AtomicU8] {
+    static FLAGS: OnceLock<&'static [AtomicU8]> = OnceLock::new();
+    FLAGS.get_or_init(|| {
+        let mut static_category_count = 0;
+        unsafe {
+            let flags = enabled_category_flags(&mut static_category_count);
+            std::slice::from_raw_parts(flags as *const AtomicU8, static_category_count + 1)
+        }
+    })
+}
+
+/// Whether a tracing session is running.
+pub fn is_tracing_enabled() -> bool {
+    let flags = flags();
+    flags[flags.len() - 1].load(Ordering::Relaxed) != 0
+}
+
+/// Whether the events of `category` may be recorded. If `category` is None the default category
+/// is checked. The state of the static categories is exact, other categories are reported as
+/// enabled while a session is running. The state may lag behind a stopping session.
+pub fn is_category_enabled(category: Option<&str>) -> bool {
+    let category = category
+        .map(get_category_handle)
+        .unwrap_or(DEFAULT_CATEGORY);
+    let flags = flags();
+    let static_category_count = flags.len() - 1;
+    let index = match usize::try_from(category) {
+        Ok(index) if index < static_category_count => index,
+        // a dynamic category
+        _ => static_category_count,
+    };
+    flags[index].load(Ordering::Relaxed) != 0
+}
+
+/// Call `callback` after the enabled state changes, e.g. to re-evaluate cached decisions.
+/// The callback is called from a thread of the SDK and must not emit events. `None` removes it.
+pub fn set_enabled_state_callback(callback: Option<extern "C" fn()>) {
+    unsafe { set_enabled_flags_callback(callback) }
+}
@@ -10,4 +10,12 @@ pub enum Error {
     ProcessError(String, std::io::Error),
     #[error("external process {0} failed with code {1}")]
     ProcessReturnedError(String, i32),
+    #[error("failed to write a trace snapshot to {0}")]
+    SnapshotError(String),
+    #[error("snapshots are not supported while the trace is rotated into chunks")]
+    SnapshotWhileRotating,
+    #[error("failed to write the trace to {0}")]
+    TraceWriteError(String),
+    #[error("invalid trace {0}: {1}")]
+    InvalidTrace(String, String),
 }
@@ -1,15 +1,23 @@
 // Copyright 2024-2025 Irreducible Inc.
 
+use crate::{
+    batch::{PackedEvent, PackedEventType, PACKED_EVENT_MAX_ARGS},
+    pool, sampling,
+};
+use std::cell::RefCell;
 use std::collections::HashMap;
+use std::hash::{BuildHasherDefault, Hasher};
 use std::sync::{Mutex, OnceLock};
 use std::{
-    ffi::{c_char, CString},
+    ffi::{c_char, CStr, CString},
+    fmt::Write,
     ptr::null,
     thread::{self, ThreadId},
 };
 
-// Get stable pointer for `key`
-fn get_key_ptr(key: &'static str) -> *const c_char {
+// Get stable pointer for `key` from the global pool. The strings are never freed, so the same
+// key always yields the same pointer, which perfetto interns as the debug annotation name.
+fn get_pooled_key_ptr(key: &'static str) -> *const c_char {
     static KEY_POOL: OnceLock<Mutex<HashMap<&'static str, CString>>> = OnceLock::new();
     let map = KEY_POOL.get_or_init(|| Mutex::new(HashMap::new()));
     let mut guard = map.lock().unwrap();
@@ -19,14 +27,126 @@ fn get_key_ptr(key: &'static str) -> *const c_char {
         .as_ptr()
 }
 
+/// Hasher for the address and length of a static string.
+#[derive(Default)]
+struct KeyAddressHasher(u64);
+
+impl Hasher for KeyAddressHasher {
+    fn finish(&self) -> u64 {
+        self.0
+    }
+
+    fn write(&mut self, bytes: &[u8]) {
+        for byte in bytes {
+            self.write_u64(*byte as u64);
+        }
+    }
+
+    fn write_u64(&mut self, value: u64) {
+        self.0 = (self.0.rotate_left(5) ^ value).wrapping_mul(0x517c_c1b7_2722_0a95);
+    }
+
+    fn write_usize(&mut self, value: usize) {
+        self.write_u64(value as u64);
+    }
+}
+
+// Get stable pointer for `key`. Each thread looks a key up in the global pool only once,
+// afterwards it is found by its address without taking any lock.
+fn get_key_ptr(key: &'static str) -> *const c_char {
+    type KeyPtrs = HashMap<(usize, usize), *const c_char, BuildHasherDefault<KeyAddressHasher>>;
+    thread_local! {
+        static KEY_PTRS: RefCell<KeyPtrs> = RefCell::new(KeyPtrs::default());
+    }
+    KEY_PTRS
+        .try_with(|key_ptrs| {
+            *key_ptrs
+                .borrow_mut()
+                .entry((key.as_ptr() as usize, key.len()))
+                .or_insert_with(|| get_pooled_key_ptr(key))
+        })
+        .unwrap_or_else(|_| get_pooled_key_ptr(key))
+}
+
+// Get the interned handle for the event `name`. Each thread registers a name only once.
+fn get_name_handle(name: &'static str) -> u64 {
+    thread_local! {
+        static NAME_HANDLES: RefCell<HashMap<&'static str, u64>> = RefCell::new(HashMap::new());
+    }
+    NAME_HANDLES.with_borrow_mut(|handles| {
+        *handles.entry(name).or_insert_with(|| {
+            let name = CString::new(name).expect("invalid event name");
+            unsafe { register_event_name(name.as_ptr()) }
+        })
+    })
+}
+
+/// Number of dynamic names interned by each thread. The registered names are never freed, so
+/// the events with the other names are not packed and pass their name with every event.
+const MAX_CACHED_DYNAMIC_NAMES: usize = 4096;
+
+// Get the interned handle for the dynamic event `name`. Each thread registers a name only once.
+// Returns `None` once the cache of the thread is full and the name is not in it.
+fn get_dynamic_name_handle(name: &CStr) -> Option<u64> {
+    thread_local! {
+        static DYNAMIC_NAME_HANDLES: RefCell<HashMap<CString, u64>> = RefCell::new(HashMap::new());
+    }
+    DYNAMIC_NAME_HANDLES
+        .try_with(|handles| {
+            let mut handles = handles.borrow_mut();
+            if let Some(handle) = handles.get(name) {
+                return Some(*handle);
+            }
+            if handles.len() >= MAX_CACHED_DYNAMIC_NAMES {
+                return None;
+            }
+
+            let handle = unsafe { register_event_name(name.as_ptr()) };
+            handles.insert(name.to_owned(), handle);
+            Some(handle)
+        })
+        .ok()
+        .flatten()
+}
+
+/// Register the event `name`, see `register_event_name` in wrapper.h.
+pub(crate) fn register_name(name: &str) -> u64 {
+    let name = CString::new(name).expect("invalid event name");
+    unsafe { register_event_name(name.as_ptr()) }
+}
+
+// Get the handle for the `category`. Each thread registers a category only once.
+pub(crate) fn get_category_handle(category: &str) -> u64 {
+    thread_local! {
+        static CATEGORY_HANDLES: RefCell<HashMap<String, u64>> = RefCell::new(HashMap::new());
+    }
+    CATEGORY_HANDLES.with_borrow_mut(|handles| {
+        if let Some(handle) = handles.get(category) {
+            return *handle;
+        }
+
+        let category_str = CString::new(category).expect("category is not a valid string");
+        let handle = unsafe { register_category(category_str.as_ptr()) };
+        handles.insert(category.to_string(), handle);
+        handle
+    })
+}
+
+/// Handle of the default category, see `kDefaultCategory` in wrapper.h.
+pub(crate) const DEFAULT_CATEGORY: u64 = 0;
+
 #[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 enum ArgType {
     FlowID = 0,
+    /// NUL-terminated string value, the string values are passed as `StringViewKeyValue`.
+    #[allow(dead_code)]
     StringKeyValue,
     F64KeyValue,
     I64KeyValue,
     U64KeyValue,
     BoolKeyValue,
+    StringViewKeyValue,
 }
 
 #[repr(u8)]
@@ -42,7 +162,16 @@ struct KeyValue<T> {
     value: T,
 }
 
+/// See `StringView` in wrapper.h.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct StringView {
+    ptr: *const c_char,
+    len: usize,
+}
+
 #[repr(C)]
+#[derive(Clone, Copy)]
 union ArgValue {
     u64: u64,
     string_key_value: KeyValue<*const c_char>,
@@ -50,14 +179,24 @@ union ArgValue {
     i64_key_value: KeyValue<i64>,
     u64_key_value: KeyValue<u64>,
     bool_key_value: KeyValue<bool>,
+    string_view_key_value: KeyValue<StringView>,
 }
 
 #[repr(C)]
-struct PerfettoArg {
+#[derive(Clone, Copy)]
+pub(crate) struct PerfettoArg {
     data: ArgValue,
     arg_type: ArgType,
 }
 
+impl PerfettoArg {
+    /// Placeholder for the unused argument slots.
+    pub(crate) const EMPTY: Self = Self {
+        data: ArgValue { u64: 0 },
+        arg_type: ArgType::FlowID,
+    };
+}
+
 extern "C" {
     fn create_event(
         event_type: EventType,
@@ -68,43 +207,190 @@ extern "C" {
         arg_count: usize,
     );
     fn destroy_event(category: *const c_char, track_id: *const u64);
+    fn register_event_name(name: *const c_char) -> u64;
+    fn register_category(category: *const c_char) -> u64;
+    fn create_event_interned(
+        event_type: EventType,
+        category: u64,
+        name: u64,
+        track_id: *const u64,
+        args: *const PerfettoArg,
+        arg_count: usize,
+    );
+    fn destroy_event_interned(category: u64, track_id: *const u64);
+    fn create_event_at(
+        event_type: EventType,
+        category: *const c_char,
+        name: *const c_char,
+        track_id: *const u64,
+        timestamp: u64,
+        args: *const PerfettoArg,
+        arg_count: usize,
+    );
+    fn destroy_event_at(category: *const c_char, track_id: *const u64, timestamp: u64);
+    fn create_event_interned_at(
+        event_type: EventType,
+        category: u64,
+        name: u64,
+        track_id: *const u64,
+        timestamp: u64,
+        args: *const PerfettoArg,
+        arg_count: usize,
+    );
+    fn destroy_event_interned_at(category: u64, track_id: *const u64, timestamp: u64);
+    #[cfg(not(any(target_os = "linux", target_os = "android")))]
+    fn get_trace_time_ns() -> u64;
+}
+
+/// Current time of the trace clock in nanoseconds.
+/// Use it to get timestamps for the events emitted with an explicit time.
+pub fn trace_time_ns() -> u64 {
+    // perfetto uses the boot time clock on Linux, read it without crossing the FFI boundary
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    {
+        let mut time = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        unsafe { libc::clock_gettime(libc::CLOCK_BOOTTIME, &mut time) };
+        time.tv_sec as u64 * 1_000_000_000 + time.tv_nsec as u64
+    }
+    #[cfg(not(any(target_os = "linux", target_os = "android")))]
+    unsafe {
+        get_trace_time_ns()
+    }
+}
+
+/// The trace clock and the wall clock read at the same time.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ClockSnapshot {
+    /// See `trace_time_ns`.
+    pub trace_time_ns: u64,
+    /// Nanoseconds since the Unix epoch.
+    pub realtime_ns: u64,
+}
+
+/// Read the trace clock and the wall clock, e.g. to record how the timestamps of the trace relate
+/// to the ones of other hosts. The wall clock is read between two reads of the trace clock and
+/// paired with their midpoint.
+pub fn clock_snapshot() -> ClockSnapshot {
+    let before = trace_time_ns();
+    let realtime_ns = std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |time| time.as_nanos() as u64);
+    let after = trace_time_ns();
+
+    ClockSnapshot {
+        trace_time_ns: before + (after - before) / 2,
+        realtime_ns,
+    }
+}
+
+/// Event name, either copied into the trace with every event or interned.
+enum EventName {
+    Dynamic(CString),
+    Interned(u64),
+}
+
+/// Event category matching the `EventName` kind.
+#[derive(Debug)]
+enum EventCategory {
+    /// Category name. If None the default will be used
+    Dynamic(Option<CString>),
+    /// Handle returned by `register_category`
+    Interned(u64),
+}
+
+impl EventCategory {
+    fn destroy_event(&self, track_id: *const u64, timestamp: Option<u64>) {
+        match (self, timestamp) {
+            (EventCategory::Dynamic(category), None) => unsafe {
+                destroy_event(
+                    category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                    track_id,
+                )
+            },
+            (EventCategory::Dynamic(category), Some(timestamp)) => unsafe {
+                destroy_event_at(
+                    category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                    track_id,
+                    timestamp,
+                )
+            },
+            (EventCategory::Interned(category), None) => unsafe {
+                destroy_event_interned(*category, track_id)
+            },
+            (EventCategory::Interned(category), Some(timestamp)) => unsafe {
+                destroy_event_interned_at(*category, track_id, timestamp)
+            },
+        }
+    }
 }
 
 /// Represents a tracing event data.
 pub struct EventData {
     /// Name of the event.
-    name: CString,
-    /// Category of the event. If None the default will be used
-    category: Option<CString>,
+    name: EventName,
+    /// Category of the event.
+    category: EventCategory,
     /// Track id of the event. If None the current thread track will be used.
     track_id: Option<u64>,
-    /// Information about custom fields and flow id
+    /// Information about custom fields and flow id. Taken from the pool of the thread.
     args: Vec<PerfettoArg>,
-    /// Storage for the strings in the args
-    strings_storage: Vec<CString>,
+    /// Storage for the string values in the args, one after another. Taken from the pool of the
+    /// thread.
+    strings_storage: String,
+    /// Until the args are passed to perfetto, `StringView::ptr` of the string values holds
+    /// their offset in `strings_storage`, which can still be reallocated.
+    strings_resolved: bool,
 }
 
 impl EventData {
     pub fn new(name: &str) -> Self {
         Self {
-            category: None,
+            category: EventCategory::Dynamic(None),
             track_id: None,
-            name: CString::new(name).unwrap(),
-            strings_storage: Vec::new(),
+            name: EventName::Dynamic(CString::new(name).unwrap()),
+            strings_storage: String::new(),
+            strings_resolved: false,
+            args: Vec::new(),
+        }
+    }
+
+    /// Create an event with a static name that is written to the trace only once and referenced
+    /// by ID afterwards. The category is interned as well.
+    /// Prefer this for names from `tracing` metadata, the set of such names is bounded.
+    pub fn new_interned(name: &'static str) -> Self {
+        Self {
+            category: EventCategory::Interned(DEFAULT_CATEGORY),
+            track_id: None,
+            name: EventName::Interned(get_name_handle(name)),
+            strings_storage: String::new(),
+            strings_resolved: false,
             args: Vec::new(),
         }
     }
 
     pub fn set_category(&mut self, category: &str) {
-        self.category = Some(CString::new(category).expect("category is not a valid string"));
+        self.category = match self.category {
+            EventCategory::Dynamic(_) => EventCategory::Dynamic(Some(
+                CString::new(category).expect("category is not a valid string"),
+            )),
+            EventCategory::Interned(_) => EventCategory::Interned(get_category_handle(category)),
+        };
     }
 
     pub fn set_track_id(&mut self, track_id: u64) {
         self.track_id = Some(track_id);
     }
 
+    /// Custom track ID of the event, see `set_track_id`.
+    pub fn track_id(&self) -> Option<u64> {
+        self.track_id
+    }
+
     pub fn set_flow_id(&mut self, flow_id: u64) {
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue { u64: flow_id },
             arg_type: ArgType::FlowID,
         });
@@ -112,7 +398,7 @@ impl EventData {
 
     pub fn add_u64_field(&mut self, key: &'static str, value: u64) {
         let key_ptr = get_key_ptr(key);
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue {
                 u64_key_value: KeyValue {
                     key: key_ptr,
@@ -125,7 +411,7 @@ impl EventData {
 
     pub fn add_i64_field(&mut self, key: &'static str, value: i64) {
         let key_ptr = get_key_ptr(key);
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue {
                 i64_key_value: KeyValue {
                     key: key_ptr,
@@ -138,7 +424,7 @@ impl EventData {
 
     pub fn add_f64_field(&mut self, key: &'static str, value: f64) {
         let key_ptr = get_key_ptr(key);
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue {
                 f64_key_value: KeyValue {
                     key: key_ptr,
@@ -151,7 +437,7 @@ impl EventData {
 
     pub fn add_bool_field(&mut self, key: &'static str, value: bool) {
         let key_ptr = get_key_ptr(key);
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue {
                 bool_key_value: KeyValue {
                     key: key_ptr,
@@ -163,18 +449,222 @@ impl EventData {
     }
 
     pub fn add_string_arg(&mut self, key: &'static str, value: &str) {
+        let offset = self.strings_offset();
+        self.strings_storage.push_str(value);
+        self.push_string_view(key, offset);
+    }
+
+    /// Add a string argument with the `Debug` representation of `value`, formatted in place.
+    pub fn add_debug_arg(&mut self, key: &'static str, value: &dyn std::fmt::Debug) {
+        let offset = self.strings_offset();
+        _ = write!(self.strings_storage, "{value:?}");
+        self.push_string_view(key, offset);
+    }
+
+    fn push_arg(&mut self, arg: PerfettoArg) {
+        if self.args.capacity() == 0 {
+            self.args = pool::take_args();
+        }
+        self.args.push(arg);
+    }
+
+    /// Offset of the next string value in `strings_storage`.
+    fn strings_offset(&mut self) -> usize {
+        if self.strings_storage.capacity() == 0 {
+            self.strings_storage = pool::take_strings();
+        }
+        self.strings_storage.len()
+    }
+
+    /// Add the string value that starts at `offset` of `strings_storage` and ends at its end.
+    fn push_string_view(&mut self, key: &'static str, offset: usize) {
+        assert!(!self.strings_resolved, "event data is already emitted");
         let key_ptr = get_key_ptr(key);
-        let value = CString::new(value).expect("value is invalid string");
-        self.args.push(PerfettoArg {
+        self.push_arg(PerfettoArg {
             data: ArgValue {
-                string_key_value: KeyValue {
+                string_view_key_value: KeyValue {
                     key: key_ptr,
-                    value: value.as_ptr(),
+                    value: StringView {
+                        ptr: offset as *const c_char,
+                        len: self.strings_storage.len() - offset,
+                    },
                 },
             },
-            arg_type: ArgType::StringKeyValue,
+            arg_type: ArgType::StringViewKeyValue,
         });
-        self.strings_storage.push(value);
+    }
+
+    /// Turn the offsets of the string values into pointers into `strings_storage`.
+    /// No arguments can be added afterwards.
+    fn resolve_strings(&mut self) {
+        if self.strings_resolved {
+            return;
+        }
+        self.strings_resolved = true;
+
+        let base = self.strings_storage.as_ptr() as *const c_char;
+        for arg in &mut self.args {
+            if arg.arg_type == ArgType::StringViewKeyValue {
+                unsafe {
+                    let value = &mut arg.data.string_view_key_value.value;
+                    value.ptr = base.add(value.ptr as usize);
+                }
+            }
+        }
+    }
+
+    /// Convert to a record for the deferred mode. Dynamic names and categories are interned.
+    /// String arguments are not recorded, because the record may outlive their storage, and
+    /// only the first `PACKED_EVENT_MAX_ARGS` of the other arguments are kept.
+    /// Returns back the data if its dynamic name cannot be interned, see `get_dynamic_name_handle`.
+    pub(crate) fn into_deferred_event(
+        self,
+        event_type: PackedEventType,
+    ) -> Result<PackedEvent, Self> {
+        let Some(name) = self.packed_name() else {
+            return Err(self);
+        };
+        let args = self.args.iter().filter(|arg| {
+            !matches!(
+                arg.arg_type,
+                ArgType::StringKeyValue | ArgType::StringViewKeyValue
+            )
+        });
+        Ok(self.packed_event(name, event_type, args))
+    }
+
+    /// Convert to a record for `create_events_batch` together with the storage of its string
+    /// arguments. Dynamic names and categories are interned.
+    /// Returns back the data if there are more than `PACKED_EVENT_MAX_ARGS` arguments or its
+    /// dynamic name cannot be interned, see `get_dynamic_name_handle`.
+    pub(crate) fn into_batched_event(
+        mut self,
+        event_type: PackedEventType,
+    ) -> Result<(PackedEvent, String), Self> {
+        if self.args.len() > PACKED_EVENT_MAX_ARGS {
+            return Err(self);
+        }
+        let Some(name) = self.packed_name() else {
+            return Err(self);
+        };
+
+        // moving the string keeps its buffer in place
+        self.resolve_strings();
+        let event = self.packed_event(name, event_type, self.args.iter());
+        Ok((event, std::mem::take(&mut self.strings_storage)))
+    }
+
+    /// Interned handle of the name for a packed event.
+    fn packed_name(&self) -> Option<u64> {
+        match &self.name {
+            EventName::Interned(name) => Some(*name),
+            EventName::Dynamic(name) => get_dynamic_name_handle(name),
+        }
+    }
+
+    fn packed_event<'a>(
+        &self,
+        name: u64,
+        event_type: PackedEventType,
+        args: impl Iterator<Item = &'a PerfettoArg>,
+    ) -> PackedEvent {
+        let category = match &self.category {
+            EventCategory::Interned(category) => *category,
+            EventCategory::Dynamic(None) => DEFAULT_CATEGORY,
+            EventCategory::Dynamic(Some(category)) => unsafe {
+                register_category(category.as_ptr())
+            },
+        };
+
+        let mut event = PackedEvent::new(event_type, category, name, self.track_id);
+        for arg in args.take(PACKED_EVENT_MAX_ARGS) {
+            event.args[event.arg_count as usize] = *arg;
+            event.arg_count += 1;
+        }
+        event
+    }
+
+    /// Sampling decision for this event, see `set_sampling_rules`. Take it once per span.
+    pub(crate) fn sample(&self) -> bool {
+        let name = match &self.name {
+            EventName::Interned(name) => sampling::SampledName::Interned(*name),
+            EventName::Dynamic(name) => sampling::SampledName::Dynamic(name),
+        };
+        sampling::should_emit(name, || match &self.category {
+            EventCategory::Interned(category) => *category,
+            EventCategory::Dynamic(None) => DEFAULT_CATEGORY,
+            EventCategory::Dynamic(Some(category)) => category
+                .to_str()
+                .map(get_category_handle)
+                .unwrap_or(DEFAULT_CATEGORY),
+        })
+    }
+
+    /// Emit as an instant event, regardless of sampling.
+    pub(crate) fn emit_instant(mut self) {
+        self.emit(EventType::Instant, None);
+    }
+
+    fn emit(&mut self, event_type: EventType, timestamp: Option<u64>) {
+        self.resolve_strings();
+        let track_id = self
+            .track_id
+            .as_ref()
+            .map(|id| id as *const u64)
+            .unwrap_or(null());
+
+        match (&self.name, &self.category, timestamp) {
+            (EventName::Interned(name), EventCategory::Interned(category), None) => unsafe {
+                create_event_interned(
+                    event_type,
+                    *category,
+                    *name,
+                    track_id,
+                    self.args.as_ptr(),
+                    self.args.len(),
+                )
+            },
+            (EventName::Interned(name), EventCategory::Interned(category), Some(timestamp)) => unsafe {
+                create_event_interned_at(
+                    event_type,
+                    *category,
+                    *name,
+                    track_id,
+                    timestamp,
+                    self.args.as_ptr(),
+                    self.args.len(),
+                )
+            },
+            (EventName::Dynamic(name), EventCategory::Dynamic(category), None) => unsafe {
+                create_event(
+                    event_type,
+                    category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                    name.as_ptr(),
+                    track_id,
+                    self.args.as_ptr(),
+                    self.args.len(),
+                )
+            },
+            (EventName::Dynamic(name), EventCategory::Dynamic(category), Some(timestamp)) => unsafe {
+                create_event_at(
+                    event_type,
+                    category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
+                    name.as_ptr(),
+                    track_id,
+                    timestamp,
+                    self.args.as_ptr(),
+                    self.args.len(),
+                )
+            },
+            _ => unreachable!("event name and category are always of the same kind"),
+        }
+    }
+}
+
+impl Drop for EventData {
+    fn drop(&mut self) {
+        pool::release_args(std::mem::take(&mut self.args));
+        pool::release_strings(std::mem::take(&mut self.strings_storage));
     }
 }
 
@@ -187,35 +677,59 @@ unsafe impl Sync for EventData {}
 enum Track {
     CurrentThread(ThreadId),
     Custom(u64),
+    /// The span is sampled out, nothing was emitted.
+    SampledOut,
 }
 
 /// Represents a tracing span. Will exist until the struct is dropped.
 #[derive(Debug)]
 pub struct TraceEvent {
     track: Track,
-    category: Option<CString>,
+    category: EventCategory,
+    /// End time set by `end_at`. If None the time of the drop is used.
+    end_timestamp: Option<u64>,
 }
 
 impl TraceEvent {
+    /// The span is not emitted if it is sampled out, see `set_sampling_rules`.
     pub fn new(event_data: EventData) -> Self {
-        unsafe {
-            create_event(
-                EventType::Span,
-                event_data
-                    .category
-                    .as_ref()
-                    .map(|s| s.as_ptr())
-                    .unwrap_or(null()),
-                event_data.name.as_ptr(),
-                event_data
-                    .track_id
-                    .as_ref()
-                    .map(|id| id as *const u64)
-                    .unwrap_or(null()),
-                event_data.args.as_ptr(),
-                event_data.args.len(),
-            )
-        };
+        Self::new_sampled(event_data, None)
+    }
+
+    /// Begin the span at `timestamp` (see `trace_time_ns`) instead of now.
+    /// Useful to replay events that were recorded earlier.
+    pub fn new_at(event_data: EventData, timestamp: u64) -> Self {
+        Self::new_sampled(event_data, Some(timestamp))
+    }
+
+    fn new_sampled(event_data: EventData, timestamp: Option<u64>) -> Self {
+        if !event_data.sample() {
+            return Self {
+                track: Track::SampledOut,
+                category: EventCategory::Interned(DEFAULT_CATEGORY),
+                end_timestamp: None,
+            };
+        }
+        Self::new_with_timestamp(event_data, timestamp)
+    }
+
+    /// Begin the span now, regardless of sampling.
+    pub(crate) fn new_unsampled(event_data: EventData) -> Self {
+        Self::new_with_timestamp(event_data, None)
+    }
+
+    /// Begin the span at `timestamp`, regardless of sampling.
+    pub(crate) fn new_unsampled_at(event_data: EventData, timestamp: u64) -> Self {
+        Self::new_with_timestamp(event_data, Some(timestamp))
+    }
+
+    /// End the span at `timestamp` (see `trace_time_ns`) instead of now.
+    pub fn end_at(mut self, timestamp: u64) {
+        self.end_timestamp = Some(timestamp);
+    }
+
+    fn new_with_timestamp(mut event_data: EventData, timestamp: Option<u64>) -> Self {
+        event_data.emit(EventType::Span, timestamp);
 
         let track = match event_data.track_id {
             Some(track_id) => Track::Custom(track_id),
@@ -223,7 +737,11 @@ impl TraceEvent {
         };
         Self {
             track,
-            category: event_data.category,
+            category: std::mem::replace(
+                &mut event_data.category,
+                EventCategory::Interned(DEFAULT_CATEGORY),
+            ),
+            end_timestamp: None,
         }
     }
 }
@@ -236,35 +754,23 @@ impl Drop for TraceEvent {
                 null()
             }
             Track::Custom(track_id) => track_id as *const u64,
+            Track::SampledOut => return,
         };
 
-        unsafe {
-            destroy_event(
-                self.category.as_ref().map(|s| s.as_ptr()).unwrap_or(null()),
-                track_id,
-            )
-        };
+        self.category.destroy_event(track_id, self.end_timestamp);
     }
 }
 
 /// Emit the given `EventData` as a Perfetto instant event with all metadata.
 pub fn create_instant_event(event_data: EventData) {
-    unsafe {
-        create_event(
-            EventType::Instant,
-            event_data
-                .category
-                .as_ref()
-                .map(|s| s.as_ptr())
-                .unwrap_or(null()),
-            event_data.name.as_ptr(),
-            event_data
-                .track_id
-                .as_ref()
-                .map(|id| id as *const u64)
-                .unwrap_or(null()),
-            event_data.args.as_ptr(),
-            event_data.args.len(),
-        );
+    if event_data.sample() {
+        event_data.emit_instant();
+    }
+}
+
+/// Emit the given `EventData` as a Perfetto instant event at `timestamp` (see `trace_time_ns`).
+pub fn create_instant_event_at(mut event_data: EventData, timestamp: u64) {
+    if event_data.sample() {
+        event_data.emit(EventType::Instant, Some(timestamp));
     }
 }
@@ -1,18 +1,40 @@
 // Copyright 2024-2025 Irreducible Inc.
 
-use crate::Error;
+use crate::{
+    batch::flush_event_batch,
+    deferred::{DeferredConfig, Drainer},
+    rotation::{path_to_cstring, RotationConfig, Rotator},
+    sampling::flush_sampled_out_events,
+    stats::{PerfettoStats, RawStats},
+    Error,
+};
 use std::{
     ffi::{c_char, c_void, CString},
     io::Write,
     path::{Path, PathBuf},
     process::{Child, Command},
+    ptr::null,
     thread,
-    time::Duration,
+    time::{Duration, Instant},
 };
 
 extern "C" {
-    fn init_perfetto(backend: u32, output_path: *const c_char, buffer_size: usize) -> *mut c_void;
-    fn deinit_perfetto(guard: *mut c_void);
+    fn init_perfetto(
+        backend: u32,
+        output_path: *const c_char,
+        producer: *const ProducerConfig,
+        config: *const InProcessConfig,
+        system_config: *const SystemConfig,
+    ) -> *mut c_void;
+    fn deinit_perfetto(
+        guard: *mut c_void,
+        flush_timeout_ms: u32,
+        output_path: *const c_char,
+        written: *mut bool,
+    ) -> bool;
+    fn commit_thread_trace_data();
+    fn snapshot_perfetto(guard: *mut c_void, output_path: *const c_char) -> bool;
+    fn get_perfetto_stats(guard: *mut c_void, stats: *mut RawStats) -> bool;
 }
 
 #[repr(u32)]
@@ -24,12 +46,104 @@ enum Backend {
     System = 2,
 }
 
+/// Shared memory between this process and the tracing service, see `ProducerConfig` in wrapper.h.
+/// Events are lost when it is full before the service has copied the data into the buffer,
+/// see `BufferStats::trace_writer_packet_loss`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ProducerConfig {
+    /// Size hint of the shared memory buffer in kilobytes. 0 keeps the SDK default (256 KB).
+    pub shmem_size_hint_kb: u32,
+    /// Page size hint of the shared memory buffer in kilobytes. 0 keeps the SDK default (4 KB).
+    pub shmem_page_size_hint_kb: u32,
+}
+
+/// Additional buffer of the in-process backend holding only the events of the given categories.
+/// Keeps low-rate categories from being overwritten or discarded because of high-rate ones.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct CategoryBuffer {
+    /// Size of the buffer in kilobytes.
+    pub size_kb: usize,
+    /// Categories written into this buffer instead of the main one.
+    pub categories: Vec<String>,
+}
+
+/// See `CategoryBufferConfig` in wrapper.h.
+#[repr(C)]
+struct CategoryBufferConfig {
+    size_kb: usize,
+    categories: *const *const c_char,
+    category_count: usize,
+}
+
+/// See `InProcessConfig` in wrapper.h.
+#[repr(C)]
+struct InProcessConfig {
+    buffer_size_kb: usize,
+    file_write_period_ms: u32,
+    ring_buffer: bool,
+    compression: TraceCompression,
+    flush_period_ms: u32,
+    category_buffers: *const CategoryBufferConfig,
+    category_buffer_count: usize,
+    thread_time: bool,
+    incremental_state_clear_period_ms: u32,
+}
+
+/// See `SystemConfig` in wrapper.h.
+#[repr(C)]
+struct SystemConfig {
+    startup_tracing: bool,
+    start_timeout_ms: u32,
+}
+
+/// `InProcessConfig` together with the storage of the pointers inside it.
+struct InProcessConfigStorage {
+    config: InProcessConfig,
+    _category_buffers: Vec<CategoryBufferConfig>,
+    _category_ptrs: Vec<Vec<*const c_char>>,
+    _categories: Vec<CString>,
+}
+
+/// Compression of the trace file, see `TraceCompression` in wrapper.h.
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub enum TraceCompression {
+    #[default]
+    None,
+    /// The file is a gzip stream, the Perfetto UI and trace processor open it directly.
+    Gzip,
+}
+
 /// Backend configuration for perfetto.
 pub enum BackendConfig {
     /// Use API to create a trace of the local process.
     InProcess {
         /// Size of the buffer in kilobytes.
         buffer_size_kb: usize,
+        /// If set, the trace is streamed into the output file with this period in milliseconds.
+        /// The buffer then only has to hold the data produced between two writes.
+        /// Otherwise the whole trace is kept in memory and written when the guard is dropped.
+        file_write_period_ms: Option<u32>,
+        /// Flight recorder mode: the buffer keeps only the most recent data, which can be written
+        /// at any time with `PerfettoGuard::snapshot`. Takes precedence over the streaming.
+        ring_buffer: bool,
+        /// Compression of the output file and the snapshots. The data is compressed as it is
+        /// written, also when streaming.
+        compression: TraceCompression,
+        /// How often the data of the threads is committed into the buffer in milliseconds.
+        /// If `None`, the data is committed only when a chunk is full or on flush.
+        flush_period_ms: Option<u32>,
+        /// Additional buffers for some categories, the main buffer holds all the other ones.
+        category_buffers: Vec<CategoryBuffer>,
+        /// Shared memory between the threads and the in-process tracing service.
+        producer: ProducerConfig,
+        /// Record the CPU time of the thread with the begin and end of every slice. The slices
+        /// then show how long the thread was running, e.g. to tell CPU-bound slices from blocked ones.
+        thread_time: bool,
+        /// If set, the trace is written into chunk files of bounded size or duration while
+        /// tracing runs. Takes precedence over the streaming.
+        rotation: Option<RotationConfig>,
     },
     /// Use system wide tracing fused with the local process data.
     /// The `PerfettoGuard` will take care of starting and stopping the perfetto processes.
@@ -39,7 +153,20 @@ pub enum BackendConfig {
         perfetto_bin_path: Option<String>,
         /// Path to the perfetto config file.
         /// If none the default one `config/system_profiling.cfg` will be used.
+        /// The buffers and the flush period are set in this file.
         perfetto_cfg_path: Option<String>,
+        /// Shared memory between this process and the `traced` service.
+        producer: ProducerConfig,
+        /// Start tracing immediately instead of waiting for the session of the perfetto process:
+        /// the events are kept in the shared memory and adopted by the session once it starts.
+        /// The perfetto config should enable the default track event categories.
+        startup_tracing: bool,
+        /// With `startup_tracing`, how long the events are kept if no session adopts them.
+        /// Otherwise how long `PerfettoGuard::new` waits for the session to start, the events
+        /// are dropped until it starts afterwards.
+        /// If `None`, the SDK default of 10 seconds is used with `startup_tracing`,
+        /// and `PerfettoGuard::new` waits indefinitely otherwise.
+        start_timeout: Option<Duration>,
     },
 }
 
@@ -51,18 +178,129 @@ impl BackendConfig {
         }
     }
 
-    fn buffer_size_kb(&self) -> usize {
+    fn producer_config(&self) -> ProducerConfig {
+        match self {
+            BackendConfig::InProcess { producer, .. } | BackendConfig::System { producer, .. } => {
+                *producer
+            }
+        }
+    }
+
+    fn in_process_config(&self) -> Option<InProcessConfigStorage> {
         match self {
-            BackendConfig::InProcess { buffer_size_kb } => *buffer_size_kb,
-            BackendConfig::System { .. } => 0,
+            BackendConfig::InProcess {
+                buffer_size_kb,
+                file_write_period_ms,
+                ring_buffer,
+                compression,
+                flush_period_ms,
+                category_buffers,
+                producer: _,
+                thread_time,
+                rotation,
+            } => {
+                let categories: Vec<Vec<CString>> = category_buffers
+                    .iter()
+                    .map(|buffer| {
+                        buffer
+                            .categories
+                            .iter()
+                            .map(|category| {
+                                CString::new(category.as_str()).expect("invalid category name")
+                            })
+                            .collect()
+                    })
+                    .collect();
+                let category_ptrs: Vec<Vec<*const c_char>> = categories
+                    .iter()
+                    .map(|names| names.iter().map(|name| name.as_ptr()).collect())
+                    .collect();
+                let ffi_buffers: Vec<CategoryBufferConfig> = category_buffers
+                    .iter()
+                    .zip(&category_ptrs)
+                    .map(|(buffer, ptrs)| CategoryBufferConfig {
+                        size_kb: buffer.size_kb,
+                        categories: ptrs.as_ptr(),
+                        category_count: ptrs.len(),
+                    })
+                    .collect();
+
+                Some(InProcessConfigStorage {
+                    config: InProcessConfig {
+                        buffer_size_kb: *buffer_size_kb,
+                        // the chunks are read from the buffer
+                        file_write_period_ms: match rotation {
+                            Some(_) => 0,
+                            None => file_write_period_ms.unwrap_or(0),
+                        },
+                        ring_buffer: *ring_buffer,
+                        compression: *compression,
+                        flush_period_ms: flush_period_ms.unwrap_or(0),
+                        category_buffers: ffi_buffers.as_ptr(),
+                        category_buffer_count: ffi_buffers.len(),
+                        thread_time: *thread_time,
+                        incremental_state_clear_period_ms: rotation
+                            .as_ref()
+                            .map(|rotation| {
+                                duration_to_ms(rotation.incremental_state_clear_period).max(1)
+                            })
+                            .unwrap_or(0),
+                    },
+                    _category_buffers: ffi_buffers,
+                    _category_ptrs: category_ptrs,
+                    _categories: categories.into_iter().flatten().collect(),
+                })
+            }
+            BackendConfig::System { .. } => None,
         }
     }
+
+    fn system_config(&self) -> Option<SystemConfig> {
+        match self {
+            BackendConfig::InProcess { .. } => None,
+            BackendConfig::System {
+                startup_tracing,
+                start_timeout,
+                ..
+            } => Some(SystemConfig {
+                startup_tracing: *startup_tracing,
+                // at least 1 ms, 0 stands for the default
+                start_timeout_ms: start_timeout
+                    .map(|timeout| duration_to_ms(timeout).max(1))
+                    .unwrap_or(0),
+            }),
+        }
+    }
+}
+
+fn duration_to_ms(duration: Duration) -> u32 {
+    duration.as_millis().min(u32::MAX as u128) as u32
+}
+
+/// Default maximum time to wait for the trace data to be flushed on shutdown.
+const DEFAULT_FLUSH_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Result of flushing the trace data on shutdown. With the system backend the session is owned by
+/// the perfetto process, the outcome only tells whether the perfetto processes have exited in time.
+/// A failure to write the trace is reported separately, see `PerfettoGuard::stop`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FlushOutcome {
+    /// All the data has been received by the tracing service.
+    Completed,
+    /// The flush or the stop of the perfetto processes has not completed in time, some data may be missing.
+    TimedOut,
 }
 
 /// Create only one of these per tracing session. It should live for the duration of the program.
 pub struct PerfettoGuard {
+    /// Null after the session is stopped.
     ptr: *mut c_void,
+    /// Path of the trace, reported if it could not be written.
+    output_path: String,
     processes: Option<PerfettoProcessesGuard>,
+    drainer: Option<Drainer>,
+    rotator: Option<Rotator>,
+    flush_timeout: Duration,
 }
 
 // Safety: the pointers here are heap allocated and not shared. Should be ok to send them to other threads
@@ -76,6 +314,7 @@ impl PerfettoGuard {
             BackendConfig::System {
                 perfetto_bin_path,
                 perfetto_cfg_path,
+                ..
             } => Some(PerfettoProcessesGuard::new(
                 perfetto_bin_path.as_ref().map(|s| s.as_str()),
                 output_path,
@@ -84,26 +323,174 @@ impl PerfettoGuard {
             BackendConfig::InProcess { .. } => None,
         };
 
-        let output_path = CString::new(output_path).expect("output_path is not a valid string");
-        let buffer_size_kb = backend.buffer_size_kb();
-        let backend = backend.backend();
-        let ptr = unsafe { init_perfetto(backend as u32, output_path.as_ptr(), buffer_size_kb) };
+        let output_path_str = CString::new(output_path).expect("output_path is not a valid string");
+        let producer = backend.producer_config();
+        let config = backend.in_process_config();
+        let system_config = backend.system_config();
+        let backend_type = backend.backend();
+        let ptr = unsafe {
+            init_perfetto(
+                backend_type as u32,
+                output_path_str.as_ptr(),
+                &producer,
+                config
+                    .as_ref()
+                    .map(|c| &c.config as *const _)
+                    .unwrap_or(null()),
+                system_config
+                    .as_ref()
+                    .map(|c| c as *const _)
+                    .unwrap_or(null()),
+            )
+        };
 
-        Ok(Self { ptr, processes })
+        let rotator = match backend {
+            BackendConfig::InProcess {
+                rotation: Some(rotation),
+                ..
+            } => Some(Rotator::start(ptr, rotation)),
+            _ => None,
+        };
+
+        Ok(Self {
+            ptr,
+            output_path: output_path.to_string(),
+            processes,
+            drainer: None,
+            rotator,
+            flush_timeout: DEFAULT_FLUSH_TIMEOUT,
+        })
+    }
+
+    /// Set the maximum time to wait for the trace data to be flushed on shutdown. Default: 5 seconds.
+    pub fn set_flush_timeout(&mut self, flush_timeout: Duration) {
+        self.flush_timeout = flush_timeout;
+    }
+
+    /// Stop tracing and write the trace. Same as dropping the guard, but reports whether
+    /// the data has been flushed in time, or `Error::TraceWriteError` if the trace could not be
+    /// written.
+    pub fn stop(mut self) -> Result<FlushOutcome, Error> {
+        self.shutdown()
+    }
+
+    /// Write the data currently in the trace buffer into `output_path` without stopping tracing.
+    /// The data is consumed, so consecutive snapshots don't overlap.
+    /// Only supported by the in-process backend when the trace is neither streamed into a file
+    /// nor rotated into chunks, with the rotation `Error::SnapshotWhileRotating` is returned.
+    pub fn snapshot(&self, output_path: &str) -> Result<(), Error> {
+        // the snapshot would take the data of the current chunk
+        if self.rotator.is_some() {
+            return Err(Error::SnapshotWhileRotating);
+        }
+
+        // the events gathered by this thread are not in the buffer yet
+        flush_event_batch();
+
+        let output_path_str = CString::new(output_path).expect("output_path is not a valid string");
+        match unsafe { snapshot_perfetto(self.ptr, output_path_str.as_ptr()) } {
+            true => Ok(()),
+            false => Err(Error::SnapshotError(output_path.to_string())),
+        }
+    }
+
+    /// Query the statistics of the tracing session: data written, dropped and overwritten per
+    /// buffer, and the data lost because the shared memory was full.
+    /// Returns `None` with the system backend, whose session is owned by the perfetto process.
+    pub fn stats(&self) -> Option<PerfettoStats> {
+        if self.ptr.is_null() {
+            return None;
+        }
+
+        let mut stats = RawStats::default();
+        match unsafe { get_perfetto_stats(self.ptr, &mut stats) } {
+            true => Some(stats.into()),
+            false => None,
+        }
+    }
+
+    /// Start replaying the events recorded in the deferred mode, see `DeferredSpan`.
+    /// The events are replayed until the guard is dropped. Does nothing if already started.
+    pub fn start_deferred(&mut self, config: DeferredConfig) {
+        self.drainer.get_or_insert_with(|| Drainer::start(config));
     }
 }
 
-impl Drop for PerfettoGuard {
-    fn drop(&mut self) {
-        // in wrapper.cc there's a 2 second flush interval. want to ensure all logs are flushed before stopping perfetto.
-        std::thread::sleep(Duration::from_millis(2500));
-        unsafe { deinit_perfetto(self.ptr) }
+impl PerfettoGuard {
+    fn shutdown(&mut self) -> Result<FlushOutcome, Error> {
+        if self.ptr.is_null() {
+            return Ok(FlushOutcome::Completed);
+        }
+
+        // emits the events gathered by this thread and replays the remaining deferred events
+        flush_event_batch();
+        flush_sampled_out_events();
+        self.drainer = None;
+
+        let mut completed = true;
+        // the perfetto process stops the session and collects the data of all producers,
+        // so it has to finish while this process is still connected to the service.
+        // the data of this thread has to be committed before, the session is gone afterwards.
+        // `deinit_perfetto` doesn't measure anything with the system backend, only the wait
+        // for the processes counts.
+        if let Some(processes) = &mut self.processes {
+            unsafe { commit_thread_trace_data() };
+            completed &= processes
+                .stop_session(self.flush_timeout)
+                .expect("failed to stop perfetto");
+        }
+
+        // the rest of the trace is the last chunk
+        let mut chunk_files = self.rotator.take().map(Rotator::finish);
+        let last_chunk = chunk_files.as_mut().map(|files| files.next_path());
+        let last_chunk_str = last_chunk.as_deref().map(path_to_cstring);
 
-        self.processes.take().map(|mut processes| {
-            _ = processes
-                .stop_and_wait()
+        let mut written = true;
+        completed &= unsafe {
+            deinit_perfetto(
+                self.ptr,
+                duration_to_ms(self.flush_timeout),
+                last_chunk_str
+                    .as_ref()
+                    .map(|path| path.as_ptr())
+                    .unwrap_or(null()),
+                &mut written,
+            )
+        };
+        self.ptr = std::ptr::null_mut();
+        let written_path = match &last_chunk {
+            Some(last_chunk) => last_chunk.display().to_string(),
+            None => self.output_path.clone(),
+        };
+        if let (Some(files), Some(last_chunk), true) = (&mut chunk_files, last_chunk, written) {
+            files.written(last_chunk);
+        }
+
+        if let Some(mut processes) = self.processes.take() {
+            completed &= processes
+                .stop_services(self.flush_timeout)
                 .expect("failed to stop perfetto processes");
-        });
+        }
+
+        if !written {
+            return Err(Error::TraceWriteError(written_path));
+        }
+        match completed {
+            true => Ok(FlushOutcome::Completed),
+            false => Ok(FlushOutcome::TimedOut),
+        }
+    }
+}
+
+impl Drop for PerfettoGuard {
+    fn drop(&mut self) {
+        match self.shutdown() {
+            Ok(FlushOutcome::Completed) => {}
+            Ok(FlushOutcome::TimedOut) => {
+                eprintln!("perfetto trace flush has timed out, some data may be missing")
+            }
+            Err(e) => eprintln!("{e}"),
+        }
     }
 }
 
@@ -155,14 +542,21 @@ impl PerfettoProcessesGuard {
         })
     }
 
-    fn stop_and_wait(&mut self) -> Result<(), Error> {
-        thread::sleep(Duration::from_millis(1000));
-        self.perfetto.stop_and_wait()?;
-        thread::sleep(Duration::from_millis(1000));
-        self.traced_probes.stop_and_wait()?;
-        thread::sleep(Duration::from_millis(1000));
-        self.traced.stop_and_wait()?;
-        Ok(())
+    /// Stop the perfetto process, which ends the tracing session and writes the trace.
+    /// Returns false if it has not exited within `timeout`.
+    fn stop_session(&mut self, timeout: Duration) -> Result<bool, Error> {
+        self.perfetto.stop_and_wait(timeout)
+    }
+
+    /// Stop the tracing services once the session has ended.
+    /// Returns false if any of them has not exited within `timeout`, which is shared by both.
+    fn stop_services(&mut self, timeout: Duration) -> Result<bool, Error> {
+        let deadline = Instant::now() + timeout;
+        self.traced_probes.interrupt()?;
+        self.traced.interrupt()?;
+        let traced_probes = self.traced_probes.wait_until(deadline)?;
+        let traced = self.traced.wait_until(deadline)?;
+        Ok(traced_probes && traced)
     }
 }
 
@@ -189,12 +583,19 @@ impl ProcessGuard {
             .map_err(|e| Error::ProcessError(name, e))
     }
 
-    fn stop_and_wait(&mut self) -> Result<(), Error> {
-        let Some(process) = self.process.take() else {
+    /// Interrupt the process and wait until it exits.
+    /// Returns false if it has not exited within `timeout`, the process is killed then.
+    fn stop_and_wait(&mut self, timeout: Duration) -> Result<bool, Error> {
+        self.interrupt()?;
+        self.wait_until(Instant::now() + timeout)
+    }
+
+    /// Ask the process to finish gracefully.
+    fn interrupt(&mut self) -> Result<(), Error> {
+        let Some(process) = &self.process else {
             return Ok(());
         };
 
-        // try to finish the process gracefully
         let res = unsafe { libc::kill(process.id() as i32, libc::SIGINT) };
         if res != 0 {
             return Err(Error::ProcessError(
@@ -202,13 +603,34 @@ impl ProcessGuard {
                 std::io::Error::last_os_error(),
             ));
         }
-
         Ok(())
     }
+
+    /// Wait until the interrupted process exits.
+    /// Returns false if it has not exited by `deadline`, the process is killed then.
+    fn wait_until(&mut self, deadline: Instant) -> Result<bool, Error> {
+        const POLL_INTERVAL: Duration = Duration::from_millis(5);
+
+        let Some(mut process) = self.process.take() else {
+            return Ok(true);
+        };
+        let process_error = |e| Error::ProcessError(self.name.clone(), e);
+
+        while Instant::now() < deadline {
+            if process.try_wait().map_err(process_error)?.is_some() {
+                return Ok(true);
+            }
+            thread::sleep(POLL_INTERVAL);
+        }
+
+        _ = process.kill();
+        process.wait().map_err(process_error)?;
+        Ok(false)
+    }
 }
 
 impl Drop for PerfettoProcessesGuard {
     fn drop(&mut self) {
-        _ = self.perfetto.stop_and_wait();
+        _ = self.perfetto.stop_and_wait(DEFAULT_FLUSH_TIMEOUT);
     }
 }
@@ -1,11 +1,40 @@
 // Copyright 2024-2025 Irreducible Inc.
 
+mod batch;
 mod counter;
+mod deferred;
+mod enabled;
 mod error;
 mod event;
 mod guard;
+mod merge;
+mod pool;
+mod rotation;
+mod sampling;
+mod stats;
+mod track;
 
-pub use counter::{set_counter_f64, set_counter_u64};
+pub use batch::{
+    create_batched_instant_event, create_batched_slice, flush_event_batch, BatchedSpan,
+};
+pub use counter::{set_counter_f64, set_counter_u64, CounterHandle};
+pub use deferred::{
+    deferred_dropped_events, record_deferred_instant_event, record_deferred_slice, DeferredConfig,
+    DeferredSpan,
+};
+pub use enabled::{is_category_enabled, is_tracing_enabled, set_enabled_state_callback};
 pub use error::Error;
-pub use event::{create_instant_event, EventData, TraceEvent};
-pub use guard::{BackendConfig, PerfettoGuard};
+pub use event::{
+    clock_snapshot, create_instant_event, create_instant_event_at, trace_time_ns, ClockSnapshot,
+    EventData, TraceEvent,
+};
+pub use guard::{
+    BackendConfig, CategoryBuffer, FlushOutcome, PerfettoGuard, ProducerConfig, TraceCompression,
+};
+pub use merge::{merge_traces, MergeInput};
+pub use rotation::RotationConfig;
+pub use sampling::{
+    sampled_out_events, set_sampling_rules, SamplingKey, SamplingPolicy, SamplingRule,
+};
+pub use stats::{BufferStats, PerfettoStats};
+pub use track::AsyncTrack;
@@ -0,0 +1,824 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Merging of the traces written by several processes, possibly on different hosts, into a
+//! single timeline. Each trace keeps its timestamps in the trace clock of its process (the boot
+//! time on Linux), which has a different origin on every host. The clock snapshots written by the
+//! tracing service pair the trace clock with the wall clock, so the timestamps of every trace are
+//! shifted onto the trace clock of the first one through the wall clock.
+//!
+//! The traces are rewritten on the protobuf wire level, packet by packet, without decoding the
+//! events:
+//! - the packet timestamps in the trace clock and the trace clock values of the clock snapshots
+//!   are shifted,
+//! - the sequence IDs are made unique per trace, so the interned data of the traces don't mix,
+//! - the traces of other hosts get a machine ID, so their processes don't collide.
+//!
+//! Flow IDs are kept as they are, so `perfetto_flow_id` values shared by the processes link their
+//! spans across the traces.
+//!
+//! The clocks and the machine and process UUIDs of the `metadata:run_info` events are
+//! informational only, the merge reads neither them nor any other event. The clocks are aligned
+//! with the clock snapshot packets of the service and the machines are given by `MergeInput::host`.
+
+use std::{
+    collections::HashMap,
+    fs::File,
+    io::{BufRead, BufReader, BufWriter, ErrorKind, Read, Write},
+    path::{Path, PathBuf},
+};
+
+use crate::Error;
+
+/// `Trace.packet`.
+const TRACE_PACKET_FIELD: u32 = 1;
+
+// `TracePacket` fields
+const TIMESTAMP_FIELD: u32 = 8;
+const CLOCK_SNAPSHOT_FIELD: u32 = 6;
+const TRUSTED_PACKET_SEQUENCE_ID_FIELD: u32 = 10;
+const SEQUENCE_FLAGS_FIELD: u32 = 13;
+const INCREMENTAL_STATE_CLEARED_FIELD: u32 = 41;
+const TIMESTAMP_CLOCK_ID_FIELD: u32 = 58;
+const TRACE_PACKET_DEFAULTS_FIELD: u32 = 59;
+const MACHINE_ID_FIELD: u32 = 98;
+
+/// `TracePacket.SequenceFlags.SEQ_INCREMENTAL_STATE_CLEARED`.
+const SEQ_INCREMENTAL_STATE_CLEARED: u64 = 1;
+
+// `ClockSnapshot` fields
+const CLOCKS_FIELD: u32 = 1;
+const PRIMARY_TRACE_CLOCK_FIELD: u32 = 2;
+// `ClockSnapshot.Clock` fields
+const CLOCK_ID_FIELD: u32 = 1;
+const CLOCK_TIMESTAMP_FIELD: u32 = 2;
+
+// `BuiltinClock` values
+const CLOCK_REALTIME: u64 = 1;
+const CLOCK_REALTIME_COARSE: u64 = 2;
+const CLOCK_BOOTTIME: u64 = 6;
+/// The clocks from this ID up are scoped to their sequence and defined relative to the
+/// builtin clocks, they follow the trace clock when it is shifted.
+const FIRST_SEQUENCE_SCOPED_CLOCK: u64 = 64;
+
+/// The sequence IDs of the trace at index `i` are moved by `i * SEQUENCE_ID_STRIDE`.
+const SEQUENCE_ID_STRIDE: u64 = 1 << 20;
+
+const GZIP_MAGIC: [u8; 2] = [0x1f, 0x8b];
+
+const WIRE_VARINT: u8 = 0;
+const WIRE_FIXED64: u8 = 1;
+const WIRE_LENGTH_DELIMITED: u8 = 2;
+const WIRE_FIXED32: u8 = 5;
+
+/// A trace to merge.
+#[derive(Debug, Clone)]
+pub struct MergeInput {
+    path: PathBuf,
+    host: Option<String>,
+    clock_offset_ns: i64,
+}
+
+impl MergeInput {
+    pub fn new(path: impl Into<PathBuf>) -> Self {
+        Self {
+            path: path.into(),
+            host: None,
+            clock_offset_ns: 0,
+        }
+    }
+
+    /// Host the trace was recorded on. The traces of the hosts other than the one of the
+    /// first trace are put on machines of their own. The traces without a host are assumed
+    /// to be recorded on the host of the first trace.
+    pub fn host(mut self, host: impl Into<String>) -> Self {
+        self.host = Some(host.into());
+        self
+    }
+
+    /// Correction of the wall clock of the host, added to its timestamps, e.g. the offset
+    /// measured by NTP or PTP.
+    pub fn clock_offset_ns(mut self, offset_ns: i64) -> Self {
+        self.clock_offset_ns = offset_ns;
+        self
+    }
+}
+
+/// Merge the uncompressed traces of `inputs` into `output`, on the timeline of the first one.
+/// Returns the shift applied to the trace clock of every input, in nanoseconds.
+///
+/// The shift is computed from the first clock snapshot of each trace, the traces without a
+/// snapshot are only shifted by their `clock_offset_ns`. Only the packet timestamps are shifted,
+/// the timestamps inside the ftrace bundles of the system backend are kept.
+pub fn merge_traces(inputs: &[MergeInput], output: impl AsRef<Path>) -> Result<Vec<i64>, Error> {
+    let reference = match inputs.first() {
+        Some(input) => first_clock_snapshot(&input.path)?,
+        None => None,
+    };
+    if inputs.len() as u64 > u32::MAX as u64 / SEQUENCE_ID_STRIDE {
+        return Err(invalid_trace(output.as_ref(), "too many traces to merge"));
+    }
+
+    // the first trace is on machine 0, the traces without a host are on its machine as well
+    let first_host = inputs.first().and_then(|input| input.host.as_deref());
+    let mut machines = HashMap::from([(first_host, 0)]);
+    let mut shifts = Vec::with_capacity(inputs.len());
+    let mut writer = BufWriter::new(File::create(output)?);
+    for (index, input) in inputs.iter().enumerate() {
+        let snapshot = match index {
+            0 => reference,
+            _ => first_clock_snapshot(&input.path)?,
+        };
+        let shift = match (snapshot, reference) {
+            (Some(snapshot), Some(reference)) => {
+                snapshot.wall_clock_offset() - reference.wall_clock_offset()
+            }
+            _ => 0,
+        } + input.clock_offset_ns;
+        let next_machine_id = machines.len() as u32;
+        let machine_id = *machines
+            .entry(input.host.as_deref().or(first_host))
+            .or_insert(next_machine_id);
+
+        let mut rewriter = PacketRewriter {
+            shift,
+            wall_clock_shift: input.clock_offset_ns,
+            trace_clock: snapshot.map_or(CLOCK_BOOTTIME, |snapshot| snapshot.trace_clock),
+            sequence_id_offset: index as u64 * SEQUENCE_ID_STRIDE,
+            // the reference keeps all the clocks, the other traces only the ones that are aligned
+            keep_other_clocks: index == 0,
+            machine_id,
+            default_clocks: HashMap::new(),
+        };
+        let mut reader = PacketReader::open(&input.path)?;
+        while let Some(packet) = reader.next_packet()? {
+            let packet = rewriter
+                .rewrite(packet)
+                .ok_or_else(|| invalid_trace(&input.path, "malformed packet"))?;
+            write_tag(&mut writer, TRACE_PACKET_FIELD, WIRE_LENGTH_DELIMITED)?;
+            write_varint(&mut writer, packet.len() as u64)?;
+            writer.write_all(&packet)?;
+        }
+        shifts.push(shift);
+    }
+    writer.flush()?;
+
+    Ok(shifts)
+}
+
+fn invalid_trace(path: &Path, reason: &str) -> Error {
+    Error::InvalidTrace(path.display().to_string(), reason.to_string())
+}
+
+/// Trace clock and wall clock of a clock snapshot packet.
+#[derive(Debug, Clone, Copy)]
+struct TraceClockSnapshot {
+    trace_clock: u64,
+    trace_time_ns: u64,
+    realtime_ns: u64,
+}
+
+impl TraceClockSnapshot {
+    /// Difference between the wall clock and the trace clock.
+    fn wall_clock_offset(&self) -> i64 {
+        self.realtime_ns.wrapping_sub(self.trace_time_ns) as i64
+    }
+
+    fn parse(snapshot: &[u8]) -> Option<Self> {
+        let mut trace_clock = CLOCK_BOOTTIME;
+        let mut clocks = Vec::new();
+        for field in Fields::new(snapshot) {
+            match field? {
+                (PRIMARY_TRACE_CLOCK_FIELD, Value::Varint(clock)) => trace_clock = clock,
+                (CLOCKS_FIELD, Value::LengthDelimited(clock)) => clocks.push(parse_clock(clock)?),
+                _ => {}
+            }
+        }
+
+        let time = |id| {
+            clocks
+                .iter()
+                .find(|(clock, _)| *clock == id)
+                .map(|(_, time)| *time)
+        };
+        Some(Self {
+            trace_clock,
+            trace_time_ns: time(trace_clock)?,
+            realtime_ns: time(CLOCK_REALTIME)?,
+        })
+    }
+}
+
+/// ID and timestamp of a `ClockSnapshot.Clock`.
+fn parse_clock(clock: &[u8]) -> Option<(u64, u64)> {
+    let (mut id, mut timestamp) = (0, 0);
+    for field in Fields::new(clock) {
+        match field? {
+            (CLOCK_ID_FIELD, Value::Varint(value)) => id = value,
+            (CLOCK_TIMESTAMP_FIELD, Value::Varint(value)) => timestamp = value,
+            _ => {}
+        }
+    }
+    Some((id, timestamp))
+}
+
+/// First clock snapshot of the trace with both the trace clock and the wall clock.
+fn first_clock_snapshot(path: &Path) -> Result<Option<TraceClockSnapshot>, Error> {
+    let mut reader = PacketReader::open(path)?;
+    while let Some(packet) = reader.next_packet()? {
+        for field in Fields::new(&packet) {
+            let Some((field_number, value)) = field else {
+                return Err(invalid_trace(path, "malformed packet"));
+            };
+            if let (CLOCK_SNAPSHOT_FIELD, Value::LengthDelimited(snapshot)) = (field_number, value)
+            {
+                if let Some(snapshot) = TraceClockSnapshot::parse(snapshot) {
+                    return Ok(Some(snapshot));
+                }
+            }
+        }
+    }
+
+    Ok(None)
+}
+
+struct PacketRewriter {
+    /// Shift of the trace clock.
+    shift: i64,
+    /// Shift of the wall clock.
+    wall_clock_shift: i64,
+    trace_clock: u64,
+    sequence_id_offset: u64,
+    keep_other_clocks: bool,
+    /// Written to every packet unless 0, i.e. the host of the first trace.
+    machine_id: u32,
+    /// Clock of the packets without a clock ID, per sequence, from `TracePacketDefaults`.
+    default_clocks: HashMap<u64, u64>,
+}
+
+impl PacketRewriter {
+    fn rewrite(&mut self, packet: Vec<u8>) -> Option<Vec<u8>> {
+        let mut sequence_id = 0;
+        let mut clock_id = None;
+        let mut cleared = false;
+        let mut default_clock = None;
+        for field in Fields::new(&packet) {
+            match field? {
+                (TRUSTED_PACKET_SEQUENCE_ID_FIELD, Value::Varint(id)) => sequence_id = id,
+                (TIMESTAMP_CLOCK_ID_FIELD, Value::Varint(id)) => clock_id = Some(id),
+                (SEQUENCE_FLAGS_FIELD, Value::Varint(flags)) => {
+                    cleared |= flags & SEQ_INCREMENTAL_STATE_CLEARED != 0
+                }
+                (INCREMENTAL_STATE_CLEARED_FIELD, Value::Varint(value)) => cleared |= value != 0,
+                (TRACE_PACKET_DEFAULTS_FIELD, Value::LengthDelimited(defaults)) => {
+                    for field in Fields::new(defaults) {
+                        if let (TIMESTAMP_CLOCK_ID_FIELD, Value::Varint(id)) = field? {
+                            default_clock = Some(id);
+                        }
+                    }
+                }
+                _ => {}
+            }
+        }
+
+        // the defaults of a packet already apply to its own timestamp
+        if cleared {
+            self.default_clocks.remove(&sequence_id);
+        }
+        if let Some(clock) = default_clock {
+            self.default_clocks.insert(sequence_id, clock);
+        }
+        let clock = clock_id
+            .or_else(|| self.default_clocks.get(&sequence_id).copied())
+            .filter(|clock| *clock != 0)
+            .unwrap_or(self.trace_clock);
+
+        let mut rewritten = Vec::with_capacity(packet.len() + 8);
+        for field in Fields::new(&packet) {
+            let (field_number, value) = field?;
+            match (field_number, value) {
+                (TIMESTAMP_FIELD, Value::Varint(timestamp)) => {
+                    write_varint_field(&mut rewritten, field_number, self.shifted(clock, timestamp))
+                }
+                (TRUSTED_PACKET_SEQUENCE_ID_FIELD, Value::Varint(id)) if id != 0 => {
+                    write_varint_field(&mut rewritten, field_number, id + self.sequence_id_offset)
+                }
+                (CLOCK_SNAPSHOT_FIELD, Value::LengthDelimited(snapshot)) => {
+                    let snapshot = self.rewrite_clock_snapshot(snapshot)?;
+                    write_bytes_field(&mut rewritten, field_number, &snapshot);
+                }
+                (MACHINE_ID_FIELD, _) => {}
+                (_, value) => value.write(&mut rewritten, field_number),
+            }
+        }
+        if self.machine_id != 0 {
+            write_varint_field(&mut rewritten, MACHINE_ID_FIELD, self.machine_id as u64);
+        }
+
+        Some(rewritten)
+    }
+
+    fn rewrite_clock_snapshot(&self, snapshot: &[u8]) -> Option<Vec<u8>> {
+        let mut rewritten = Vec::with_capacity(snapshot.len());
+        for field in Fields::new(snapshot) {
+            let clock = match field? {
+                (CLOCKS_FIELD, Value::LengthDelimited(clock)) => clock,
+                (field_number, value) => {
+                    value.write(&mut rewritten, field_number);
+                    continue;
+                }
+            };
+
+            let (id, _) = parse_clock(clock)?;
+            let aligned = id == self.trace_clock
+                || id == CLOCK_REALTIME
+                || id == CLOCK_REALTIME_COARSE
+                || id >= FIRST_SEQUENCE_SCOPED_CLOCK;
+            // the other clocks of a host, e.g. the monotonic one, would contradict the ones of
+            // the reference host
+            if !aligned && !self.keep_other_clocks {
+                continue;
+            }
+
+            let mut clock_rewritten = Vec::with_capacity(clock.len());
+            for field in Fields::new(clock) {
+                match field? {
+                    (CLOCK_TIMESTAMP_FIELD, Value::Varint(timestamp)) => write_varint_field(
+                        &mut clock_rewritten,
+                        CLOCK_TIMESTAMP_FIELD,
+                        self.shifted(id, timestamp),
+                    ),
+                    (field_number, value) => value.write(&mut clock_rewritten, field_number),
+                }
+            }
+            write_bytes_field(&mut rewritten, CLOCKS_FIELD, &clock_rewritten);
+        }
+
+        Some(rewritten)
+    }
+
+    fn shifted(&self, clock: u64, timestamp: u64) -> u64 {
+        let shift = match clock {
+            _ if clock == self.trace_clock => self.shift,
+            CLOCK_REALTIME | CLOCK_REALTIME_COARSE => self.wall_clock_shift,
+            _ => 0,
+        };
+        timestamp.wrapping_add_signed(shift)
+    }
+}
+
+/// Reads the packets of a trace one by one.
+struct PacketReader {
+    reader: BufReader<File>,
+    path: PathBuf,
+}
+
+impl PacketReader {
+    fn open(path: &Path) -> Result<Self, Error> {
+        let mut reader = BufReader::new(File::open(path)?);
+        if reader.fill_buf()?.starts_with(&GZIP_MAGIC) {
+            return Err(invalid_trace(
+                path,
+                "compressed traces must be decompressed first",
+            ));
+        }
+
+        Ok(Self {
+            reader,
+            path: path.to_path_buf(),
+        })
+    }
+
+    /// The next `Trace.packet`, other fields of the trace are skipped.
+    fn next_packet(&mut self) -> Result<Option<Vec<u8>>, Error> {
+        loop {
+            let Some(tag) = self.read_varint(true)? else {
+                return Ok(None);
+            };
+            let field_number = (tag >> 3) as u32;
+            let skip = match (tag & 7) as u8 {
+                WIRE_VARINT => {
+                    self.read_varint(false)?;
+                    continue;
+                }
+                WIRE_FIXED64 => 8,
+                WIRE_FIXED32 => 4,
+                WIRE_LENGTH_DELIMITED => self.read_varint(false)?.unwrap_or_default(),
+                _ => return Err(invalid_trace(&self.path, "unsupported wire type")),
+            };
+
+            let mut data = Vec::new();
+            let read = (&mut self.reader).take(skip).read_to_end(&mut data)?;
+            if (read as u64) < skip {
+                return Err(invalid_trace(&self.path, "truncated packet"));
+            }
+            if field_number == TRACE_PACKET_FIELD && tag & 7 == WIRE_LENGTH_DELIMITED as u64 {
+                return Ok(Some(data));
+            }
+        }
+    }
+
+    /// `None` at the end of the file if `at_boundary`, an error elsewhere.
+    fn read_varint(&mut self, at_boundary: bool) -> Result<Option<u64>, Error> {
+        let mut value = 0u64;
+        for shift in (0..64).step_by(7) {
+            let mut byte = [0u8];
+            match self.reader.read_exact(&mut byte) {
+                Ok(()) => {}
+                Err(e) if e.kind() == ErrorKind::UnexpectedEof && at_boundary && shift == 0 => {
+                    return Ok(None)
+                }
+                Err(e) if e.kind() == ErrorKind::UnexpectedEof => {
+                    return Err(invalid_trace(&self.path, "truncated packet"))
+                }
+                Err(e) => return Err(e.into()),
+            }
+            value |= ((byte[0] & 0x7f) as u64) << shift;
+            if byte[0] & 0x80 == 0 {
+                return Ok(Some(value));
+            }
+        }
+
+        Err(invalid_trace(&self.path, "malformed varint"))
+    }
+}
+
+/// Value of a protobuf field.
+#[derive(Clone, Copy)]
+enum Value<'a> {
+    Varint(u64),
+    Fixed64(u64),
+    LengthDelimited(&'a [u8]),
+    Fixed32(u32),
+}
+
+impl Value<'_> {
+    fn write(&self, out: &mut Vec<u8>, field_number: u32) {
+        match *self {
+            Value::Varint(value) => write_varint_field(out, field_number, value),
+            Value::Fixed64(value) => {
+                push_tag(out, field_number, WIRE_FIXED64);
+                out.extend_from_slice(&value.to_le_bytes());
+            }
+            Value::LengthDelimited(bytes) => write_bytes_field(out, field_number, bytes),
+            Value::Fixed32(value) => {
+                push_tag(out, field_number, WIRE_FIXED32);
+                out.extend_from_slice(&value.to_le_bytes());
+            }
+        }
+    }
+}
+
+/// Iterator over the fields of a protobuf message, yields `None` once if the message is
+/// malformed.
+struct Fields<'a> {
+    data: &'a [u8],
+    failed: bool,
+}
+
+impl<'a> Fields<'a> {
+    fn new(data: &'a [u8]) -> Self {
+        Self {
+            data,
+            failed: false,
+        }
+    }
+
+    fn varint(&mut self) -> Option<u64> {
+        let mut value = 0u64;
+        for (index, byte) in self.data.iter().enumerate().take(10) {
+            value |= ((byte & 0x7f) as u64) << (7 * index);
+            if byte & 0x80 == 0 {
+                self.data = &self.data[index + 1..];
+                return Some(value);
+            }
+        }
+        None
+    }
+
+    fn bytes(&mut self, len: usize) -> Option<&'a [u8]> {
+        if self.data.len() < len {
+            return None;
+        }
+        let (bytes, rest) = self.data.split_at(len);
+        self.data = rest;
+        Some(bytes)
+    }
+
+    fn field(&mut self) -> Option<(u32, Value<'a>)> {
+        let tag = self.varint()?;
+        let value = match (tag & 7) as u8 {
+            WIRE_VARINT => Value::Varint(self.varint()?),
+            WIRE_FIXED64 => Value::Fixed64(u64::from_le_bytes(self.bytes(8)?.try_into().ok()?)),
+            WIRE_LENGTH_DELIMITED => {
+                let len = self.varint()? as usize;
+                Value::LengthDelimited(self.bytes(len)?)
+            }
+            WIRE_FIXED32 => Value::Fixed32(u32::from_le_bytes(self.bytes(4)?.try_into().ok()?)),
+            _ => return None,
+        };
+        Some(((tag >> 3) as u32, value))
+    }
+}
+
+impl<'a> Iterator for Fields<'a> {
+    type Item = Option<(u32, Value<'a>)>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        if self.data.is_empty() || self.failed {
+            return None;
+        }
+        let field = self.field();
+        self.failed = field.is_none();
+        Some(field)
+    }
+}
+
+fn push_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+fn push_tag(out: &mut Vec<u8>, field_number: u32, wire_type: u8) {
+    push_varint(out, ((field_number as u64) << 3) | wire_type as u64);
+}
+
+fn write_varint_field(out: &mut Vec<u8>, field_number: u32, value: u64) {
+    push_tag(out, field_number, WIRE_VARINT);
+    push_varint(out, value);
+}
+
+fn write_bytes_field(out: &mut Vec<u8>, field_number: u32, bytes: &[u8]) {
+    push_tag(out, field_number, WIRE_LENGTH_DELIMITED);
+    push_varint(out, bytes.len() as u64);
+    out.extend_from_slice(bytes);
+}
+
+fn write_varint(writer: &mut impl Write, value: u64) -> std::io::Result<()> {
+    let mut bytes = Vec::with_capacity(10);
+    push_varint(&mut bytes, value);
+    writer.write_all(&bytes)
+}
+
+fn write_tag(writer: &mut impl Write, field_number: u32, wire_type: u8) -> std::io::Result<()> {
+    write_varint(writer, ((field_number as u64) << 3) | wire_type as u64)
+}
+
+#[cfg(test)]
+mod tests {
+    use tempfile::NamedTempFile;
+
+    use super::*;
+
+    const CLOCK_MONOTONIC: u64 = 3;
+
+    fn clock_snapshot(clocks: &[(u64, u64)]) -> Vec<u8> {
+        let mut snapshot = Vec::new();
+        for &(id, timestamp) in clocks {
+            let mut clock = Vec::new();
+            write_varint_field(&mut clock, CLOCK_ID_FIELD, id);
+            write_varint_field(&mut clock, CLOCK_TIMESTAMP_FIELD, timestamp);
+            write_bytes_field(&mut snapshot, CLOCKS_FIELD, &clock);
+        }
+        let mut packet = Vec::new();
+        write_bytes_field(&mut packet, CLOCK_SNAPSHOT_FIELD, &snapshot);
+        packet
+    }
+
+    fn event(sequence_id: u64, timestamp: u64) -> Vec<u8> {
+        let mut packet = Vec::new();
+        write_varint_field(&mut packet, TIMESTAMP_FIELD, timestamp);
+        write_varint_field(&mut packet, TRUSTED_PACKET_SEQUENCE_ID_FIELD, sequence_id);
+        packet
+    }
+
+    fn with_field(mut packet: Vec<u8>, field_number: u32, value: u64) -> Vec<u8> {
+        write_varint_field(&mut packet, field_number, value);
+        packet
+    }
+
+    fn with_default_clock(mut packet: Vec<u8>, clock: u64) -> Vec<u8> {
+        let mut defaults = Vec::new();
+        write_varint_field(&mut defaults, TIMESTAMP_CLOCK_ID_FIELD, clock);
+        write_bytes_field(&mut packet, TRACE_PACKET_DEFAULTS_FIELD, &defaults);
+        packet
+    }
+
+    fn write_trace(packets: &[Vec<u8>]) -> NamedTempFile {
+        let mut trace = Vec::new();
+        for packet in packets {
+            write_bytes_field(&mut trace, TRACE_PACKET_FIELD, packet);
+        }
+        let mut file = NamedTempFile::new().unwrap();
+        file.write_all(&trace).unwrap();
+        file
+    }
+
+    fn read_trace(path: &Path) -> Vec<Vec<u8>> {
+        let mut reader = PacketReader::open(path).unwrap();
+        std::iter::from_fn(|| reader.next_packet().unwrap()).collect()
+    }
+
+    fn varint(message: &[u8], field_number: u32) -> Option<u64> {
+        Fields::new(message).find_map(|field| match field.unwrap() {
+            (number, Value::Varint(value)) if number == field_number => Some(value),
+            _ => None,
+        })
+    }
+
+    /// Clocks of the clock snapshot of the packet.
+    fn clocks(packet: &[u8]) -> Vec<(u64, u64)> {
+        let snapshot = Fields::new(packet)
+            .find_map(|field| match field.unwrap() {
+                (CLOCK_SNAPSHOT_FIELD, Value::LengthDelimited(snapshot)) => Some(snapshot),
+                _ => None,
+            })
+            .unwrap();
+        Fields::new(snapshot)
+            .map(|field| match field.unwrap() {
+                (CLOCKS_FIELD, Value::LengthDelimited(clock)) => parse_clock(clock).unwrap(),
+                _ => panic!("unexpected field in the clock snapshot"),
+            })
+            .collect()
+    }
+
+    fn merge(inputs: &[MergeInput]) -> (Vec<i64>, Vec<Vec<u8>>) {
+        let output = NamedTempFile::new().unwrap();
+        let shifts = merge_traces(inputs, output.path()).unwrap();
+        (shifts, read_trace(output.path()))
+    }
+
+    #[test]
+    fn test_fields() {
+        let mut message = Vec::new();
+        write_varint_field(&mut message, 1, 300);
+        write_varint_field(&mut message, 98, u64::MAX);
+        write_bytes_field(&mut message, 3, b"abc");
+        Value::Fixed64(7).write(&mut message, 4);
+        Value::Fixed32(9).write(&mut message, 5);
+
+        let fields: Vec<_> = Fields::new(&message).map(Option::unwrap).collect();
+        assert!(matches!(fields[0], (1, Value::Varint(300))));
+        assert!(matches!(fields[1], (98, Value::Varint(u64::MAX))));
+        assert!(matches!(fields[2], (3, Value::LengthDelimited(b"abc"))));
+        assert!(matches!(fields[3], (4, Value::Fixed64(7))));
+        assert!(matches!(fields[4], (5, Value::Fixed32(9))));
+        assert_eq!(fields.len(), 5);
+
+        // the length goes past the end of the message
+        let truncated = [0x1a, 0x05, b'a'];
+        let fields: Vec<_> = Fields::new(&truncated).collect();
+        assert_eq!(fields.len(), 1);
+        assert!(fields[0].is_none());
+    }
+
+    #[test]
+    fn test_merge_shifts_timestamps() {
+        let first = write_trace(&[
+            clock_snapshot(&[
+                (CLOCK_BOOTTIME, 1_000),
+                (CLOCK_MONOTONIC, 900),
+                (CLOCK_REALTIME, 1_000_000),
+            ]),
+            event(1, 1_500),
+        ]);
+        let second = write_trace(&[
+            clock_snapshot(&[
+                (CLOCK_BOOTTIME, 5_000),
+                (CLOCK_MONOTONIC, 4_000),
+                (CLOCK_REALTIME, 1_000_500),
+            ]),
+            event(1, 6_000),
+            event(2, 7_000),
+        ]);
+
+        let (shifts, packets) = merge(&[
+            MergeInput::new(first.path()),
+            MergeInput::new(second.path()).clock_offset_ns(100),
+        ]);
+        // the wall clock of the second trace is ahead by 3'500 ns of its boot time compared to
+        // the first one, and it is corrected by 100 ns
+        assert_eq!(shifts, vec![0, -3_400]);
+        assert_eq!(packets.len(), 5);
+
+        // the reference keeps all its clocks
+        assert_eq!(
+            clocks(&packets[0]),
+            vec![
+                (CLOCK_BOOTTIME, 1_000),
+                (CLOCK_MONOTONIC, 900),
+                (CLOCK_REALTIME, 1_000_000)
+            ]
+        );
+        assert_eq!(varint(&packets[1], TIMESTAMP_FIELD), Some(1_500));
+        assert_eq!(
+            varint(&packets[1], TRUSTED_PACKET_SEQUENCE_ID_FIELD),
+            Some(1)
+        );
+
+        // the other traces drop the clocks that are not aligned
+        assert_eq!(
+            clocks(&packets[2]),
+            vec![(CLOCK_BOOTTIME, 1_600), (CLOCK_REALTIME, 1_000_600)]
+        );
+        assert_eq!(varint(&packets[3], TIMESTAMP_FIELD), Some(2_600));
+        assert_eq!(
+            varint(&packets[3], TRUSTED_PACKET_SEQUENCE_ID_FIELD),
+            Some(1 + SEQUENCE_ID_STRIDE)
+        );
+        assert_eq!(varint(&packets[4], TIMESTAMP_FIELD), Some(3_600));
+        assert_eq!(
+            varint(&packets[4], TRUSTED_PACKET_SEQUENCE_ID_FIELD),
+            Some(2 + SEQUENCE_ID_STRIDE)
+        );
+        assert!(packets
+            .iter()
+            .all(|packet| varint(packet, MACHINE_ID_FIELD).is_none()));
+    }
+
+    #[test]
+    fn test_merge_default_clocks() {
+        let first = write_trace(&[clock_snapshot(&[
+            (CLOCK_BOOTTIME, 1_000),
+            (CLOCK_REALTIME, 1_000_000),
+        ])]);
+        let second = write_trace(&[
+            clock_snapshot(&[(CLOCK_BOOTTIME, 2_000), (CLOCK_REALTIME, 1_000_000)]),
+            // the wall clock becomes the default of the sequence 1, including this packet
+            with_default_clock(event(1, 10_000), CLOCK_REALTIME),
+            event(1, 20_000),
+            // the other sequences keep the trace clock
+            event(2, 30_000),
+            // explicit clock of the packet
+            with_field(event(2, 40_000), TIMESTAMP_CLOCK_ID_FIELD, CLOCK_REALTIME),
+            // the cleared incremental state resets the defaults
+            with_field(
+                event(1, 50_000),
+                SEQUENCE_FLAGS_FIELD,
+                SEQ_INCREMENTAL_STATE_CLEARED,
+            ),
+            with_field(event(1, 60_000), INCREMENTAL_STATE_CLEARED_FIELD, 1),
+        ]);
+
+        let (shifts, packets) = merge(&[
+            MergeInput::new(first.path()),
+            MergeInput::new(second.path()).clock_offset_ns(7),
+        ]);
+        assert_eq!(shifts, vec![0, -993]);
+
+        let timestamps: Vec<_> = packets[2..]
+            .iter()
+            .map(|packet| varint(packet, TIMESTAMP_FIELD).unwrap())
+            .collect();
+        assert_eq!(
+            timestamps,
+            vec![10_007, 20_007, 29_007, 40_007, 49_007, 59_007]
+        );
+    }
+
+    #[test]
+    fn test_merge_machine_ids() {
+        // the traces without a clock snapshot are not shifted
+        let traces: Vec<_> = (0..5)
+            .map(|index| write_trace(&[with_field(event(1, 100 * index), MACHINE_ID_FIELD, 42)]))
+            .collect();
+
+        let (shifts, packets) = merge(&[
+            MergeInput::new(traces[0].path()).host("a"),
+            MergeInput::new(traces[1].path()),
+            MergeInput::new(traces[2].path()).host("b"),
+            MergeInput::new(traces[3].path()).host("a"),
+            MergeInput::new(traces[4].path()).host("c"),
+        ]);
+        assert_eq!(shifts, vec![0; 5]);
+
+        let machine_ids: Vec<_> = packets
+            .iter()
+            .map(|packet| varint(packet, MACHINE_ID_FIELD))
+            .collect();
+        assert_eq!(machine_ids, vec![None, None, Some(1), None, Some(2)]);
+        let timestamps: Vec<_> = packets
+            .iter()
+            .map(|packet| varint(packet, TIMESTAMP_FIELD).unwrap())
+            .collect();
+        assert_eq!(timestamps, vec![0, 100, 200, 300, 400]);
+    }
+
+    #[test]
+    fn test_merge_without_first_host() {
+        let traces: Vec<_> = (0..3).map(|_| write_trace(&[event(1, 1)])).collect();
+
+        let (_, packets) = merge(&[
+            MergeInput::new(traces[0].path()),
+            MergeInput::new(traces[1].path()).host("a"),
+            MergeInput::new(traces[2].path()),
+        ]);
+        let machine_ids: Vec<_> = packets
+            .iter()
+            .map(|packet| varint(packet, MACHINE_ID_FIELD))
+            .collect();
+        assert_eq!(machine_ids, vec![None, Some(1), None]);
+    }
+}
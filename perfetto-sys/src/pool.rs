@@ -0,0 +1,71 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Per-thread pools of the argument buffers of `EventData`. The buffers are cleared and reused
+//! once the event is emitted, so that creating events doesn't allocate in the steady state.
+//! A buffer is returned to the pool of the thread that releases it, which is not necessarily
+//! the one that allocated it.
+
+use std::cell::RefCell;
+
+use crate::event::PerfettoArg;
+
+/// Maximum number of buffers of each kind kept by a thread.
+const POOL_CAPACITY: usize = 64;
+/// Buffers that have grown beyond this capacity in bytes are freed instead of being kept.
+const MAX_BUFFER_BYTES: usize = 16 * 1024;
+
+thread_local! {
+    static ARGS: RefCell<Vec<Vec<PerfettoArg>>> = const { RefCell::new(Vec::new()) };
+    static STRINGS: RefCell<Vec<String>> = const { RefCell::new(Vec::new()) };
+}
+
+fn should_keep(capacity: usize, element_size: usize) -> bool {
+    capacity != 0 && capacity * element_size <= MAX_BUFFER_BYTES
+}
+
+/// Get an empty arguments buffer.
+pub(crate) fn take_args() -> Vec<PerfettoArg> {
+    ARGS.try_with(|pool| pool.borrow_mut().pop())
+        .ok()
+        .flatten()
+        .unwrap_or_default()
+}
+
+/// Return an arguments buffer to the pool of the current thread.
+pub(crate) fn release_args(mut args: Vec<PerfettoArg>) {
+    if !should_keep(args.capacity(), size_of::<PerfettoArg>()) {
+        return;
+    }
+
+    args.clear();
+    _ = ARGS.try_with(|pool| {
+        let mut pool = pool.borrow_mut();
+        if pool.len() < POOL_CAPACITY {
+            pool.push(args);
+        }
+    });
+}
+
+/// Get an empty strings buffer.
+pub(crate) fn take_strings() -> String {
+    STRINGS
+        .try_with(|pool| pool.borrow_mut().pop())
+        .ok()
+        .flatten()
+        .unwrap_or_default()
+}
+
+/// Return a strings buffer to the pool of the current thread.
+pub(crate) fn release_strings(mut strings: String) {
+    if !should_keep(strings.capacity(), 1) {
+        return;
+    }
+
+    strings.clear();
+    _ = STRINGS.try_with(|pool| {
+        let mut pool = pool.borrow_mut();
+        if pool.len() < POOL_CAPACITY {
+            pool.push(strings);
+        }
+    });
+}
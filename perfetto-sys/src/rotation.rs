@@ -0,0 +1,210 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Rotation of the trace of the in-process backend into chunk files, see `RotationConfig`.
+
+use std::{
+    collections::VecDeque,
+    ffi::{c_char, c_void, CString},
+    os::unix::ffi::OsStrExt,
+    path::{Path, PathBuf},
+    sync::{Arc, Condvar, Mutex},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use crate::stats::{PerfettoStats, RawStats};
+
+extern "C" {
+    fn snapshot_perfetto(guard: *mut c_void, output_path: *const c_char) -> bool;
+    fn get_perfetto_stats(guard: *mut c_void, stats: *mut RawStats) -> bool;
+}
+
+/// Rotation of the trace into chunk files for long-running processes. The data of the trace
+/// buffer is moved into a new file once it reaches `max_chunk_size_kb` or after
+/// `max_chunk_duration`, while the events keep being recorded. The last chunk is written when
+/// the guard is dropped, the output path of the guard is not used.
+///
+/// The interned data and the track descriptors are emitted again every
+/// `incremental_state_clear_period`, so that every chunk can be opened on its own. The events
+/// of a chunk recorded before the first re-emission refer to the data of the previous chunk,
+/// they are only shown when the chunks are concatenated, e.g. with `cat`.
+///
+/// The buffer has to hold the data of a chunk, the data that doesn't fit is dropped, see
+/// `BufferStats::chunks_discarded`. `PerfettoGuard::snapshot` returns an error while rotating,
+/// since the snapshot would take the data of the current chunk.
+pub struct RotationConfig {
+    /// Path of the chunk with the given index, starting at 0.
+    pub chunk_path: Box<dyn FnMut(usize) -> PathBuf + Send>,
+    /// A chunk is written once the unread data in the buffers reaches this size in kilobytes.
+    /// The size is the one before the compression.
+    pub max_chunk_size_kb: Option<usize>,
+    /// A chunk is written once it covers this duration.
+    pub max_chunk_duration: Option<Duration>,
+    /// Number of the most recent chunks kept on disk, the older ones are deleted.
+    /// If `None`, all the chunks are kept.
+    pub max_chunks: Option<usize>,
+    /// How often the interned data and the track descriptors are emitted again.
+    pub incremental_state_clear_period: Duration,
+    /// How often the size of the chunk is checked.
+    pub poll_period: Duration,
+}
+
+impl RotationConfig {
+    /// Rotation with the default periods and without limits, set at least the size or the
+    /// duration of the chunks.
+    pub fn new(chunk_path: impl FnMut(usize) -> PathBuf + Send + 'static) -> Self {
+        Self {
+            chunk_path: Box::new(chunk_path),
+            max_chunk_size_kb: None,
+            max_chunk_duration: None,
+            max_chunks: None,
+            incremental_state_clear_period: Duration::from_secs(1),
+            poll_period: Duration::from_millis(250),
+        }
+    }
+}
+
+/// Chunk files written so far.
+pub(crate) struct ChunkFiles {
+    chunk_path: Box<dyn FnMut(usize) -> PathBuf + Send>,
+    next_index: usize,
+    max_chunks: Option<usize>,
+    written: VecDeque<PathBuf>,
+}
+
+impl ChunkFiles {
+    fn new(chunk_path: Box<dyn FnMut(usize) -> PathBuf + Send>, max_chunks: Option<usize>) -> Self {
+        Self {
+            chunk_path,
+            next_index: 0,
+            max_chunks,
+            written: VecDeque::new(),
+        }
+    }
+
+    pub(crate) fn next_path(&mut self) -> PathBuf {
+        let path = (self.chunk_path)(self.next_index);
+        self.next_index += 1;
+        path
+    }
+
+    /// Record a written chunk and delete the chunks past the retention limit.
+    pub(crate) fn written(&mut self, path: PathBuf) {
+        self.written.push_back(path);
+        while self
+            .max_chunks
+            .is_some_and(|max_chunks| self.written.len() > max_chunks.max(1))
+        {
+            let Some(oldest) = self.written.pop_front() else {
+                break;
+            };
+            if let Err(e) = std::fs::remove_file(&oldest) {
+                eprintln!("failed to delete the trace chunk {}: {e}", oldest.display());
+            }
+        }
+    }
+}
+
+/// The pointer of the guard, used only until the guard stops the thread.
+struct GuardPtr(*mut c_void);
+
+// Safety: the session is only read, the snapshot and the stats are synchronized by the wrapper
+unsafe impl Send for GuardPtr {}
+
+/// Background thread writing the chunks.
+pub(crate) struct Rotator {
+    /// Set to true to stop the thread.
+    stop: Arc<(Mutex<bool>, Condvar)>,
+    thread: JoinHandle<ChunkFiles>,
+}
+
+impl Rotator {
+    /// `guard` must stay valid until `finish` returns.
+    pub(crate) fn start(guard: *mut c_void, config: RotationConfig) -> Self {
+        let guard = GuardPtr(guard);
+        let stop = Arc::new((Mutex::new(false), Condvar::new()));
+        let thread = thread::Builder::new()
+            .name("perfetto-rotate".to_string())
+            .spawn({
+                let stop = stop.clone();
+                move || {
+                    // captures the wrapper rather than the pointer inside it
+                    let guard = guard;
+                    let mut files = ChunkFiles::new(config.chunk_path, config.max_chunks);
+                    let mut chunk_started = Instant::now();
+
+                    let (stopped, condvar) = &*stop;
+                    let mut stopped = stopped.lock().unwrap();
+                    loop {
+                        (stopped, _) = condvar.wait_timeout(stopped, config.poll_period).unwrap();
+                        if *stopped {
+                            break;
+                        }
+
+                        let duration_reached = config
+                            .max_chunk_duration
+                            .is_some_and(|duration| chunk_started.elapsed() >= duration);
+                        let size_reached = config.max_chunk_size_kb.is_some_and(|size_kb| {
+                            unread_bytes(guard.0)
+                                .is_some_and(|bytes| bytes >= size_kb as u64 * 1024)
+                        });
+                        if !duration_reached && !size_reached {
+                            continue;
+                        }
+
+                        let path = files.next_path();
+                        let path_str = path_to_cstring(&path);
+                        match unsafe { snapshot_perfetto(guard.0, path_str.as_ptr()) } {
+                            true => files.written(path),
+                            false => {
+                                eprintln!("failed to write the trace chunk {}", path.display())
+                            }
+                        }
+                        chunk_started = Instant::now();
+                    }
+                    files
+                }
+            })
+            .expect("failed to spawn the rotation thread");
+
+        Self { stop, thread }
+    }
+
+    /// Stop the thread, the remaining data goes into the next chunk of the returned files.
+    pub(crate) fn finish(self) -> ChunkFiles {
+        let (stopped, condvar) = &*self.stop;
+        *stopped.lock().unwrap() = true;
+        condvar.notify_one();
+
+        self.thread
+            .join()
+            .expect("the rotation thread has panicked")
+    }
+}
+
+/// Path of a chunk as passed to the wrapper.
+pub(crate) fn path_to_cstring(path: &Path) -> CString {
+    CString::new(path.as_os_str().as_bytes()).expect("chunk path is not a valid string")
+}
+
+/// Data in the buffers that has not been written into a chunk yet.
+fn unread_bytes(guard: *mut c_void) -> Option<u64> {
+    let mut stats = RawStats::default();
+    if !unsafe { get_perfetto_stats(guard, &mut stats) } {
+        return None;
+    }
+
+    let stats = PerfettoStats::from(stats);
+    Some(
+        stats
+            .buffers
+            .iter()
+            .map(|buffer| {
+                buffer
+                    .bytes_written
+                    .saturating_sub(buffer.bytes_read)
+                    .saturating_sub(buffer.bytes_overwritten)
+            })
+            .sum(),
+    )
+}
@@ -0,0 +1,378 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Sampling of frequent events, keyed by event name or category. The decision is taken once per
+//! span, so its begin and end are either both emitted or both skipped. The samplers keep their
+//! state per thread, so the decisions don't synchronize the threads; the limits apply per thread.
+
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    ffi::CStr,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        OnceLock, RwLock,
+    },
+};
+
+use crate::{
+    event::{get_category_handle, register_name, trace_time_ns},
+    CounterHandle,
+};
+
+/// Name of the counter track with the total number of sampled out events.
+const SAMPLED_OUT_COUNTER_NAME: &str = "sampled_out_events";
+/// Number of sampled out events after which a thread adds them to the total.
+const SAMPLED_OUT_FLUSH_COUNT: u64 = 1024;
+/// A thread adds its sampled out events to the total at most this often, unless it has reached
+/// `SAMPLED_OUT_FLUSH_COUNT`.
+const SAMPLED_OUT_FLUSH_PERIOD_NS: u64 = 100_000_000;
+
+/// Events a sampling rule applies to.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum SamplingKey {
+    /// Events with this name, interned or dynamic.
+    Name(String),
+    /// Events of this category. Rules for the name of an event take precedence.
+    Category(String),
+}
+
+/// Which events of a rule are emitted.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SamplingPolicy {
+    /// One event of every `n`.
+    OneIn(u32),
+    /// At most this many events per second and thread, with bursts of up to one second worth.
+    PerSecond(u32),
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SamplingRule {
+    pub key: SamplingKey,
+    pub policy: SamplingPolicy,
+}
+
+/// Rules with the names and categories resolved to their handles.
+#[derive(Default)]
+struct ResolvedRules {
+    names: HashMap<u64, SamplingPolicy>,
+    categories: HashMap<u64, SamplingPolicy>,
+    /// Handles of the names of the rules, to match the dynamic names.
+    name_handles: HashMap<String, u64>,
+}
+
+/// Version of the current rules, 0 while there are none.
+static GENERATION: AtomicU64 = AtomicU64::new(0);
+/// Last version of the rules.
+static LAST_GENERATION: AtomicU64 = AtomicU64::new(0);
+static RULES: RwLock<Option<ResolvedRules>> = RwLock::new(None);
+static SAMPLED_OUT: AtomicU64 = AtomicU64::new(0);
+
+/// Replace the sampling rules. An empty list disables sampling.
+pub fn set_sampling_rules(rules: Vec<SamplingRule>) {
+    let mut resolved = ResolvedRules::default();
+    for rule in &rules {
+        match &rule.key {
+            SamplingKey::Name(name) => {
+                let handle = register_name(name);
+                resolved.names.insert(handle, rule.policy);
+                resolved.name_handles.insert(name.clone(), handle);
+            }
+            SamplingKey::Category(category) => {
+                resolved
+                    .categories
+                    .insert(get_category_handle(category), rule.policy);
+            }
+        }
+    }
+
+    set_resolved_rules((!rules.is_empty()).then_some(resolved));
+}
+
+fn set_resolved_rules(rules: Option<ResolvedRules>) {
+    let mut current = RULES.write().unwrap();
+    *current = rules;
+    let generation = match current.is_some() {
+        true => LAST_GENERATION.fetch_add(1, Ordering::Relaxed) + 1,
+        false => 0,
+    };
+    GENERATION.store(generation, Ordering::Release);
+}
+
+/// Total number of events sampled out. Each thread adds its events to the total in batches, at
+/// most every 100 ms while it samples events out, and when it exits.
+pub fn sampled_out_events() -> u64 {
+    SAMPLED_OUT.load(Ordering::Relaxed)
+}
+
+struct Sampler {
+    policy: SamplingPolicy,
+    seen: u64,
+    tokens: f64,
+    last_refill_ns: u64,
+}
+
+impl Sampler {
+    fn new(policy: SamplingPolicy) -> Self {
+        let tokens = match policy {
+            SamplingPolicy::OneIn(_) => 0.0,
+            SamplingPolicy::PerSecond(rate) => rate as f64,
+        };
+        Self {
+            policy,
+            seen: 0,
+            tokens,
+            last_refill_ns: trace_time_ns(),
+        }
+    }
+
+    fn should_emit(&mut self) -> bool {
+        match self.policy {
+            SamplingPolicy::OneIn(n) => {
+                let emit = self.seen % n.max(1) as u64 == 0;
+                self.seen += 1;
+                emit
+            }
+            SamplingPolicy::PerSecond(rate) => self.take_token(rate, trace_time_ns()),
+        }
+    }
+
+    /// Refill the tokens for the time elapsed until `now` and take one if there is any.
+    fn take_token(&mut self, rate: u32, now: u64) -> bool {
+        let elapsed_s = now.saturating_sub(self.last_refill_ns) as f64 * 1e-9;
+        self.last_refill_ns = now;
+        self.tokens = (self.tokens + elapsed_s * rate as f64).min(rate as f64);
+        if self.tokens >= 1.0 {
+            self.tokens -= 1.0;
+            true
+        } else {
+            false
+        }
+    }
+}
+
+#[derive(Default)]
+struct ThreadSamplers {
+    generation: u64,
+    names: HashMap<u64, Sampler>,
+    categories: HashMap<u64, Sampler>,
+    name_handles: HashMap<String, u64>,
+    /// Sampled out events not added to `SAMPLED_OUT` yet.
+    sampled_out: u64,
+    /// Time of the last addition to `SAMPLED_OUT`.
+    last_flush_ns: u64,
+}
+
+impl ThreadSamplers {
+    fn refresh(&mut self, generation: u64) {
+        self.generation = generation;
+        self.names.clear();
+        self.categories.clear();
+        self.name_handles.clear();
+
+        if let Some(rules) = RULES.read().unwrap().as_ref() {
+            for (name, policy) in &rules.names {
+                self.names.insert(*name, Sampler::new(*policy));
+            }
+            for (category, policy) in &rules.categories {
+                self.categories.insert(*category, Sampler::new(*policy));
+            }
+            self.name_handles.clone_from(&rules.name_handles);
+        }
+    }
+
+    fn flush_sampled_out(&mut self) {
+        if self.sampled_out == 0 {
+            return;
+        }
+
+        static COUNTER: OnceLock<CounterHandle> = OnceLock::new();
+        let total = SAMPLED_OUT.fetch_add(self.sampled_out, Ordering::Relaxed) + self.sampled_out;
+        self.sampled_out = 0;
+        self.last_flush_ns = trace_time_ns();
+        COUNTER
+            .get_or_init(|| CounterHandle::new(None, SAMPLED_OUT_COUNTER_NAME, None, false))
+            .set_u64(total);
+    }
+}
+
+impl Drop for ThreadSamplers {
+    fn drop(&mut self) {
+        self.flush_sampled_out();
+    }
+}
+
+thread_local! {
+    static SAMPLERS: RefCell<ThreadSamplers> = RefCell::new(ThreadSamplers::default());
+}
+
+/// Name of an event to sample.
+#[derive(Debug, Clone, Copy)]
+pub(crate) enum SampledName<'a> {
+    Interned(u64),
+    /// Matched against the names of the rules, so it shares their samplers.
+    Dynamic(&'a CStr),
+}
+
+/// Decide whether to emit an event with the `name` and the category handle returned by `category`.
+pub(crate) fn should_emit(name: SampledName<'_>, category: impl FnOnce() -> u64) -> bool {
+    let generation = GENERATION.load(Ordering::Acquire);
+    if generation == 0 {
+        return true;
+    }
+
+    SAMPLERS
+        .try_with(|samplers| {
+            let mut samplers = samplers.borrow_mut();
+            let samplers = &mut *samplers;
+            if samplers.generation != generation {
+                samplers.refresh(generation);
+            }
+
+            let name = match name {
+                SampledName::Interned(name) => Some(name),
+                SampledName::Dynamic(name) => name
+                    .to_str()
+                    .ok()
+                    .and_then(|name| samplers.name_handles.get(name).copied()),
+            };
+            let sampler = match name.and_then(|name| samplers.names.get_mut(&name)) {
+                Some(sampler) => Some(sampler),
+                None => samplers.categories.get_mut(&category()),
+            };
+            let emit = sampler.is_none_or(|sampler| sampler.should_emit());
+            if !emit {
+                samplers.sampled_out += 1;
+                let flush_due = trace_time_ns().saturating_sub(samplers.last_flush_ns)
+                    >= SAMPLED_OUT_FLUSH_PERIOD_NS;
+                if samplers.sampled_out >= SAMPLED_OUT_FLUSH_COUNT || flush_due {
+                    samplers.flush_sampled_out();
+                }
+            }
+            emit
+        })
+        .unwrap_or(true)
+}
+
+/// Add the sampled out events of the current thread to the total.
+pub(crate) fn flush_sampled_out_events() {
+    _ = SAMPLERS.try_with(|samplers| samplers.borrow_mut().flush_sampled_out());
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{thread, time::Duration};
+
+    use super::*;
+
+    const NAME: u64 = 1;
+    const CATEGORY: u64 = 2;
+    const OTHER_CATEGORY: u64 = 3;
+    /// Name without rules.
+    const OTHER_NAME: SampledName = SampledName::Interned(4);
+
+    fn sampler_at_zero(policy: SamplingPolicy) -> Sampler {
+        let mut sampler = Sampler::new(policy);
+        sampler.last_refill_ns = 0;
+        sampler
+    }
+
+    #[test]
+    fn test_one_in() {
+        let mut sampler = sampler_at_zero(SamplingPolicy::OneIn(3));
+        let emitted: Vec<_> = (0..7).map(|_| sampler.should_emit()).collect();
+        assert_eq!(emitted, [true, false, false, true, false, false, true]);
+
+        // 0 keeps every event
+        let mut sampler = sampler_at_zero(SamplingPolicy::OneIn(0));
+        assert!((0..3).all(|_| sampler.should_emit()));
+    }
+
+    #[test]
+    fn test_per_second() {
+        let mut sampler = sampler_at_zero(SamplingPolicy::PerSecond(2));
+
+        // a full bucket allows a burst of one second worth of events
+        assert!(sampler.take_token(2, 0));
+        assert!(sampler.take_token(2, 0));
+        assert!(!sampler.take_token(2, 0));
+
+        // a token is refilled every half a second
+        assert!(!sampler.take_token(2, 400_000_000));
+        assert!(sampler.take_token(2, 500_000_000));
+        assert!(!sampler.take_token(2, 500_000_000));
+
+        // the bucket doesn't grow past one second worth of events
+        assert!(sampler.take_token(2, 10_000_000_000));
+        assert!(sampler.take_token(2, 10_000_000_000));
+        assert!(!sampler.take_token(2, 10_000_000_000));
+    }
+
+    /// Decisions for the events of `NAME` and `OTHER_CATEGORY`.
+    fn decisions(count: usize) -> Vec<bool> {
+        (0..count)
+            .map(|_| should_emit(SampledName::Interned(NAME), || OTHER_CATEGORY))
+            .collect()
+    }
+
+    /// The rules are global, so the tests that set them are run one after another.
+    #[test]
+    fn test_rules() {
+        // the samplers are per thread, start with fresh ones
+        thread::spawn(check_rules_generation).join().unwrap();
+        thread::spawn(check_sampled_out_flush_period)
+            .join()
+            .unwrap();
+        set_resolved_rules(None);
+    }
+
+    fn check_rules_generation() {
+        let rules = |policy| ResolvedRules {
+            names: HashMap::from([(NAME, policy)]),
+            categories: HashMap::from([(CATEGORY, SamplingPolicy::PerSecond(0))]),
+            name_handles: HashMap::from([("name".to_string(), NAME)]),
+        };
+        let sampled_out = sampled_out_events();
+
+        set_resolved_rules(Some(rules(SamplingPolicy::OneIn(2))));
+        assert_eq!(decisions(4), [true, false, true, false]);
+        // the rules of the names take precedence over the categories
+        assert!(should_emit(SampledName::Interned(NAME), || CATEGORY));
+        assert!(!should_emit(OTHER_NAME, || CATEGORY));
+        assert!(should_emit(OTHER_NAME, || OTHER_CATEGORY));
+
+        // the dynamic names share the samplers of the rules of their names
+        let dynamic = |name| should_emit(SampledName::Dynamic(name), || CATEGORY);
+        assert!(!dynamic(c"name"));
+        assert!(dynamic(c"name"));
+        assert!(!dynamic(c"other"));
+
+        // new rules replace the samplers of the thread
+        set_resolved_rules(Some(rules(SamplingPolicy::OneIn(3))));
+        assert_eq!(decisions(4), [true, false, false, true]);
+
+        set_resolved_rules(None);
+        assert_eq!(GENERATION.load(Ordering::Relaxed), 0);
+        assert_eq!(decisions(3), [true, true, true]);
+
+        flush_sampled_out_events();
+        assert_eq!(sampled_out_events(), sampled_out + 7);
+    }
+
+    fn check_sampled_out_flush_period() {
+        set_resolved_rules(Some(ResolvedRules {
+            names: HashMap::new(),
+            categories: HashMap::from([(OTHER_CATEGORY, SamplingPolicy::PerSecond(0))]),
+            name_handles: HashMap::new(),
+        }));
+        let sampled_out = sampled_out_events();
+
+        // the first event is added to the total right away, the next ones after the period
+        assert!(!should_emit(OTHER_NAME, || OTHER_CATEGORY));
+        assert_eq!(sampled_out_events(), sampled_out + 1);
+        assert!(!should_emit(OTHER_NAME, || OTHER_CATEGORY));
+        assert_eq!(sampled_out_events(), sampled_out + 1);
+        thread::sleep(Duration::from_nanos(SAMPLED_OUT_FLUSH_PERIOD_NS));
+        assert!(!should_emit(OTHER_NAME, || OTHER_CATEGORY));
+        assert_eq!(sampled_out_events(), sampled_out + 3);
+    }
+}
@@ -0,0 +1,80 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Health of the tracing session as reported by the tracing service, see `PerfettoGuard::stats`.
+
+/// Maximum number of buffers reported, see `kPerfettoStatsMaxBuffers` in wrapper.h.
+const MAX_BUFFERS: usize = 8;
+
+/// Statistics of a trace buffer, see `PerfettoBufferStats` in wrapper.h.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct BufferStats {
+    /// Size of the buffer in bytes.
+    pub buffer_size: u64,
+    /// Bytes written into the buffer, including the overwritten ones.
+    pub bytes_written: u64,
+    /// Bytes overwritten by newer data in the ring buffer mode.
+    pub bytes_overwritten: u64,
+    /// Bytes read from the buffer, i.e. written into the trace file.
+    pub bytes_read: u64,
+    pub chunks_written: u64,
+    /// Chunks dropped because the buffer was full. A non-zero value means the buffer is too small.
+    pub chunks_discarded: u64,
+    /// Chunks overwritten by newer data in the ring buffer mode.
+    pub chunks_overwritten: u64,
+    /// Packets lost by the producers because the shared memory was full. A non-zero value means
+    /// the shared memory is too small or the flush period too long.
+    pub trace_writer_packet_loss: u64,
+}
+
+impl BufferStats {
+    /// Approximate fraction of the buffer holding data that has not been read yet.
+    pub fn fill_ratio(&self) -> f64 {
+        if self.buffer_size == 0 {
+            return 0.0;
+        }
+
+        let used = self
+            .bytes_written
+            .saturating_sub(self.bytes_read)
+            .saturating_sub(self.bytes_overwritten)
+            .min(self.buffer_size);
+        used as f64 / self.buffer_size as f64
+    }
+}
+
+/// See `PerfettoStats` in wrapper.h.
+#[repr(C)]
+#[derive(Default)]
+pub(crate) struct RawStats {
+    chunks_discarded: u64,
+    patches_discarded: u64,
+    flushes_succeeded: u64,
+    flushes_failed: u64,
+    buffer_count: usize,
+    buffers: [BufferStats; MAX_BUFFERS],
+}
+
+/// Statistics of the tracing session.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct PerfettoStats {
+    /// Chunks dropped by the service before they reached a buffer.
+    pub chunks_discarded: u64,
+    pub patches_discarded: u64,
+    pub flushes_succeeded: u64,
+    pub flushes_failed: u64,
+    /// The main buffer first, then the category buffers in the order of the configuration.
+    pub buffers: Vec<BufferStats>,
+}
+
+impl From<RawStats> for PerfettoStats {
+    fn from(raw: RawStats) -> Self {
+        Self {
+            chunks_discarded: raw.chunks_discarded,
+            patches_discarded: raw.patches_discarded,
+            flushes_succeeded: raw.flushes_succeeded,
+            flushes_failed: raw.flushes_failed,
+            buffers: raw.buffers[..raw.buffer_count.min(MAX_BUFFERS)].to_vec(),
+        }
+    }
+}
@@ -0,0 +1,45 @@
+// Copyright 2025 Irreducible Inc.
+
+use std::{
+    ffi::{c_char, CString},
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+extern "C" {
+    fn register_async_track(track_id: u64, name: *const c_char);
+    fn unregister_async_track(track_id: u64);
+}
+
+/// First ID of the async tracks, far from the IDs usually chosen by hand.
+const FIRST_ASYNC_TRACK_ID: u64 = 1 << 62;
+
+static NEXT_ASYNC_TRACK_ID: AtomicU64 = AtomicU64::new(FIRST_ASYNC_TRACK_ID);
+
+/// Named track for asynchronous work, e.g. a task that migrates between threads. Its events can
+/// begin and end on different threads, but must still be properly nested in time.
+/// The track descriptor is written once, not with every event. Drop the track only once all
+/// its events are emitted, the events emitted afterwards are on an unnamed track.
+#[derive(Debug)]
+pub struct AsyncTrack {
+    id: u64,
+}
+
+impl AsyncTrack {
+    pub fn new(name: &str) -> Self {
+        let id = NEXT_ASYNC_TRACK_ID.fetch_add(1, Ordering::Relaxed);
+        let name = CString::new(name).expect("track name is not a valid string");
+        unsafe { register_async_track(id, name.as_ptr()) };
+        Self { id }
+    }
+
+    /// Track ID to pass to `EventData::set_track_id`.
+    pub fn id(&self) -> u64 {
+        self.id
+    }
+}
+
+impl Drop for AsyncTrack {
+    fn drop(&mut self) {
+        unsafe { unregister_async_track(self.id) };
+    }
+}
@@ -1,43 +1,7 @@
 // Copyright 2024-2025 Irreducible Inc.
 
+use std::ops::AddAssign;
 use std::{borrow::Cow, fmt::Write};
-use {linear_map::LinearMap, std::ops::AddAssign};
-
-pub struct StoringFieldVisitor<'a>(pub &'a mut LinearMap<&'static str, String>);
-
-impl tracing::field::Visit for StoringFieldVisitor<'_> {
-    fn record_f64(&mut self, field: &tracing::field::Field, value: f64) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_i64(&mut self, field: &tracing::field::Field, value: i64) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_u64(&mut self, field: &tracing::field::Field, value: u64) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_bool(&mut self, field: &tracing::field::Field, value: bool) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_str(&mut self, field: &tracing::field::Field, value: &str) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_error(
-        &mut self,
-        field: &tracing::field::Field,
-        value: &(dyn std::error::Error + 'static),
-    ) {
-        self.0.insert(field.name(), value.to_string());
-    }
-
-    fn record_debug(&mut self, field: &tracing::field::Field, value: &dyn std::fmt::Debug) {
-        self.0.insert(field.name(), format!("{value:?}"));
-    }
-}
 
 pub struct WritingFieldVisitor<'a, Writer: Write> {
     is_first: bool,
@@ -156,12 +120,26 @@ impl AddAssign<u64> for CounterValue {
 #[derive(Default)]
 pub struct CounterVisitor {
     pub value: Option<CounterValue>,
-    pub unit: Option<String>,
-    pub category: Option<String>,
+    /// Empty if not set.
+    pub unit: String,
+    /// Empty if not set.
+    pub category: String,
     pub is_counter: bool,
     pub is_incremental: bool,
 }
 
+impl CounterVisitor {
+    /// Reset the visitor for the next event, the strings keep their buffers.
+    #[allow(unused)]
+    pub fn clear(&mut self) {
+        self.value = None;
+        self.unit.clear();
+        self.category.clear();
+        self.is_counter = false;
+        self.is_incremental = false;
+    }
+}
+
 const COUNTER_VALUE_FIELD: &str = "value";
 const IS_COUNTER_FIELD: &str = "counter";
 const IS_INCREMENTAL_FIELD: &str = "incremental";
@@ -198,10 +176,12 @@ impl tracing::field::Visit for CounterVisitor {
     fn record_str(&mut self, field: &tracing::field::Field, value: &str) {
         match field.name() {
             PERFETTO_CATEGORY_FIELD => {
-                self.category.replace(value.to_string());
+                self.category.clear();
+                self.category.push_str(value);
             }
             UNIT_FIELD => {
-                self.unit.replace(value.to_string());
+                self.unit.clear();
+                self.unit.push_str(value);
             }
             _ => {}
         }
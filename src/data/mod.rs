@@ -4,20 +4,23 @@ mod event_counts;
 mod field_visitor;
 mod guard_wrapper;
 mod log_tree;
+mod per_thread;
+mod recorded_fields;
 mod span_metadata;
 mod storage_utils;
 
 pub(crate) use event_counts::EventCounts;
 #[allow(unused_imports)]
-pub use field_visitor::{CounterValue, CounterVisitor, StoringFieldVisitor, WritingFieldVisitor};
+pub use field_visitor::{CounterValue, CounterVisitor, WritingFieldVisitor};
 #[allow(unused_imports)]
 pub(super) use guard_wrapper::GuardWrapper;
 pub use log_tree::LogTree;
+pub use per_thread::PerThread;
+#[allow(unused_imports)]
+pub use recorded_fields::{record_span_fields, span_fields, FieldValue, RecordedFields};
 #[cfg(feature = "perfetto")]
 pub use span_metadata::*;
-#[cfg(feature = "ittapi")]
 pub use storage_utils::insert_to_span_storage;
 #[cfg(feature = "perf_counters")]
 pub use storage_utils::with_span_storage;
-#[cfg(any(feature = "perfetto", feature = "ittapi", feature = "perf_counters"))]
 pub use storage_utils::with_span_storage_mut;
@@ -0,0 +1,123 @@
+// Copyright 2025 Irreducible Inc.
+
+use std::{
+    any::Any,
+    cell::RefCell,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
+};
+
+use crate::errors::err_msg;
+
+static NEXT_ID: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    /// Values of the current thread per `PerThread` instance.
+    static VALUES: RefCell<Vec<(usize, Arc<dyn Any + Send + Sync>)>> =
+        const { RefCell::new(Vec::new()) };
+}
+
+/// A value per thread that can also be read from the other threads, e.g. totals of a layer that
+/// are printed when its guard is dropped. The threads update their own values, so they don't
+/// contend with each other, only with the threads reading all the values.
+pub struct PerThread<T> {
+    id: usize,
+    /// Values of all the threads that have used this instance, including the exited ones.
+    values: Mutex<Vec<Arc<Mutex<T>>>>,
+}
+
+impl<T: Default + Send + 'static> PerThread<T> {
+    pub fn new() -> Self {
+        Self {
+            id: NEXT_ID.fetch_add(1, Ordering::Relaxed),
+            values: Mutex::new(Vec::new()),
+        }
+    }
+
+    /// Perform operation with the value of the current thread.
+    pub fn with<R>(&self, f: impl FnOnce(&mut T) -> R) -> Option<R> {
+        let value = VALUES
+            .try_with(|values| {
+                let index = values.borrow().iter().position(|(id, _)| *id == self.id);
+                let value = match index {
+                    Some(index) => values.borrow()[index].1.clone(),
+                    None => {
+                        let value = Arc::new(Mutex::new(T::default()));
+                        self.values.lock().ok()?.push(value.clone());
+                        values.borrow_mut().push((self.id, value.clone()));
+                        value
+                    }
+                };
+                value.downcast::<Mutex<T>>().ok()
+            })
+            .ok()
+            .flatten();
+        let Some(value) = value else {
+            err_msg!("failed to get thread value");
+            return None;
+        };
+
+        let Ok(mut value) = value.lock() else {
+            err_msg!("failed to get mutex");
+            return None;
+        };
+        Some(f(&mut value))
+    }
+
+    /// Perform operation with the values of all the threads.
+    pub fn for_each(&self, mut f: impl FnMut(&mut T)) {
+        let Ok(values) = self.values.lock() else {
+            return err_msg!("failed to get mutex");
+        };
+
+        for value in values.iter() {
+            match value.lock() {
+                Ok(mut value) => f(&mut value),
+                Err(_) => err_msg!("failed to get mutex"),
+            }
+        }
+    }
+}
+
+impl<T: Default + Send + 'static> Default for PerThread<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+
+    use super::*;
+
+    #[test]
+    fn test_per_thread() {
+        let values = Arc::new(PerThread::<usize>::new());
+        values.with(|value| *value += 1);
+        let handles: Vec<_> = (0..4)
+            .map(|_| {
+                let values = values.clone();
+                thread::spawn(move || {
+                    values.with(|value| *value += 10);
+                    values.with(|value| *value += 10);
+                })
+            })
+            .collect();
+        for handle in handles {
+            handle.join().unwrap();
+        }
+
+        // the values of the exited threads are kept
+        let mut all = Vec::new();
+        values.for_each(|value| all.push(*value));
+        all.sort();
+        assert_eq!(all, [1, 20, 20, 20, 20]);
+
+        // the other instances have values of their own
+        let other = PerThread::<usize>::new();
+        assert_eq!(other.with(|value| *value), Some(0));
+    }
+}
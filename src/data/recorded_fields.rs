@@ -0,0 +1,405 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Span fields shared by the stacked layers. The attributes of a span are visited once, by the
+//! first layer that asks for them, and stored as a span extension that the other layers reuse.
+
+use std::{fmt::Write, sync::Arc};
+
+use tracing::{
+    field::{Field, Visit},
+    span,
+};
+use tracing_subscriber::registry::LookupSpan;
+
+use crate::errors::err_msg;
+
+/// Value of a recorded field, the strings point to the storage of the fields.
+#[derive(Debug, Copy, Clone, PartialEq)]
+pub enum FieldValue<'a> {
+    I64(i64),
+    U64(u64),
+    F64(f64),
+    Bool(bool),
+    /// String, error or `Debug` value.
+    Str(&'a str),
+}
+
+impl std::fmt::Display for FieldValue<'_> {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            FieldValue::I64(value) => write!(f, "{value}"),
+            FieldValue::U64(value) => write!(f, "{value}"),
+            FieldValue::F64(value) => write!(f, "{value}"),
+            FieldValue::Bool(value) => write!(f, "{value}"),
+            FieldValue::Str(value) => f.write_str(value),
+        }
+    }
+}
+
+#[derive(Copy, Clone)]
+enum StoredValue {
+    I64(i64),
+    U64(u64),
+    F64(f64),
+    Bool(bool),
+    Str(u32, u32),
+}
+
+#[derive(Default, Clone)]
+struct Fields {
+    /// Field names are the static names of the callsite, in the order of recording.
+    values: Vec<(&'static str, StoredValue)>,
+    /// All string values of the span, written one after another. The bytes of a replaced value
+    /// are removed, so the size is bounded by the current values.
+    strings: String,
+}
+
+/// Recorded fields of a span. Cloning shares the values, the empty fields don't allocate.
+#[derive(Default, Clone)]
+pub struct RecordedFields(Option<Arc<Fields>>);
+
+impl RecordedFields {
+    pub fn is_empty(&self) -> bool {
+        self.0
+            .as_ref()
+            .is_none_or(|fields| fields.values.is_empty())
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (&'static str, FieldValue<'_>)> {
+        self.0.iter().flat_map(|fields| {
+            fields.values.iter().map(|&(name, value)| {
+                let value = match value {
+                    StoredValue::I64(value) => FieldValue::I64(value),
+                    StoredValue::U64(value) => FieldValue::U64(value),
+                    StoredValue::F64(value) => FieldValue::F64(value),
+                    StoredValue::Bool(value) => FieldValue::Bool(value),
+                    StoredValue::Str(start, end) => {
+                        FieldValue::Str(&fields.strings[start as usize..end as usize])
+                    }
+                };
+                (name, value)
+            })
+        })
+    }
+
+    /// Write the fields as `key: value` separated by `separator`.
+    #[allow(unused)]
+    pub fn write_to(&self, writer: &mut impl Write, separator: &str) -> std::fmt::Result {
+        for (i, (name, value)) in self.iter().enumerate() {
+            if i > 0 {
+                writer.write_str(separator)?;
+            }
+            write!(writer, "{name}: {value}")?;
+        }
+        Ok(())
+    }
+
+    /// Record `values` into the fields, a field recorded again replaces the previous value.
+    /// The storage is copied first if it is shared, so the layers shouldn't keep the fields of
+    /// a span that is still recorded.
+    fn record(&mut self, values: &impl RecordFields) {
+        if values.is_empty() {
+            return;
+        }
+        let fields = Arc::make_mut(self.0.get_or_insert_default());
+        values.record(&mut FieldsVisitor(fields));
+    }
+}
+
+impl std::fmt::Debug for RecordedFields {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_map()
+            .entries(self.iter().map(|(name, value)| (name, value.to_string())))
+            .finish()
+    }
+}
+
+/// Attributes and records of the spans.
+trait RecordFields {
+    fn is_empty(&self) -> bool;
+    fn record(&self, visitor: &mut dyn Visit);
+}
+
+impl RecordFields for span::Attributes<'_> {
+    fn is_empty(&self) -> bool {
+        span::Attributes::is_empty(self)
+    }
+
+    fn record(&self, visitor: &mut dyn Visit) {
+        span::Attributes::record(self, visitor)
+    }
+}
+
+impl RecordFields for span::Record<'_> {
+    fn is_empty(&self) -> bool {
+        span::Record::is_empty(self)
+    }
+
+    fn record(&self, visitor: &mut dyn Visit) {
+        span::Record::record(self, visitor)
+    }
+}
+
+struct FieldsVisitor<'a>(&'a mut Fields);
+
+impl FieldsVisitor<'_> {
+    fn insert(&mut self, field: &Field, value: StoredValue) {
+        self.remove_str(field.name());
+        self.set(field.name(), value);
+    }
+
+    fn insert_str(&mut self, field: &Field, write: impl FnOnce(&mut String)) {
+        self.remove_str(field.name());
+        let start = self.0.strings.len() as u32;
+        write(&mut self.0.strings);
+        let end = self.0.strings.len() as u32;
+        self.set(field.name(), StoredValue::Str(start, end));
+    }
+
+    fn set(&mut self, name: &'static str, value: StoredValue) {
+        match self.0.values.iter_mut().find(|(key, _)| *key == name) {
+            Some((_, stored)) => *stored = value,
+            None => self.0.values.push((name, value)),
+        }
+    }
+
+    /// Remove the bytes of the string value of `name`, if any, from the strings. The stored value
+    /// must be replaced right after.
+    fn remove_str(&mut self, name: &str) {
+        let Some(&(_, StoredValue::Str(start, end))) =
+            self.0.values.iter().find(|(key, _)| *key == name)
+        else {
+            return;
+        };
+
+        self.0
+            .strings
+            .replace_range(start as usize..end as usize, "");
+        let len = end - start;
+        for (_, value) in &mut self.0.values {
+            if let StoredValue::Str(other_start, other_end) = value {
+                if *other_start >= end {
+                    *other_start -= len;
+                    *other_end -= len;
+                }
+            }
+        }
+    }
+}
+
+impl Visit for FieldsVisitor<'_> {
+    fn record_f64(&mut self, field: &Field, value: f64) {
+        self.insert(field, StoredValue::F64(value));
+    }
+
+    fn record_i64(&mut self, field: &Field, value: i64) {
+        self.insert(field, StoredValue::I64(value));
+    }
+
+    fn record_u64(&mut self, field: &Field, value: u64) {
+        self.insert(field, StoredValue::U64(value));
+    }
+
+    fn record_bool(&mut self, field: &Field, value: bool) {
+        self.insert(field, StoredValue::Bool(value));
+    }
+
+    fn record_str(&mut self, field: &Field, value: &str) {
+        self.insert_str(field, |strings| strings.push_str(value));
+    }
+
+    fn record_error(&mut self, field: &Field, value: &(dyn std::error::Error + 'static)) {
+        self.insert_str(field, |strings| {
+            _ = write!(strings, "{value}");
+        });
+    }
+
+    fn record_debug(&mut self, field: &Field, value: &dyn std::fmt::Debug) {
+        self.insert_str(field, |strings| {
+            _ = write!(strings, "{value:?}");
+        });
+    }
+}
+
+/// Fields of a new span. They are recorded by the first layer that calls this in `on_new_span`,
+/// the other layers get the stored ones.
+pub fn span_fields<S>(
+    attrs: &span::Attributes<'_>,
+    id: &span::Id,
+    ctx: tracing_subscriber::layer::Context<'_, S>,
+) -> RecordedFields
+where
+    S: tracing::Subscriber,
+    for<'lookup> S: LookupSpan<'lookup>,
+{
+    let Some(span) = ctx.span(id) else {
+        err_msg!("failed to get span");
+        return RecordedFields::default();
+    };
+
+    let mut extensions = span.extensions_mut();
+    if let Some(fields) = extensions.get_mut::<RecordedFields>() {
+        return fields.clone();
+    }
+    let mut fields = RecordedFields::default();
+    fields.record(attrs);
+    extensions.insert(fields.clone());
+    fields
+}
+
+/// Record the new values of a span and return the updated fields. The values may be recorded by
+/// every layer that calls this from `on_record`, each call replaces them with the same values.
+pub fn record_span_fields<S>(
+    values: &span::Record<'_>,
+    id: &span::Id,
+    ctx: tracing_subscriber::layer::Context<'_, S>,
+) -> RecordedFields
+where
+    S: tracing::Subscriber,
+    for<'lookup> S: LookupSpan<'lookup>,
+{
+    let Some(span) = ctx.span(id) else {
+        err_msg!("failed to get span");
+        return RecordedFields::default();
+    };
+
+    let mut extensions = span.extensions_mut();
+    if extensions.get_mut::<RecordedFields>().is_none() {
+        extensions.insert(RecordedFields::default());
+    }
+    let fields = extensions
+        .get_mut::<RecordedFields>()
+        .expect("the fields were just inserted");
+    fields.record(values);
+    fields.clone()
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use tracing_subscriber::{layer::SubscriberExt, Registry};
+
+    use super::*;
+
+    /// Collects the fields seen by the layer when the span is created and recorded.
+    struct FieldsLayer(Arc<Mutex<Vec<String>>>);
+
+    impl<S> tracing_subscriber::Layer<S> for FieldsLayer
+    where
+        S: tracing::Subscriber,
+        for<'lookup> S: LookupSpan<'lookup>,
+    {
+        fn on_new_span(
+            &self,
+            attrs: &span::Attributes<'_>,
+            id: &span::Id,
+            ctx: tracing_subscriber::layer::Context<'_, S>,
+        ) {
+            let fields = span_fields(attrs, id, ctx);
+            self.0.lock().unwrap().push(format!("{fields:?}"));
+        }
+
+        fn on_record(
+            &self,
+            id: &span::Id,
+            values: &span::Record<'_>,
+            ctx: tracing_subscriber::layer::Context<'_, S>,
+        ) {
+            let fields = record_span_fields(values, id, ctx);
+            self.0.lock().unwrap().push(format!("{fields:?}"));
+        }
+    }
+
+    #[test]
+    fn test_shared_fields() {
+        let seen = Arc::new(Mutex::new(Vec::new()));
+        let subscriber = Registry::default()
+            .with(FieldsLayer(seen.clone()))
+            .with(FieldsLayer(seen.clone()));
+
+        tracing::subscriber::with_default(subscriber, || {
+            let span = tracing::info_span!(
+                "span",
+                count = 3u64,
+                delta = -1i64,
+                name = "first",
+                path = ?std::path::Path::new("a/b"),
+                done = tracing::field::Empty,
+            );
+            span.record("name", "second");
+            span.record("done", true);
+        });
+
+        let created = r#"{"count": "3", "delta": "-1", "name": "first", "path": "\"a/b\""}"#;
+        let renamed = r#"{"count": "3", "delta": "-1", "name": "second", "path": "\"a/b\""}"#;
+        let done =
+            r#"{"count": "3", "delta": "-1", "name": "second", "path": "\"a/b\"", "done": "true"}"#;
+        assert_eq!(
+            *seen.lock().unwrap(),
+            vec![created, created, renamed, renamed, done, done]
+        );
+    }
+
+    /// Records the fields without keeping them and takes them when the span closes.
+    struct ClosingLayer(Arc<Mutex<RecordedFields>>);
+
+    impl<S> tracing_subscriber::Layer<S> for ClosingLayer
+    where
+        S: tracing::Subscriber,
+        for<'lookup> S: LookupSpan<'lookup>,
+    {
+        fn on_new_span(
+            &self,
+            attrs: &span::Attributes<'_>,
+            id: &span::Id,
+            ctx: tracing_subscriber::layer::Context<'_, S>,
+        ) {
+            span_fields(attrs, id, ctx);
+        }
+
+        fn on_record(
+            &self,
+            id: &span::Id,
+            values: &span::Record<'_>,
+            ctx: tracing_subscriber::layer::Context<'_, S>,
+        ) {
+            record_span_fields(values, id, ctx);
+        }
+
+        fn on_close(&self, id: span::Id, ctx: tracing_subscriber::layer::Context<'_, S>) {
+            let span = ctx.span(&id).unwrap();
+            let fields = span.extensions().get::<RecordedFields>().unwrap().clone();
+            *self.0.lock().unwrap() = fields;
+        }
+    }
+
+    #[test]
+    fn test_recorded_again() {
+        let closed = Arc::new(Mutex::new(RecordedFields::default()));
+        let subscriber = Registry::default()
+            .with(ClosingLayer(closed.clone()))
+            .with(ClosingLayer(closed.clone()));
+
+        tracing::subscriber::with_default(subscriber, || {
+            let span = tracing::info_span!(
+                "span",
+                first = "a",
+                second = tracing::field::Empty,
+                third = "c",
+            );
+            for i in 0..100 {
+                span.record("second", format!("value {i}"));
+                span.record("first", i);
+            }
+        });
+
+        // the replaced values don't take any space
+        let fields = closed.lock().unwrap().clone();
+        assert_eq!(fields.0.as_ref().unwrap().strings, "cvalue 99");
+        assert_eq!(
+            format!("{fields:?}"),
+            r#"{"first": "99", "third": "c", "second": "value 99"}"#
+        );
+    }
+}
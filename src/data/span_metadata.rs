@@ -1,29 +1,356 @@
 // Copyright 2024-2025 Irreducible Inc.
 
+#[cfg(feature = "perfetto")]
+use std::thread::{self, ThreadId};
+
+/// Perfetto events of a span. Every entry of the span is a slice. The first one is on the
+/// track of the thread, or on the custom track of the span, and carries the span fields.
+/// The entries on the thread of the first one stay on its track. Spans entered from another
+/// thread, e.g. instrumented futures polled by several worker threads, get a named async track
+/// for the slices of that entry and of all the later ones.
 #[cfg(feature = "perfetto")]
 pub struct PerfettoMetadata {
-    event_data: Option<perfetto_sys::EventData>,
-    trace_guard: Option<perfetto_sys::TraceEvent>,
+    name: &'static str,
+    slice: PerfettoSlice,
+    /// Custom track of the span or its async track, used by the entries after the first one.
+    track: Option<SpanTrack>,
+    /// Thread of the first entry, set after it.
+    first_thread: Option<ThreadId>,
+    /// Thread of the current slice and the number of its nested entries of the span.
+    /// Concurrent entries from other threads don't emit slices.
+    current: Option<(ThreadId, usize)>,
+}
+
+#[cfg(feature = "perfetto")]
+enum SpanTrack {
+    Custom(u64),
+    Async(perfetto_sys::AsyncTrack),
+}
+
+/// How the slices held until their exit are emitted, with their original timestamps.
+#[cfg(feature = "perfetto")]
+#[derive(Debug, Clone, Copy)]
+pub enum DelayedEmit {
+    Inline,
+    /// Through the batch of the thread.
+    Batched,
+    /// Recorded into the ring of the thread and emitted by the drain thread.
+    Deferred,
+    /// Passed to the function instead of perfetto.
+    #[cfg(test)]
+    Test(fn(perfetto_sys::EventData, u64, u64)),
+}
+
+#[cfg(feature = "perfetto")]
+impl DelayedEmit {
+    fn emit(self, event_data: perfetto_sys::EventData, begin: u64, end: u64) {
+        match self {
+            Self::Inline => perfetto_sys::TraceEvent::new_at(event_data, begin).end_at(end),
+            Self::Batched => perfetto_sys::create_batched_slice(event_data, begin, end),
+            Self::Deferred => perfetto_sys::record_deferred_slice(event_data, begin, end),
+            #[cfg(test)]
+            Self::Test(emit) => emit(event_data, begin, end),
+        }
+    }
+}
+
+#[cfg(feature = "perfetto")]
+enum PerfettoSlice {
+    /// The events are emitted on enter and exit.
+    Inline {
+        event_data: Option<perfetto_sys::EventData>,
+        trace_guard: Option<perfetto_sys::TraceEvent>,
+    },
+    /// The events are gathered per thread and emitted on exit.
+    Batched(perfetto_sys::BatchedSpan),
+    /// The events are recorded on enter and exit and emitted later by the drain thread.
+    Deferred(perfetto_sys::DeferredSpan),
+    /// The begin is held until exit, both events are emitted with their timestamps on exit
+    /// if the slice lasted at least `min_duration_ns`.
+    Delayed {
+        event_data: Option<perfetto_sys::EventData>,
+        begin: u64,
+        min_duration_ns: u64,
+        emit: DelayedEmit,
+    },
+}
+
+#[cfg(feature = "perfetto")]
+impl PerfettoSlice {
+    /// Slice of the same kind for `event_data`.
+    fn with_event_data(&self, event_data: perfetto_sys::EventData) -> Self {
+        match self {
+            Self::Inline { .. } => Self::Inline {
+                event_data: Some(event_data),
+                trace_guard: None,
+            },
+            Self::Batched(_) => Self::Batched(perfetto_sys::BatchedSpan::new(event_data)),
+            Self::Deferred(_) => Self::Deferred(perfetto_sys::DeferredSpan::new(event_data)),
+            Self::Delayed {
+                min_duration_ns,
+                emit,
+                ..
+            } => Self::Delayed {
+                event_data: Some(event_data),
+                begin: 0,
+                min_duration_ns: *min_duration_ns,
+                emit: *emit,
+            },
+        }
+    }
+
+    fn start(&mut self) {
+        match self {
+            Self::Inline {
+                event_data,
+                trace_guard,
+            } => {
+                *trace_guard = Some(perfetto_sys::TraceEvent::new(
+                    event_data
+                        .take()
+                        .expect("start cannot be called more than once"),
+                ));
+            }
+            Self::Batched(span) => span.enter(),
+            Self::Deferred(span) => span.enter(),
+            Self::Delayed { begin, .. } => *begin = perfetto_sys::trace_time_ns(),
+        }
+    }
+
+    fn end(&mut self) {
+        match self {
+            Self::Inline { trace_guard, .. } => *trace_guard = None,
+            Self::Batched(span) => span.exit(),
+            Self::Deferred(span) => span.exit(),
+            Self::Delayed {
+                event_data,
+                begin,
+                min_duration_ns,
+                emit,
+            } => {
+                let event_data = event_data
+                    .take()
+                    .expect("end cannot be called more than once");
+                let end = perfetto_sys::trace_time_ns();
+                if end.saturating_sub(*begin) >= *min_duration_ns {
+                    emit.emit(event_data, *begin, end);
+                }
+            }
+        }
+    }
 }
 
 #[cfg(feature = "perfetto")]
 impl PerfettoMetadata {
-    pub fn new(event_data: perfetto_sys::EventData) -> Self {
+    pub fn new(name: &'static str, event_data: perfetto_sys::EventData) -> Self {
+        let track_id = event_data.track_id();
+        Self::with_track_id(
+            name,
+            track_id,
+            PerfettoSlice::Inline {
+                event_data: Some(event_data),
+                trace_guard: None,
+            },
+        )
+    }
+
+    pub fn new_batched(name: &'static str, event_data: perfetto_sys::EventData) -> Self {
+        let track_id = event_data.track_id();
+        Self::with_track_id(
+            name,
+            track_id,
+            PerfettoSlice::Batched(perfetto_sys::BatchedSpan::new(event_data)),
+        )
+    }
+
+    pub fn new_deferred(name: &'static str, event_data: perfetto_sys::EventData) -> Self {
+        let track_id = event_data.track_id();
+        Self::with_track_id(
+            name,
+            track_id,
+            PerfettoSlice::Deferred(perfetto_sys::DeferredSpan::new(event_data)),
+        )
+    }
+
+    /// The slice is emitted on exit by `emit`, and only if it lasted at least `min_duration_ns`.
+    pub fn new_delayed(
+        name: &'static str,
+        event_data: perfetto_sys::EventData,
+        min_duration_ns: u64,
+        emit: DelayedEmit,
+    ) -> Self {
+        let track_id = event_data.track_id();
+        Self::with_track_id(
+            name,
+            track_id,
+            PerfettoSlice::Delayed {
+                event_data: Some(event_data),
+                begin: 0,
+                min_duration_ns,
+                emit,
+            },
+        )
+    }
+
+    fn with_track_id(name: &'static str, track_id: Option<u64>, slice: PerfettoSlice) -> Self {
         Self {
-            event_data: Some(event_data),
-            trace_guard: None,
+            name,
+            slice,
+            track: track_id.map(SpanTrack::Custom),
+            first_thread: None,
+            current: None,
         }
     }
 
     pub fn start(&mut self) {
-        self.trace_guard = Some(perfetto_sys::TraceEvent::new(
-            self.event_data
-                .take()
-                .expect("start cannot be called more than once"),
-        ));
+        let thread_id = thread::current().id();
+        if let Some((current_thread, depth)) = &mut self.current {
+            if *current_thread == thread_id {
+                *depth += 1;
+            }
+            return;
+        }
+
+        if let Some(first_thread) = self.first_thread {
+            // the fields are written with the first slice only
+            let mut event_data = perfetto_sys::EventData::new_interned(self.name);
+            if let Some(track_id) = self.reentry_track_id(first_thread == thread_id) {
+                event_data.set_track_id(track_id);
+            }
+            self.slice = self.slice.with_event_data(event_data);
+        }
+
+        self.slice.start();
+        self.first_thread.get_or_insert(thread_id);
+        self.current = Some((thread_id, 1));
+    }
+
+    /// Track of the slices after the first one, `None` for the thread track. The entries on the
+    /// first thread stay on its track until the span has been entered from another thread.
+    fn reentry_track_id(&mut self, on_first_thread: bool) -> Option<u64> {
+        // the deferred events may be replayed after the span is closed and its async track
+        // is gone, they stay on the thread tracks
+        let deferred = matches!(
+            self.slice,
+            PerfettoSlice::Deferred(_)
+                | PerfettoSlice::Delayed {
+                    emit: DelayedEmit::Deferred,
+                    ..
+                }
+        );
+        if self.track.is_none() && (deferred || on_first_thread) {
+            return None;
+        }
+
+        let track = self
+            .track
+            .get_or_insert_with(|| SpanTrack::Async(perfetto_sys::AsyncTrack::new(self.name)));
+        match track {
+            SpanTrack::Custom(track_id) => Some(*track_id),
+            SpanTrack::Async(track) => Some(track.id()),
+        }
     }
 
     pub fn end(&mut self) {
-        self.trace_guard = None;
+        let Some((current_thread, depth)) = &mut self.current else {
+            return;
+        };
+        if *current_thread != thread::current().id() {
+            return;
+        }
+
+        *depth -= 1;
+        if *depth == 0 {
+            self.slice.end();
+            self.current = None;
+        }
+    }
+}
+
+#[cfg(all(test, feature = "perfetto"))]
+mod tests {
+    use std::{cell::RefCell, time::Duration};
+
+    use perfetto_sys::trace_time_ns;
+
+    use super::*;
+
+    const MIN_DURATION_NS: u64 = 10_000_000;
+
+    thread_local! {
+        /// Begin and end of the emitted slices.
+        static EMITTED: RefCell<Vec<(u64, u64)>> = const { RefCell::new(Vec::new()) };
+    }
+
+    fn record_slice(_: perfetto_sys::EventData, begin: u64, end: u64) {
+        EMITTED.with_borrow_mut(|emitted| emitted.push((begin, end)));
+    }
+
+    fn delayed_span(name: &'static str) -> PerfettoMetadata {
+        PerfettoMetadata::new_delayed(
+            name,
+            perfetto_sys::EventData::new_interned(name),
+            MIN_DURATION_NS,
+            DelayedEmit::Test(record_slice),
+        )
+    }
+
+    #[test]
+    fn test_min_span_duration() {
+        let mut parent = delayed_span("parent");
+        let mut short = delayed_span("short");
+        let mut short_child = delayed_span("short_child");
+        let mut long_child = delayed_span("long_child");
+
+        let before = trace_time_ns();
+        parent.start();
+        let parent_started = trace_time_ns();
+
+        // a short span and its children are dropped
+        short.start();
+        short_child.start();
+        short_child.end();
+        short.end();
+        assert!(EMITTED.with_borrow(Vec::is_empty));
+
+        long_child.start();
+        let child_started = trace_time_ns();
+        std::thread::sleep(Duration::from_nanos(2 * MIN_DURATION_NS));
+        let child_ending = trace_time_ns();
+        long_child.end();
+        parent.end();
+        let after = trace_time_ns();
+
+        // the long spans are emitted on exit with the times of their entry and exit
+        let emitted = EMITTED.take();
+        assert_eq!(emitted.len(), 2);
+        let (child_begin, child_end) = emitted[0];
+        let (parent_begin, parent_end) = emitted[1];
+        assert!(before <= parent_begin && parent_begin <= parent_started);
+        assert!(parent_started <= child_begin && child_begin <= child_started);
+        assert!(child_ending <= child_end && child_end <= parent_end && parent_end <= after);
+    }
+
+    #[test]
+    fn test_reentry_track() {
+        let mut span = PerfettoMetadata::new("span", perfetto_sys::EventData::new_interned("span"));
+        span.start();
+        span.end();
+
+        // the entries on the same thread stay on its track
+        span.start();
+        span.end();
+        assert!(span.track.is_none());
+
+        // an entry from another thread moves the span to an async track for good
+        std::thread::scope(|scope| {
+            scope.spawn(|| {
+                span.start();
+                span.end();
+            });
+        });
+        assert!(matches!(span.track, Some(SpanTrack::Async(_))));
+        let track_id = span.reentry_track_id(false);
+        assert_eq!(span.reentry_track_id(true), track_id);
     }
 }
@@ -6,7 +6,7 @@
 //! with various components like timestamp, git information, system details, and custom metadata.
 //! It provides flexible file naming with environment variable overrides.
 
-use std::path::PathBuf;
+use std::path::{Path, PathBuf};
 use thiserror::Error;
 
 use crate::filename_utils::{get_formatted_time, get_git_info, sanitize_filename};
@@ -39,6 +39,7 @@ pub struct TraceFilenameBuilder {
     timestamp: Option<String>,
     name: Option<String>,
     iteration: Option<usize>,
+    chunk: Option<usize>,
     git_branch: Option<String>,
     git_commit: Option<String>,
     git_dirty: bool,
@@ -165,6 +166,14 @@ impl TraceFilenameBuilder {
         self
     }
 
+    /// Set the index of the chunk of a rotated trace, appended as `chunk0001` after all the other
+    /// components, see `perfetto_sys::RotationConfig`. Also applied to the path set by
+    /// `PERFETTO_TRACE_FILE_PATH`.
+    pub fn chunk(mut self, chunk: usize) -> Self {
+        self.chunk = Some(chunk);
+        self
+    }
+
     /// Add a variant description (e.g., "optimized", "baseline", "multi-threaded").
     pub fn variant(mut self, variant: impl Into<String>) -> Self {
         self.custom_fields
@@ -314,10 +323,44 @@ impl TraceFilenameBuilder {
         self.build_impl()
     }
 
+    /// Identification of the run written into the run metadata of the trace, e.g. to tell the
+    /// traces of the processes of a distributed run apart. Respects the same environment
+    /// variable overrides as `build()`.
+    pub(crate) fn run_metadata(&self) -> Vec<(&'static str, String)> {
+        let mut metadata = Vec::new();
+        if let Some(run_id) = &self.run_id {
+            metadata.push(("run_id", run_id.clone()));
+        }
+        if let Some(iteration) = self.final_iteration() {
+            metadata.push(("iteration", iteration.to_string()));
+        }
+        if let Some(machine_name) = self.final_machine_name() {
+            metadata.push(("machine_name", machine_name));
+        }
+        metadata
+    }
+
+    fn final_iteration(&self) -> Option<usize> {
+        std::env::var("PERFETTO_TRACE_ITERATION")
+            .ok()
+            .and_then(|s| s.parse().ok())
+            .or(self.iteration)
+    }
+
+    fn final_machine_name(&self) -> Option<String> {
+        std::env::var("PERFETTO_MACHINE_NAME")
+            .ok()
+            .or(self.machine_name.clone())
+    }
+
     fn build_impl(self) -> Result<PathBuf, FilenameBuilderError> {
         // Check for complete override first
         if let Ok(path) = std::env::var("PERFETTO_TRACE_FILE_PATH") {
-            return Ok(PathBuf::from(path));
+            let path = PathBuf::from(path);
+            return Ok(match self.chunk {
+                Some(chunk) => with_chunk_index(&path, &self.separator, chunk),
+                None => path,
+            });
         }
 
         // Apply environment variable overrides
@@ -325,14 +368,8 @@ impl TraceFilenameBuilder {
             .ok()
             .or(self.name.clone());
 
-        let final_iteration = std::env::var("PERFETTO_TRACE_ITERATION")
-            .ok()
-            .and_then(|s| s.parse().ok())
-            .or(self.iteration);
-
-        let final_machine_name = std::env::var("PERFETTO_MACHINE_NAME")
-            .ok()
-            .or(self.machine_name.clone());
+        let final_iteration = self.final_iteration();
+        let final_machine_name = self.final_machine_name();
 
         // Build filename components in order
         let mut parts = Vec::new();
@@ -400,6 +437,11 @@ impl TraceFilenameBuilder {
             parts.push(hostname.clone());
         }
 
+        // Add the chunk last, so that the chunks of a trace are listed in order
+        if let Some(chunk) = self.chunk {
+            parts.push(chunk_part(chunk));
+        }
+
         // Build filename
         let filename = if parts.is_empty() {
             "trace.perfetto-trace".to_string()
@@ -436,6 +478,26 @@ impl TraceFilenameBuilder {
     }
 }
 
+fn chunk_part(chunk: usize) -> String {
+    format!("chunk{chunk:04}")
+}
+
+/// `path` with the chunk index inserted before the extension.
+pub(crate) fn with_chunk_index(path: &Path, separator: &str, chunk: usize) -> PathBuf {
+    let file_name = path
+        .file_name()
+        .map(|name| name.to_string_lossy().into_owned())
+        .unwrap_or_default();
+    let chunk = chunk_part(chunk);
+    let file_name = match file_name.rsplit_once('.') {
+        Some((stem, extension)) if !stem.is_empty() => {
+            format!("{stem}{separator}{chunk}.{extension}")
+        }
+        _ => format!("{file_name}{separator}{chunk}"),
+    };
+    path.with_file_name(file_name)
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
@@ -490,6 +552,30 @@ mod tests {
 
             assert_eq!(path, PathBuf::from(test_path));
         }
+
+        #[test]
+        fn test_chunk_with_environment_override() {
+            env::set_var("PERFETTO_TRACE_FILE_PATH", "/tmp/custom_trace.perfetto-trace");
+
+            let path = TraceFilenameBuilder::new().chunk(3).build().unwrap();
+            assert_eq!(
+                path,
+                PathBuf::from("/tmp/custom_trace.chunk0003.perfetto-trace")
+            );
+        }
+    }
+
+    #[test]
+    fn test_chunk() {
+        let path = TraceFilenameBuilder::new()
+            .name("service")
+            .iteration(2)
+            .chunk(12)
+            .build()
+            .unwrap();
+
+        let filename = path.file_name().unwrap().to_string_lossy();
+        assert_eq!(filename, "service.iter2.chunk0012.perfetto-trace");
     }
 
     #[test]
@@ -681,6 +767,25 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_run_metadata() {
+        let metadata = TraceFilenameBuilder::new()
+            .run_id("exp001")
+            .iteration(3)
+            .machine_name("node0")
+            .run_metadata();
+        assert_eq!(
+            metadata,
+            vec![
+                ("run_id", "exp001".to_string()),
+                ("iteration", "3".to_string()),
+                ("machine_name", "node0".to_string()),
+            ]
+        );
+
+        assert!(TraceFilenameBuilder::new().run_metadata().is_empty());
+    }
+
     #[test]
     fn test_comprehensive_extended_example() {
         // Test all the new extended features together
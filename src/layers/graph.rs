@@ -1,18 +1,25 @@
 // Copyright 2024-2025 Irreducible Inc.
 use std::{
     collections::HashMap,
-    sync::{Arc, Mutex},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex, MutexGuard,
+    },
     thread::ThreadId,
     time::Instant,
 };
 
 use crate::{
-    data::{EventCounts, LogTree, StoringFieldVisitor},
+    data::{
+        insert_to_span_storage, record_span_fields, span_fields, with_span_storage_mut,
+        EventCounts, LogTree, PerThread, RecordedFields,
+    },
     env_utils::{get_bool_env_var, get_env_var},
     errors::err_msg,
+    utils::thread_cpu_time,
 };
-use linear_map::LinearMap;
-use tracing::span;
+use tracing::{callsite, span};
 
 /// Tree layer config.
 #[derive(Debug, Clone)]
@@ -46,6 +53,24 @@ pub struct Config {
     /// Corresponds to the `TREE_LAYER_ACCUMULATE_SPANS_COUNT` environment variable.
     pub accumulate_spans_count: bool,
 
+    /// Whether to display the CPU time of the thread next to the wall time of each span.
+    /// A span with a CPU time much lower than its wall time was blocked or descheduled.
+    /// Corresponds to the `TREE_LAYER_DISPLAY_CPU_TIME` environment variable.
+    pub display_cpu_time: bool,
+
+    /// Whether to merge the repeated calls of a span into a single node as they complete, keyed
+    /// by the path of span callsites from the root. The node keeps the number of calls, the total,
+    /// minimum and maximum duration, so the memory is bounded by the number of distinct paths.
+    /// The root spans of all threads are merged as well and printed when the guard is dropped.
+    /// Corresponds to the `TREE_LAYER_AGGREGATE_CALLS` environment variable.
+    pub aggregate_calls: bool,
+
+    /// File to write the aggregated calls to in the folded stacks format, one
+    /// `root;child;grandchild self_time_ns` line per path, which flame graph tools read.
+    /// Has effect only if `aggregate_calls` is enabled.
+    /// Corresponds to the `TREE_LAYER_FOLDED_STACKS_FILE` environment variable.
+    pub folded_stacks_file: Option<PathBuf>,
+
     /// Whether to disable color output.
     /// Corresponds to the `NO_COLOR` environment variable.
     pub no_color: bool,
@@ -60,6 +85,10 @@ impl Config {
             display_unaccounted: get_env_var("TREE_LAYER_DISPLAY_", false),
             accumulate_events: get_bool_env_var("TREE_LAYER_ACCUMULATE_EVENTS", true),
             accumulate_spans_count: get_bool_env_var("TREE_LAYER_ACCUMULATE_SPANS_COUNT", false),
+            display_cpu_time: get_bool_env_var("TREE_LAYER_DISPLAY_CPU_TIME", false),
+            aggregate_calls: get_bool_env_var("TREE_LAYER_AGGREGATE_CALLS", false),
+            folded_stacks_file: std::env::var_os("TREE_LAYER_FOLDED_STACKS_FILE")
+                .map(PathBuf::from),
             no_color: get_bool_env_var("NO_COLOR", false),
         }
     }
@@ -73,8 +102,6 @@ impl Default for Config {
 
 #[derive(Default)]
 struct State {
-    current_span: Option<span::Id>,
-    unfinished_spans: LinearMap<u64, GraphNode>,
     zero_level_events: EventCounts,
 }
 
@@ -88,23 +115,115 @@ impl State {
     }
 }
 
+/// Completed root spans of a thread, merged by callsite as they complete so that the memory
+/// doesn't grow with the number of calls.
+#[derive(Default)]
+struct ThreadRoots {
+    /// Root spans of a thread other than the main thread, printed together.
+    other_threads: GraphNode,
+    /// Root spans with `Config::aggregate_calls`.
+    aggregated: GraphNode,
+}
+
+/// State shared by the threads. Only the events outside of any span and the completed root
+/// spans need it, the spans keep their nodes in the span storage.
+#[derive(Default)]
+struct Shared {
+    state: Mutex<State>,
+    /// Whether `State::zero_level_events` is not empty, checked without taking the lock.
+    has_zero_level_events: AtomicBool,
+    /// The root spans are kept per thread, so the threads don't contend for them.
+    roots: PerThread<ThreadRoots>,
+}
+
+impl Shared {
+    /// Print the root spans of the other threads under a single node.
+    fn print_thread_roots(&self, config: &Config) {
+        let mut node = GraphNode::new("[other threads]");
+        self.roots
+            .for_each(|roots| node.merge(std::mem::take(&mut roots.other_threads)));
+        if node.child_nodes.is_empty() {
+            return;
+        }
+
+        // the roots with the same name are next to each other, so the repeated ones are
+        // aggregated
+        node.child_nodes.sort_by_key(|root| root.name);
+        node.child_index.clear();
+        for root in &node.child_nodes {
+            node.execution_duration += root.execution_duration;
+            node.cpu_duration += root.cpu_duration;
+        }
+        node.print(config);
+    }
+
+    /// Print the aggregated calls and write them to `Config::folded_stacks_file`.
+    fn print_aggregated_roots(&self, config: &Config) {
+        let mut node = GraphNode::new("[all threads]");
+        self.roots
+            .for_each(|roots| node.merge(roots.aggregated.clone()));
+        if node.child_nodes.is_empty() {
+            return;
+        }
+
+        for root in &node.child_nodes {
+            node.execution_duration += root.execution_duration;
+            node.cpu_duration += root.cpu_duration;
+        }
+
+        if let Some(path) = &config.folded_stacks_file {
+            if let Err(error) = node.write_folded_stacks(path) {
+                err_msg!("failed to write {}: {error}", path.display());
+            }
+        }
+        node.print(config);
+    }
+}
+
 pub struct Guard {
-    state: Arc<Mutex<State>>,
+    shared: Arc<Shared>,
+    config: Config,
+}
+
+impl Guard {
+    /// Print the call trees of the root spans of the threads other than the main thread that
+    /// have completed so far. The remaining ones are printed when the guard is dropped.
+    pub fn print_thread_roots(&self) {
+        self.shared.print_thread_roots(&self.config);
+    }
+
+    /// Print the calls aggregated so far with `Config::aggregate_calls` and write them to
+    /// `Config::folded_stacks_file`, keeping them for the next print. They are printed when
+    /// the guard is dropped as well.
+    pub fn print_aggregated(&self) {
+        self.shared.print_aggregated_roots(&self.config);
+    }
 }
 
 impl Drop for Guard {
     fn drop(&mut self) {
-        let Ok(mut state) = self.state.lock() else {
+        self.shared.print_thread_roots(&self.config);
+        self.shared.print_aggregated_roots(&self.config);
+
+        let Ok(mut state) = self.shared.state.lock() else {
             return err_msg!("failed to get mutex");
         };
-
         state.print_zero_level_events();
     }
 }
 
 /// GraphLayer (internally called layer::graph)
 /// This Layer prints a call graph to stdout. Please note that this layer both prints data about spans and events.
-/// Spans from the threads other than the main thread are not printed. Events from the main thread are attached to the latest main thread span.
+/// The spans of all threads are recorded. A span whose parent was entered on another thread, e.g. a span created
+/// with an explicit parent in a rayon task, is a child of its parent like any other span. The root spans of the main
+/// thread are printed when they are exited, the root spans of the other threads are merged by callsite per thread as
+/// they complete and printed together under `[other threads]` when the guard is dropped, or with
+/// `Guard::print_thread_roots`.
+/// A span entered several times, possibly from several threads at once, stays a single node until it is exited by all
+/// of them, its duration is the sum of the durations of its entries.
+/// Events are attached to their parent span or the current span of their thread.
+/// With `Config::aggregate_calls` the calls are merged by callsite path as they complete and printed together when the guard
+/// is dropped, optionally also as folded stacks for flame graph tools.
 /// Depending on the `Config::accumulate_events` setting, the layer will either print the events of each span or accumulate the events of the children into the parent.
 ///
 /// example output:
@@ -133,19 +252,19 @@ impl Drop for Guard {
 /// ```
 pub struct Layer {
     main_thread: ThreadId,
-    state: Arc<Mutex<State>>,
+    shared: Arc<Shared>,
     config: Config,
 }
 
 impl Layer {
     pub fn new(config: Config) -> (Self, Guard) {
-        let state = Arc::new(Mutex::new(State::default()));
+        let shared = Arc::new(Shared::default());
         let layer = Self {
             main_thread: std::thread::current().id(),
-            state: state.clone(),
+            shared: shared.clone(),
             config: config.clone(),
         };
-        let guard = Guard { state };
+        let guard = Guard { shared, config };
 
         (layer, guard)
     }
@@ -153,6 +272,82 @@ impl Layer {
     fn is_main_thread(&self) -> bool {
         self.main_thread == std::thread::current().id()
     }
+
+    fn lock_state(&self) -> Option<MutexGuard<'_, State>> {
+        match self.shared.state.lock() {
+            Ok(state) => Some(state),
+            Err(_) => {
+                err_msg!("failed to get mutex");
+                None
+            }
+        }
+    }
+}
+
+/// Node of a span that has not completed yet, kept in the span storage.
+struct SpanNode {
+    node: GraphNode,
+    /// Threads that are inside the span.
+    entries: Vec<SpanEntry>,
+}
+
+struct SpanEntry {
+    thread: ThreadId,
+    /// Number of the nested entries of the thread.
+    depth: usize,
+    started: Instant,
+    /// CPU time of the thread when the span was entered, if `Config::display_cpu_time` is set.
+    started_cpu_time: Option<std::time::Duration>,
+}
+
+impl SpanNode {
+    fn enter(&mut self, measure_cpu_time: bool) {
+        let thread = std::thread::current().id();
+        if let Some(entry) = self.entries.iter_mut().find(|entry| entry.thread == thread) {
+            entry.depth += 1;
+            return;
+        }
+
+        self.entries.push(SpanEntry {
+            thread,
+            depth: 1,
+            started: Instant::now(),
+            started_cpu_time: measure_cpu_time.then(thread_cpu_time).flatten(),
+        });
+    }
+
+    /// Returns the completed node once no thread is inside the span. The node of the later
+    /// entries of the span, if any, starts over.
+    fn exit(&mut self) -> Option<GraphNode> {
+        let thread = std::thread::current().id();
+        let index = self
+            .entries
+            .iter()
+            .position(|entry| entry.thread == thread)?;
+        let entry = &mut self.entries[index];
+        entry.depth -= 1;
+        if entry.depth > 0 {
+            return None;
+        }
+
+        let entry = self.entries.swap_remove(index);
+        self.node.execution_duration += entry.started.elapsed();
+        if let (Some(started), Some(now)) = (entry.started_cpu_time, thread_cpu_time()) {
+            self.node.cpu_duration += now.saturating_sub(started);
+        }
+        if !self.entries.is_empty() {
+            return None;
+        }
+        self.node.min_duration = self.node.execution_duration;
+        self.node.max_duration = self.node.execution_duration;
+
+        let next = GraphNode {
+            call_count: 1,
+            callsite: self.node.callsite.clone(),
+            ..GraphNode::new(self.node.name)
+        };
+        Some(std::mem::replace(&mut self.node, next))
+    }
 }
 
 impl<S> tracing_subscriber::Layer<S> for Layer
@@ -165,103 +360,90 @@ where
         &self,
         attrs: &span::Attributes<'_>,
         id: &span::Id,
-        _ctx: tracing_subscriber::layer::Context<'_, S>,
+        ctx: tracing_subscriber::layer::Context<'_, S>,
     ) {
-        if !self.is_main_thread() {
-            return;
-        }
-
-        let mut graph_node = GraphNode {
+        let graph_node = GraphNode {
             call_count: 1,
-            ..Default::default()
+            callsite: Some(attrs.metadata().callsite()),
+            ..GraphNode::new(attrs.metadata().name())
         };
-        let mut visitor = StoringFieldVisitor(&mut graph_node.metadata);
-        attrs.record(&mut visitor);
-
-        let Ok(mut state) = self.state.lock() else {
-            return err_msg!("failed to get mutex");
-        };
-
-        state.unfinished_spans.insert(id.into_u64(), graph_node);
+        // the fields are taken when the span completes, a copy kept here would be copied on
+        // every record
+        span_fields(attrs, id, ctx.clone());
+
+        insert_to_span_storage(
+            id,
+            ctx,
+            SpanNode {
+                node: graph_node,
+                entries: Vec::new(),
+            },
+        );
     }
 
     fn on_record(
         &self,
         id: &span::Id,
         values: &span::Record<'_>,
-        _ctx: tracing_subscriber::layer::Context<'_, S>,
+        ctx: tracing_subscriber::layer::Context<'_, S>,
     ) {
-        if !self.is_main_thread() {
-            return;
-        }
-
-        let Ok(mut state) = self.state.lock() else {
-            return err_msg!("failed to get mutex");
-        };
-
-        if let Some(graph_node) = state.unfinished_spans.get_mut(&id.into_u64()) {
-            let mut visitor = StoringFieldVisitor(&mut graph_node.metadata);
-            values.record(&mut visitor);
-        }
+        record_span_fields(values, id, ctx);
     }
 
-    fn on_enter(&self, id: &span::Id, _ctx: tracing_subscriber::layer::Context<'_, S>) {
-        if !self.is_main_thread() {
-            return;
-        }
-
-        let Ok(mut state) = self.state.lock() else {
-            return err_msg!("failed to get mutex");
-        };
-
-        state.current_span = Some(id.clone());
-        if let Some(graph_node) = state.unfinished_spans.get_mut(&id.into_u64()) {
-            graph_node.started = Some(Instant::now());
+    fn on_enter(&self, id: &span::Id, ctx: tracing_subscriber::layer::Context<'_, S>) {
+        with_span_storage_mut::<SpanNode, _>(id, ctx, |span| {
+            span.enter(self.config.display_cpu_time)
+        });
+
+        if self.is_main_thread() && self.shared.has_zero_level_events.load(Ordering::Relaxed) {
+            if let Some(mut state) = self.lock_state() {
+                self.shared
+                    .has_zero_level_events
+                    .store(false, Ordering::Relaxed);
+                state.print_zero_level_events();
+            }
         }
-
-        state.print_zero_level_events();
     }
 
     fn on_exit(&self, id: &span::Id, ctx: tracing_subscriber::layer::Context<'_, S>) {
-        if !self.is_main_thread() {
-            return;
-        }
-
         let Some(span) = ctx.span(id) else {
             return err_msg!("failed to get span on_exit");
         };
 
-        let Ok(mut state) = self.state.lock() else {
-            return err_msg!("failed to get mutex");
+        let Some(mut node) = span
+            .extensions_mut()
+            .get_mut::<SpanNode>()
+            .and_then(SpanNode::exit)
+        else {
+            return;
         };
+        if let Some(fields) = span.extensions().get::<RecordedFields>() {
+            node.metadata = fields.clone();
+        }
 
-        let mut node = state
-            .unfinished_spans
-            .remove(&id.into_u64())
-            .unwrap_or_default();
-        node.execution_duration = node
-            .started
-            .map(|started| Instant::elapsed(&started))
-            .unwrap_or_default();
-        node.name = span.name();
-
-        let parent = match span.parent() {
-            Some(p) => {
-                let Some(parent_node) = state.unfinished_spans.get_mut(&p.id().into_u64()) else {
+        match span.parent() {
+            Some(parent) => {
+                let mut extensions = parent.extensions_mut();
+                let Some(parent_node) = extensions.get_mut::<SpanNode>() else {
                     return err_msg!("failed to get parent node");
                 };
 
-                parent_node.child_nodes.push(node);
-                Some(p.id().clone())
+                parent_node
+                    .node
+                    .add_child(node, self.config.aggregate_calls);
+            }
+            None if self.config.aggregate_calls => {
+                self.shared
+                    .roots
+                    .with(|roots| roots.aggregated.add_child(node, true));
             }
+            None if self.is_main_thread() => node.print(&self.config),
             None => {
-                node.print(&self.config);
-
-                None
+                self.shared
+                    .roots
+                    .with(|roots| roots.other_threads.add_child(node, true));
             }
-        };
-
-        state.current_span = parent;
+        }
     }
 
     fn on_event(&self, event: &tracing::Event<'_>, ctx: tracing_subscriber::layer::Context<'_, S>) {
@@ -269,28 +451,23 @@ where
             return;
         }
 
-        let Ok(mut state) = self.state.lock() else {
-            return err_msg!("failed to get mutex");
-        };
-
-        let span_id = if self.is_main_thread() {
-            event
-                .parent()
-                .cloned()
-                .or_else(|| ctx.current_span().id().cloned())
-        } else {
-            // try to attach the event to the latest main thread span
-            state.current_span.clone()
-        };
-
-        match span_id {
-            Some(span_id) => {
-                if let Some(graph_node) = state.unfinished_spans.get_mut(&span_id.into_u64()) {
-                    graph_node.events.record(event);
+        let span = event
+            .parent()
+            .and_then(|id| ctx.span(id))
+            .or_else(|| ctx.lookup_current());
+        match span {
+            Some(span) => {
+                if let Some(span) = span.extensions_mut().get_mut::<SpanNode>() {
+                    span.node.events.record(event);
                 }
             }
             None => {
-                state.zero_level_events.record(event);
+                if let Some(mut state) = self.lock_state() {
+                    state.zero_level_events.record(event);
+                    self.shared
+                        .has_zero_level_events
+                        .store(true, Ordering::Relaxed);
+                }
             }
         }
     }
@@ -299,11 +476,23 @@ where
 #[derive(Default, Debug, Clone)]
 struct GraphNode {
     name: &'static str,
-    started: Option<Instant>,
+    /// Callsite of the span, `None` for the nodes that are not spans.
+    callsite: Option<callsite::Identifier>,
     execution_duration: std::time::Duration,
-    metadata: LinearMap<&'static str, String>,
+    /// Shortest and longest of the calls.
+    min_duration: std::time::Duration,
+    max_duration: std::time::Duration,
+    /// CPU time of the threads spent in the span.
+    cpu_duration: std::time::Duration,
+    /// Fields of the span, shared with the other layers. Set when the span completes.
+    metadata: RecordedFields,
+    /// Position among the calls with the same name, shown for the relevant repeated calls.
+    index: Option<usize>,
     events: EventCounts,
     child_nodes: Vec<GraphNode>,
+    /// Index of the children by name and callsite, with `Config::aggregate_calls`. The spans
+    /// of different callsites with the same name are different nodes.
+    child_index: HashMap<(&'static str, Option<callsite::Identifier>), usize>,
     call_count: usize,
 }
 
@@ -315,6 +504,96 @@ impl GraphNode {
         }
     }
 
+    /// Add a completed child call. With `aggregate` it is merged into the previous calls of
+    /// the child from the same callsite, if there are any.
+    fn add_child(&mut self, child: GraphNode, aggregate: bool) {
+        if !aggregate {
+            self.child_nodes.push(child);
+            return;
+        }
+
+        let key = (child.name, child.callsite.clone());
+        match self.child_index.get(&key) {
+            Some(&index) => self.child_nodes[index].merge(child),
+            None => {
+                let mut child = child;
+                child.index_children();
+                self.child_index.insert(key, self.child_nodes.len());
+                self.child_nodes.push(child);
+            }
+        }
+    }
+
+    /// Merge the repeated children of a node added without `aggregate`, e.g. a root span of
+    /// another thread, so that it can be merged with the other calls.
+    fn index_children(&mut self) {
+        if self.child_index.len() == self.child_nodes.len() {
+            return;
+        }
+
+        self.child_index.clear();
+        for child in std::mem::take(&mut self.child_nodes) {
+            self.add_child(child, true);
+        }
+    }
+
+    /// Merge the calls of `other`, a node with the same path, and of its children.
+    fn merge(&mut self, other: GraphNode) {
+        self.min_duration = match self.call_count {
+            0 => other.min_duration,
+            _ => self.min_duration.min(other.min_duration),
+        };
+        self.max_duration = self.max_duration.max(other.max_duration);
+        self.execution_duration += other.execution_duration;
+        self.cpu_duration += other.cpu_duration;
+        self.call_count += other.call_count;
+        self.events += &other.events;
+        for child in other.child_nodes {
+            self.add_child(child, true);
+        }
+    }
+
+    /// Time of the node not spent in its children.
+    fn self_duration(&self) -> std::time::Duration {
+        let children = self
+            .child_nodes
+            .iter()
+            .map(|child| child.execution_duration)
+            .sum();
+        self.execution_duration.saturating_sub(children)
+    }
+
+    /// Write the paths of the children in the folded stacks format, this node is not part of
+    /// the paths.
+    fn write_folded_stacks(&self, path: &Path) -> std::io::Result<()> {
+        fn write_node(
+            node: &GraphNode,
+            prefix: &str,
+            out: &mut impl std::io::Write,
+        ) -> std::io::Result<()> {
+            // `;` separates the frames
+            let name = node.name.replace(';', ":");
+            let path = match prefix {
+                "" => name,
+                _ => format!("{prefix};{name}"),
+            };
+            let self_ns = node.self_duration().as_nanos();
+            if self_ns > 0 {
+                writeln!(out, "{path} {self_ns}")?;
+            }
+            for child in &node.child_nodes {
+                write_node(child, &path, out)?;
+            }
+            Ok(())
+        }
+
+        let mut out = std::io::BufWriter::new(std::fs::File::create(path)?);
+        for child in &self.child_nodes {
+            write_node(child, "", &mut out)?;
+        }
+        std::io::Write::flush(&mut out)
+    }
+
     fn execution_percentage(&self, root_time: std::time::Duration) -> f64 {
         100.0 * self.execution_duration.as_secs_f64() / root_time.as_secs_f64()
     }
@@ -349,13 +628,19 @@ impl GraphNode {
 
     fn label(&self, root_time: std::time::Duration, config: &Config) -> String {
         let mut info = vec![];
-        if self.call_count > 1 {
+        if self.call_count > 1 && config.aggregate_calls {
+            info.push(format!(
+                "({} calls, min {:.2?}, max {:.2?})",
+                self.call_count, self.min_duration, self.max_duration
+            ))
+        } else if self.call_count > 1 {
             info.push(format!("({} calls)", self.call_count))
-        } else if !self.metadata.is_empty() {
+        } else if !self.metadata.is_empty() || self.index.is_some() {
             let kv: Vec<_> = self
                 .metadata
                 .iter()
                 .map(|(k, v)| format!("{k} = {v}"))
+                .chain(self.index.map(|index| format!("index = {index}")))
                 .collect();
             info.push(format!("{{ {} }}", kv.join(", ")))
         }
@@ -363,7 +648,12 @@ impl GraphNode {
         let name = &self.name;
         let execution_time = self.execution_duration;
         let execution_time_percent = self.execution_percentage(root_time);
-        let mut result = format!("{name} [ {execution_time:.2?} | {execution_time_percent:.2}% ]");
+        let mut result = if config.display_cpu_time {
+            let cpu_time = self.cpu_duration;
+            format!("{name} [ {execution_time:.2?} | cpu {cpu_time:.2?} | {execution_time_percent:.2}% ]")
+        } else {
+            format!("{name} [ {execution_time:.2?} | {execution_time_percent:.2}% ]")
+        };
         if !info.is_empty() {
             result = format!("{result} {}", info.join(" "));
         }
@@ -398,9 +688,7 @@ impl GraphNode {
             if next.is_some_and(|next| next.name == child.name) {
                 if child.execution_percentage(root_time) > config.relevant_above_percent {
                     let mut indexed_child = child.clone();
-                    indexed_child
-                        .metadata
-                        .insert("index", format!("{name_count}"));
+                    indexed_child.index = Some(*name_count);
                     children.push(indexed_child);
                 } else {
                     aggregated_node = aggregated_node
@@ -439,6 +727,12 @@ impl GraphNode {
                     .iter()
                     .map(|x| x.execution_duration)
                     .fold(std::time::Duration::new(0, 0), |x, y| x + y);
+            unaccounted.cpu_duration = self.cpu_duration.saturating_sub(
+                self.child_nodes
+                    .iter()
+                    .map(|x| x.cpu_duration)
+                    .fold(std::time::Duration::new(0, 0), |x, y| x + y),
+            );
 
             children.insert(0, unaccounted);
         }
@@ -454,7 +748,13 @@ impl GraphNode {
     }
 
     fn aggregate(mut self, other: &GraphNode) -> Self {
+        self.min_duration = match self.call_count {
+            0 => other.min_duration,
+            _ => self.min_duration.min(other.min_duration),
+        };
+        self.max_duration = self.max_duration.max(other.max_duration);
         self.execution_duration += other.execution_duration;
+        self.cpu_duration += other.cpu_duration;
         self.call_count += other.call_count;
         self.events += &other.events;
 
@@ -464,7 +764,10 @@ impl GraphNode {
 
 #[cfg(test)]
 mod tests {
-    use {crate::data::CounterValue, tracing_subscriber::util::SubscriberInitExt};
+    use {
+        crate::data::CounterValue,
+        tracing_subscriber::{registry::LookupSpan, util::SubscriberInitExt, Registry},
+    };
     use {
         crate::{PrintTreeConfig, PrintTreeLayer},
         tracing_subscriber::layer::SubscriberExt,
@@ -476,12 +779,12 @@ mod tests {
 
     #[test]
     fn test_incremental_events_counts() {
-        let (layer, guard) = PrintTreeLayer::new(PrintTreeConfig::default());
+        let (layer, _guard) = PrintTreeLayer::new(PrintTreeConfig::default());
         let layer = tracing_subscriber::registry().with(layer);
         layer.try_init().unwrap();
 
-        let span = debug_span!("root span");
-        let _scope1 = span.enter();
+        let root_span = debug_span!("root span");
+        let _scope1 = root_span.enter();
         thread::sleep(Duration::from_millis(20));
         event!(name: "proof_size", Level::INFO, counter=true, incremental=true, value=1);
         // child spans 1 and 2 are siblings
@@ -509,8 +812,10 @@ mod tests {
         event!(name: "custom event", Level::DEBUG, {field5 = "value5", counter = true, value = 30});
         drop(scope);
 
-        thread::spawn(|| {
-            let span = debug_span!("child span5", field5 = "value5");
+        // a child entered on another thread
+        let parent = span3.clone();
+        thread::spawn(move || {
+            let span = debug_span!(parent: &parent, "child span5", field5 = "value5");
             let _scope = span.enter();
             thread::sleep(Duration::from_millis(20));
             event!(name: "proof_size", Level::INFO, counter=true, incremental=true, value=6);
@@ -526,8 +831,13 @@ mod tests {
         drop(scope);
         drop(_scope3);
 
-        let mut state = guard.state.lock().unwrap();
-        let root = state.unfinished_spans.get_mut(&1).unwrap();
+        // remove to avoid an incorrect graph print
+        let mut root = tracing::dispatcher::get_default(|dispatch| {
+            let registry = dispatch.downcast_ref::<Registry>().unwrap();
+            let root = registry.span(&root_span.id().unwrap()).unwrap();
+            let node = root.extensions_mut().remove::<super::SpanNode>().unwrap();
+            node.node
+        });
 
         root.accumulate_children_events(true);
 
@@ -535,8 +845,137 @@ mod tests {
             *root.events.get("proof_size").unwrap(),
             CounterValue::Int(10)
         );
+    }
 
-        // remove to avoid an incorrect graph print
-        state.unfinished_spans.remove(&1).unwrap();
+    #[test]
+    fn test_aggregate_calls_folded_stacks() {
+        let call = |name, millis, children: Vec<super::GraphNode>| {
+            let duration = Duration::from_millis(millis);
+            let mut node = super::GraphNode {
+                call_count: 1,
+                execution_duration: duration,
+                min_duration: duration,
+                max_duration: duration,
+                ..super::GraphNode::new(name)
+            };
+            for child in children {
+                node.add_child(child, true);
+            }
+            node
+        };
+
+        let mut root = super::GraphNode::new("[all threads]");
+        root.add_child(call("root", 10, vec![call("child", 4, vec![])]), true);
+        root.add_child(
+            call(
+                "root",
+                20,
+                vec![call("child", 2, vec![]), call("child", 6, vec![])],
+            ),
+            true,
+        );
+
+        let [root_node] = &root.child_nodes[..] else {
+            panic!("the calls of the root are not merged");
+        };
+        assert_eq!(root_node.call_count, 2);
+        assert_eq!(root_node.execution_duration, Duration::from_millis(30));
+        let [child] = &root_node.child_nodes[..] else {
+            panic!("the calls of the child are not merged");
+        };
+        assert_eq!(child.call_count, 3);
+        assert_eq!(child.min_duration, Duration::from_millis(2));
+        assert_eq!(child.max_duration, Duration::from_millis(6));
+
+        // unique per run, so that concurrent runs of the tests don't share the file
+        let nanos = std::time::SystemTime::now()
+            .duration_since(std::time::UNIX_EPOCH)
+            .unwrap()
+            .as_nanos();
+        let path = std::env::temp_dir().join(format!(
+            "tracing_profile_test_{}_{nanos}.folded",
+            std::process::id()
+        ));
+        root.write_folded_stacks(&path).unwrap();
+        let folded = std::fs::read_to_string(&path).unwrap();
+        std::fs::remove_file(&path).ok();
+        assert_eq!(folded, "root 18000000\nroot;child 12000000\n");
+    }
+
+    #[test]
+    fn test_aggregate_calls_by_callsite() {
+        let [first, second] = tracing::subscriber::with_default(Registry::default(), || {
+            [debug_span!("child"), debug_span!("child")]
+                .map(|span| span.metadata().unwrap().callsite())
+        });
+        let call = |callsite: &tracing::callsite::Identifier| super::GraphNode {
+            call_count: 1,
+            callsite: Some(callsite.clone()),
+            ..super::GraphNode::new("child")
+        };
+
+        let mut root = super::GraphNode::new("root");
+        root.add_child(call(&first), true);
+        root.add_child(call(&second), true);
+        root.add_child(call(&first), true);
+
+        // the spans with the same name are merged only if they have the same callsite
+        let counts: Vec<_> = root
+            .child_nodes
+            .iter()
+            .map(|child| child.call_count)
+            .collect();
+        assert_eq!(counts, [2, 1]);
+    }
+
+    #[test]
+    fn test_thread_roots_merged() {
+        let (layer, guard) = PrintTreeLayer::new(PrintTreeConfig::default());
+        let dispatch = tracing::Dispatch::new(tracing_subscriber::registry().with(layer));
+        thread::scope(|scope| {
+            for _ in 0..2 {
+                scope.spawn(|| {
+                    tracing::dispatcher::with_default(&dispatch, || {
+                        for _ in 0..3 {
+                            let span = debug_span!("worker");
+                            let _scope = span.enter();
+                            debug_span!("task").in_scope(|| {});
+                        }
+                    })
+                });
+            }
+        });
+
+        // the root spans of each thread are merged, not kept per call
+        let mut roots = Vec::new();
+        guard.shared.roots.for_each(|thread_roots| {
+            roots.extend(
+                thread_roots
+                    .other_threads
+                    .child_nodes
+                    .iter()
+                    .map(|root| (root.call_count, root.child_nodes.len())),
+            )
+        });
+        assert_eq!(roots, [(3, 1), (3, 1)]);
+    }
+
+    #[test]
+    fn test_cpu_time_label() {
+        let config = PrintTreeConfig {
+            display_cpu_time: true,
+            no_color: true,
+            ..Default::default()
+        };
+        let node = super::GraphNode {
+            execution_duration: Duration::from_millis(10),
+            cpu_duration: Duration::from_millis(4),
+            ..super::GraphNode::new("span")
+        };
+
+        assert_eq!(
+            node.label(Duration::from_millis(20), &config),
+            "span [ 10.00ms | cpu 4.00ms | 50.00% ]"
+        );
     }
 }
@@ -13,13 +13,15 @@ use tracing_subscriber::{
 
 use crate::{PrintTreeConfig, PrintTreeLayer};
 
+fn env_filter() -> EnvFilter {
+    EnvFilter::builder()
+        .with_default_directive(LevelFilter::DEBUG.into())
+        .from_env_lossy()
+}
+
 trait WithEnvFilter<S: Subscriber>: Layer<S> + Sized {
     fn with_env_filter(self) -> Filtered<Self, EnvFilter, S> {
-        let env_level_filter = EnvFilter::builder()
-            .with_default_directive(LevelFilter::DEBUG.into())
-            .from_env_lossy();
-
-        self.with_filter(env_level_filter)
+        self.with_filter(env_filter())
     }
 }
 
@@ -83,7 +85,11 @@ fn init_tracing_internal(_builder: BuilderOption) -> Result<impl Drop, Error> {
                             .map_err(Error::Perfetto)?
                     }
                 };
-                (layer.with(new_layer.with_env_filter()), crate::data::GuardWrapper::wrap(guard, new_guard))
+                use tracing_subscriber::filter::FilterExt;
+
+                // skips the perfetto layer entirely while perfetto doesn't record the events
+                let filter = env_filter().and(crate::PerfettoFilter::new());
+                (layer.with(new_layer.with_filter(filter)), crate::data::GuardWrapper::wrap(guard, new_guard))
             } else {
                 (layer, guard)
             }
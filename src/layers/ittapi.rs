@@ -1,11 +1,11 @@
 // Copyright 2024-2025 Irreducible Inc.
 
-use ittapi::{Domain, Task};
-use std::fmt::Write;
+use std::{cell::RefCell, collections::HashMap, fmt::Write};
 use tracing::span;
 use tracing_subscriber::{layer, registry::LookupSpan};
 
-use crate::data::{insert_to_span_storage, with_span_storage_mut, WritingFieldVisitor};
+use crate::data::{insert_to_span_storage, span_fields, with_span_storage_mut, RecordedFields};
+use crate::env_utils::get_bool_env_var;
 use crate::errors::err_msg;
 
 /// A tracing layer that integrates with Intel's Instrumentation and Tracing Technology (ITT) API.
@@ -23,13 +23,18 @@ use crate::errors::err_msg;
 ///
 /// # How It Works
 ///
-/// The `IttApiLayer` creates one ITT API `Task` for each tracing span in your application.
+/// The `IttApiLayer` creates one ITT API task for each tracing span in your application.
 /// When a span is entered, it begins an ITT task, and when the span is exited, it ends the task.
 /// This creates a hierarchical view of your application's execution flow that can be visualized
 /// in VTune Profiler alongside CPU usage, threading information, and other performance metrics.
 ///
 /// Span attributes are included in the task name using the format: `span_name(field1=value1, field2=value2)`.
 /// This helps identify specific instances of spans when analyzing performance data.
+/// With `static_task_names`, or the `ITTAPI_STATIC_TASK_NAMES` environment variable, the task name is only the
+/// span name, which is cheaper for spans entered very often.
+///
+/// The ITT string handles of the task names are created once per thread and name and cached, so entering a span
+/// only begins a task with the handle resolved when the span was created.
 ///
 /// # Use Cases
 ///
@@ -64,7 +69,8 @@ use crate::errors::err_msg;
 ///
 /// The ITT API is designed to have minimal overhead when VTune is not actively collecting data.
 /// When profiling is not active, the API calls become lightweight no-ops. However, there is still
-/// some overhead from creating task names and managing span data.
+/// some overhead from managing span data and, unless `static_task_names` is set, formatting the
+/// task names of the new spans.
 ///
 /// # See Also
 ///
@@ -72,21 +78,24 @@ use crate::errors::err_msg;
 /// - [Intel VTune Profiler](https://www.intel.com/content/www/us/en/developer/tools/oneapi/vtune-profiler.html)
 /// - [ittapi crate](https://github.com/intel/ittapi)
 pub struct Layer {
-    domain: &'static Domain,
+    domain: itt::Domain,
+    static_task_names: bool,
 }
 
 impl Layer {
-    /// Creates a new IttApiLayer with a leaked Domain.
-    ///
-    /// This uses `Box::leak()` to create a `'static` reference to the Domain.
-    /// This is acceptable because:
-    /// - The Domain type has no Drop implementation and leaks its internal resources anyway
-    /// - We typically only create one Layer instance for the lifetime of the application
-    /// - This avoids the complexity and unsafety of using static mut with non-Send types
+    /// Creates a new IttApiLayer. The collector keeps its domain for the lifetime of the
+    /// process, the layers created with the same domain name share it.
     pub fn new() -> Self {
-        // Create a boxed Domain and leak it to get a 'static reference
-        let domain = Box::leak(Box::new(Domain::new("Global tracing domain")));
-        Self { domain }
+        Self {
+            domain: itt::Domain::new("Global tracing domain"),
+            static_task_names: get_bool_env_var("ITTAPI_STATIC_TASK_NAMES", false),
+        }
+    }
+
+    /// Name the tasks after the span names only, without the span fields.
+    pub fn static_task_names(mut self, static_task_names: bool) -> Self {
+        self.static_task_names = static_task_names;
+        self
     }
 }
 
@@ -101,37 +110,36 @@ where
     for<'lookup> S: LookupSpan<'lookup>,
 {
     fn on_new_span(&self, attrs: &span::Attributes<'_>, id: &span::Id, ctx: layer::Context<'_, S>) {
-        let mut full_name = attrs.metadata().name().to_string();
-
-        if !attrs.is_empty() {
-            write!(&mut full_name, "(").expect("failed to write");
-
-            let mut visitor = WritingFieldVisitor::new(&mut full_name);
-            attrs.record(&mut visitor);
-
-            write!(&mut full_name, ")").expect("failed to write");
-        }
+        let name = match self.static_task_names || attrs.is_empty() {
+            true => TaskName::for_callsite(attrs.metadata()),
+            false => TaskName::with_fields(
+                attrs.metadata().name(),
+                &span_fields(attrs, id, ctx.clone()),
+            ),
+        };
 
         insert_to_span_storage(
             id,
             ctx,
             TaskData {
-                name: full_name,
-                task: None,
+                name,
+                started: false,
             },
         );
     }
 
     fn on_enter(&self, id: &span::Id, ctx: layer::Context<'_, S>) {
         with_span_storage_mut::<TaskData, S>(id, ctx, |task_data| {
-            task_data.task = Some(Task::begin(self.domain, task_data.name.as_str()));
+            self.domain.task_begin(task_data.name.0);
+            task_data.started = true;
         });
     }
 
     fn on_exit(&self, id: &span::Id, ctx: layer::Context<'_, S>) {
         with_span_storage_mut::<TaskData, S>(id, ctx, |task_data| {
-            if let Some(task) = task_data.task.take() {
-                task.end();
+            if task_data.started {
+                self.domain.task_end();
+                task_data.started = false;
             } else {
                 err_msg!("task not found for span on exit");
             }
@@ -142,6 +150,143 @@ where
 }
 
 struct TaskData {
-    name: String,
-    task: Option<Task<'static>>,
+    name: TaskName,
+    started: bool,
+}
+
+/// ITT string handle of a task name.
+#[derive(Clone, Copy)]
+struct TaskName(itt::StringHandle);
+
+impl TaskName {
+    /// Handle of the span name of the callsite.
+    fn for_callsite(metadata: &'static tracing::Metadata<'static>) -> Self {
+        let key = metadata as *const _ as usize;
+        CALLSITE_HANDLES.with_borrow_mut(|handles| {
+            *handles
+                .entry(key)
+                .or_insert_with(|| Self(itt::StringHandle::new(metadata.name())))
+        })
+    }
+
+    /// Handle of `span_name(field1=value1, field2=value2)`. The name is formatted into a
+    /// buffer of the thread, it only allocates the first time the thread sees it. Past
+    /// `MAX_CACHED_NAMES` names the new ones are looked up by the collector every time.
+    fn with_fields(name: &str, fields: &RecordedFields) -> Self {
+        NAME_BUFFER.with_borrow_mut(|full_name| {
+            full_name.clear();
+            full_name.push_str(name);
+            write!(full_name, "(").expect("failed to write");
+            fields
+                .write_to(&mut *full_name, ", ")
+                .expect("failed to write fields");
+            write!(full_name, ")").expect("failed to write");
+
+            NAME_HANDLES.with_borrow_mut(|handles| {
+                if let Some(name) = handles.get(full_name.as_str()) {
+                    return *name;
+                }
+
+                let name = Self(itt::StringHandle::new(full_name));
+                if handles.len() < MAX_CACHED_NAMES {
+                    handles.insert(full_name.clone(), name);
+                }
+                name
+            })
+        })
+    }
+}
+
+/// Number of the task names with fields cached by each thread. The fields usually have a few
+/// distinct values, the ones with unbounded values, e.g. IDs, would grow the cache forever.
+const MAX_CACHED_NAMES: usize = 4096;
+
+thread_local! {
+    /// Handles of the span names, by callsite.
+    static CALLSITE_HANDLES: RefCell<HashMap<usize, TaskName>> = RefCell::new(HashMap::new());
+    /// Handles of the task names with the span fields.
+    static NAME_HANDLES: RefCell<HashMap<String, TaskName>> = RefCell::new(HashMap::new());
+    static NAME_BUFFER: RefCell<String> = const { RefCell::new(String::new()) };
+}
+
+/// The ITT task API over the raw pointers of the collector. `ittapi::Task` consumes an owned
+/// `ittapi::StringHandle` on every begin, which can't be cached or shared between threads.
+/// The functions do nothing when no collector is attached.
+mod itt {
+    use std::{ffi::CString, ptr};
+
+    use ittapi_sys::{__itt_domain, __itt_id, __itt_string_handle};
+
+    use crate::errors::err_msg;
+
+    /// Domain of the tasks.
+    pub struct Domain(*mut __itt_domain);
+
+    /// String registered with the collector.
+    #[derive(Clone, Copy)]
+    pub struct StringHandle(*mut __itt_string_handle);
+
+    // The collector creates the domains and the string handles for the lifetime of the process
+    // and never changes them, they can be used from any thread.
+    unsafe impl Send for Domain {}
+    unsafe impl Sync for Domain {}
+    unsafe impl Send for StringHandle {}
+    unsafe impl Sync for StringHandle {}
+
+    const NULL_ID: __itt_id = __itt_id {
+        d1: 0,
+        d2: 0,
+        d3: 0,
+    };
+
+    fn c_string(name: &str) -> Option<CString> {
+        let name = CString::new(name);
+        if name.is_err() {
+            err_msg!("ITT name contains a nul byte");
+        }
+        name.ok()
+    }
+
+    impl Domain {
+        pub fn new(name: &str) -> Self {
+            #[cfg(unix)]
+            let create_fn = unsafe { ittapi_sys::__itt_domain_create_ptr__3_0 };
+            #[cfg(windows)]
+            let create_fn = unsafe { ittapi_sys::__itt_domain_createA_ptr__3_0 };
+
+            match (create_fn, c_string(name)) {
+                (Some(create_fn), Some(name)) => Self(unsafe { create_fn(name.as_ptr()) }),
+                _ => Self(ptr::null_mut()),
+            }
+        }
+
+        /// Begin a task of the current thread.
+        pub fn task_begin(&self, name: StringHandle) {
+            if let Some(begin_fn) = unsafe { ittapi_sys::__itt_task_begin_ptr__3_0 } {
+                unsafe { begin_fn(self.0, NULL_ID, NULL_ID, name.0) };
+            }
+        }
+
+        /// End the last task begun by the current thread.
+        pub fn task_end(&self) {
+            if let Some(end_fn) = unsafe { ittapi_sys::__itt_task_end_ptr__3_0 } {
+                unsafe { end_fn(self.0) };
+            }
+        }
+    }
+
+    impl StringHandle {
+        /// Handle of `name`, the collector returns the same handle for the same string.
+        pub fn new(name: &str) -> Self {
+            #[cfg(unix)]
+            let create_fn = unsafe { ittapi_sys::__itt_string_handle_create_ptr__3_0 };
+            #[cfg(windows)]
+            let create_fn = unsafe { ittapi_sys::__itt_string_handle_createA_ptr__3_0 };
+
+            match (create_fn, c_string(name)) {
+                (Some(create_fn), Some(name)) => Self(unsafe { create_fn(name.as_ptr()) }),
+                _ => Self(ptr::null_mut()),
+            }
+        }
+    }
 }
@@ -5,6 +5,8 @@ pub mod init_tracing;
 
 #[cfg(feature = "perfetto")]
 pub mod perfetto;
+#[cfg(all(feature = "perfetto", feature = "perf_counters"))]
+pub mod perfetto_perf_counters;
 #[cfg(feature = "perfetto")]
 pub mod perfetto_utils;
 
@@ -1,15 +1,33 @@
 // Copyright 2024-2025 Irreducible Inc.
 
-use perfetto_sys::{create_instant_event, BackendConfig, EventData, PerfettoGuard};
+use std::{
+    cell::RefCell,
+    collections::HashMap,
+    hash::{DefaultHasher, Hash, Hasher},
+    sync::{OnceLock, RwLock},
+};
+
+use perfetto_sys::{
+    create_batched_instant_event, create_instant_event, record_deferred_instant_event,
+    BackendConfig, CategoryBuffer, CounterHandle, DeferredConfig, EventData, PerfettoGuard,
+    ProducerConfig, RotationConfig, SamplingKey, SamplingPolicy, SamplingRule, TraceCompression,
+};
 use tracing::{
     field::{Field, Visit},
     span,
+    subscriber::Interest,
+    Metadata,
 };
 
-use crate::data::{with_span_storage_mut, CounterValue, CounterVisitor, PerfettoMetadata};
+use crate::data::{
+    span_fields, with_span_storage_mut, CounterValue, CounterVisitor, DelayedEmit, FieldValue,
+    PerfettoMetadata, RecordedFields,
+};
 use crate::errors::err_msg;
 
 use crate::filename_utils::{get_formatted_time, get_git_info};
+#[cfg(feature = "perf_counters")]
+use crate::layers::perfetto_perf_counters::{parse_perf_events, SpanPerfCounters};
 use crate::layers::perfetto_utils::emit_run_metadata;
 
 /// Default categoties for events and counters.
@@ -22,8 +40,123 @@ const PERFETTO_CATEGORY_FIELD: &str = "perfetto_category";
 const PERFETTO_TRACK_ID_FIELD: &str = "perfetto_track_id";
 const PERFETTO_FLOW_ID_FIELD: &str = "perfetto_flow_id";
 
+/// Default shared memory size of the in-process backend, the SDK default of 256 KB is easily
+/// exhausted by fast producers.
+const DEFAULT_SHMEM_SIZE_KB: u32 = 4096;
+/// Default flush period of the in-process backend.
+const DEFAULT_FLUSH_PERIOD_MS: u32 = 2000;
+
+fn env_var_parsed<T: std::str::FromStr>(name: &str) -> Option<T> {
+    std::env::var(name)
+        .ok()
+        .and_then(|value| value.parse().ok())
+}
+
+/// Parse a list of category buffers in the `size_kb:category,category;size_kb:category` format.
+fn parse_category_buffers(value: &str) -> Vec<CategoryBuffer> {
+    value
+        .split(';')
+        .filter(|buffer| !buffer.trim().is_empty())
+        .filter_map(|buffer| {
+            let parsed = buffer.split_once(':').and_then(|(size_kb, categories)| {
+                Some(CategoryBuffer {
+                    size_kb: size_kb.trim().parse().ok()?,
+                    categories: categories
+                        .split(',')
+                        .map(|category| category.trim().to_string())
+                        .filter(|category| !category.is_empty())
+                        .collect(),
+                })
+            });
+            if parsed.is_none() {
+                err_msg!("invalid PERFETTO_CATEGORY_BUFFERS entry: {buffer}");
+            }
+            parsed
+        })
+        .collect()
+}
+
+/// Rotation of the trace into chunk files named by `builder`, if the size or the duration of the
+/// chunks is set in the environment.
+fn rotation_from_env(
+    builder: crate::filename_builder::TraceFilenameBuilder,
+    output_path: &std::path::Path,
+) -> Option<RotationConfig> {
+    let max_chunk_size_kb = env_var_parsed::<usize>("PERFETTO_CHUNK_SIZE_MB")
+        .filter(|size| *size > 0)
+        .map(|size_mb| size_mb * 1024);
+    let max_chunk_duration = env_var_parsed("PERFETTO_CHUNK_DURATION_S")
+        .filter(|duration| *duration > 0)
+        .map(std::time::Duration::from_secs);
+    if max_chunk_size_kb.is_none() && max_chunk_duration.is_none() {
+        return None;
+    }
+
+    let output_path = output_path.to_path_buf();
+    let mut rotation = RotationConfig::new(move |index| {
+        builder.clone().chunk(index).build().unwrap_or_else(|e| {
+            err_msg!("failed to build the path of the trace chunk {index}: {e}");
+            crate::filename_builder::with_chunk_index(&output_path, ".", index)
+        })
+    });
+    rotation.max_chunk_size_kb = max_chunk_size_kb;
+    rotation.max_chunk_duration = max_chunk_duration;
+    rotation.max_chunks = env_var_parsed("PERFETTO_MAX_CHUNKS");
+    Some(rotation)
+}
+
+/// Parse a list of sampling rules in the `name:span=1/N;category:io=N/s` format.
+fn parse_sampling_rules(value: &str) -> Vec<SamplingRule> {
+    value
+        .split(';')
+        .filter(|rule| !rule.trim().is_empty())
+        .filter_map(|rule| {
+            let parsed = rule.split_once('=').and_then(|(key, policy)| {
+                let key = match key.trim().split_once(':')? {
+                    ("name", name) => SamplingKey::Name(name.trim().to_string()),
+                    ("category", category) => SamplingKey::Category(category.trim().to_string()),
+                    _ => return None,
+                };
+                let policy = match policy.trim() {
+                    policy if policy.starts_with("1/") => {
+                        SamplingPolicy::OneIn(policy[2..].parse().ok()?)
+                    }
+                    policy => SamplingPolicy::PerSecond(policy.strip_suffix("/s")?.parse().ok()?),
+                };
+                Some(SamplingRule { key, policy })
+            });
+            if parsed.is_none() {
+                err_msg!("invalid PERFETTO_SAMPLING entry: {rule}");
+            }
+            parsed
+        })
+        .collect()
+}
+
 struct SpanVisitor<'a>(&'a mut EventData);
 
+impl SpanVisitor<'_> {
+    /// Add the recorded fields of a span, with the same special fields as the visited ones.
+    fn add_fields(&mut self, fields: &RecordedFields) {
+        for (name, value) in fields.iter() {
+            match (name, value) {
+                (PERFETTO_CATEGORY_FIELD, FieldValue::Str(category)) => {
+                    self.0.set_category(category)
+                }
+                (PERFETTO_TRACK_ID_FIELD, FieldValue::U64(id)) => self.0.set_track_id(id),
+                (PERFETTO_TRACK_ID_FIELD, FieldValue::I64(id)) => self.0.set_track_id(id as _),
+                (PERFETTO_FLOW_ID_FIELD, FieldValue::U64(id)) => self.0.set_flow_id(id),
+                (PERFETTO_FLOW_ID_FIELD, FieldValue::I64(id)) => self.0.set_flow_id(id as _),
+                (name, FieldValue::U64(value)) => self.0.add_u64_field(name, value),
+                (name, FieldValue::I64(value)) => self.0.add_i64_field(name, value),
+                (name, FieldValue::F64(value)) => self.0.add_f64_field(name, value),
+                (name, FieldValue::Bool(value)) => self.0.add_bool_field(name, value),
+                (name, FieldValue::Str(value)) => self.0.add_string_arg(name, value),
+            }
+        }
+    }
+}
+
 impl Visit for SpanVisitor<'_> {
     fn record_str(&mut self, field: &Field, value: &str) {
         match field.name() {
@@ -63,10 +196,65 @@ impl Visit for SpanVisitor<'_> {
     }
 
     fn record_debug(&mut self, field: &Field, debug: &dyn std::fmt::Debug) {
-        self.0.add_string_arg(field.name(), &format!("{debug:?}"));
+        self.0.add_debug_arg(field.name(), debug);
     }
 }
 
+type CounterKey = (&'static str, Option<Box<str>>, Option<Box<str>>, bool);
+/// Registered counter tracks by the hash of their key, see `get_counter_handle`.
+type CounterTracks = HashMap<u64, Vec<(CounterKey, CounterHandle)>>;
+
+// Get the registered counter track for a counter event. The tracks are shared by all threads, so
+// a counter is registered only once, and looking it up doesn't allocate.
+fn get_counter_handle(
+    name: &'static str,
+    category: Option<&str>,
+    unit: Option<&str>,
+    is_incremental: bool,
+) -> CounterHandle {
+    static COUNTERS: OnceLock<RwLock<CounterTracks>> = OnceLock::new();
+    let counters = COUNTERS.get_or_init(Default::default);
+
+    let mut hasher = DefaultHasher::new();
+    (name, category, unit, is_incremental).hash(&mut hasher);
+    let hash = hasher.finish();
+    let find = |tracks: &[(CounterKey, CounterHandle)]| {
+        tracks
+            .iter()
+            .find(|((key_name, key_category, key_unit, key_incremental), _)| {
+                *key_name == name
+                    && key_category.as_deref() == category
+                    && key_unit.as_deref() == unit
+                    && *key_incremental == is_incremental
+            })
+            .map(|(_, handle)| *handle)
+    };
+
+    if let Some(handle) = counters
+        .read()
+        .unwrap()
+        .get(&hash)
+        .and_then(|tracks| find(tracks))
+    {
+        return handle;
+    }
+    let mut counters = counters.write().unwrap();
+    let tracks = counters.entry(hash).or_default();
+    // another thread may have registered it in the meantime
+    if let Some(handle) = find(tracks) {
+        return handle;
+    }
+    let handle = CounterHandle::new(category, name, unit, is_incremental);
+    let key = (
+        name,
+        category.map(Into::into),
+        unit.map(Into::into),
+        is_incremental,
+    );
+    tracks.push((key, handle));
+    handle
+}
+
 /// Perfetto layer for tracing.
 ///
 /// The layer support two types of entities:
@@ -78,15 +266,119 @@ impl Visit for SpanVisitor<'_> {
 ///  - `value`: value of the counter, integer or double. Required.
 ///  - `unit`: unit of the counter. Optional.
 ///  - `incremental`: if set to true, the counter will be treated as incremental. Optional.
+///  - `perfetto_category`: category of the counter. If not specified "default" will be used.
 /// - all other events are converted into perfetto instant events.
 ///
+/// Every entry of a span is a slice. The entries on the thread of the first one stay on its track. Spans
+/// entered from another thread, e.g. instrumented futures polled by several worker threads, get a named
+/// async track for the slices of that entry and of the later ones, so that the rest of the work of a task
+/// is shown on one track. In the deferred mode these slices stay on the thread tracks.
+///
+/// In the batched mode the events of a thread are gathered and passed to perfetto in a single call when
+/// a span ends, which reduces the per-event overhead for short spans.
+///
+/// In the deferred mode the span and instant events are only recorded into a per-thread ring, and
+/// a background thread emits them into perfetto. This removes most of the tracing overhead from the
+/// instrumented threads. String fields are not recorded in this mode and only the first four other fields
+/// of an event are kept, flow IDs included. Counters are emitted as usual.
+/// The number of events dropped because a ring was full is written to the `deferred_dropped_events`
+/// counter track.
+///
+/// With a minimum span duration the begin of a span is held until the span exits, and both events
+/// are emitted with their original timestamps only if the span lasted at least that long. The
+/// children of a dropped span are shorter than it, so they are dropped as well. In the batched and
+/// the deferred modes the kept spans go through the batch or the ring of the thread.
+///
+/// Wrap the layer with `PerfettoFilter` to skip it entirely while perfetto doesn't record the events,
+/// e.g. before a system session starts or while the default category is disabled.
+///
+/// With the `perf_counters` feature the layer can read hardware counters, see `with_perf_counters`.
+/// Every thread opens its own counter group and writes the values at each span boundary to counter
+/// tracks under its thread track, so that e.g. the instructions and cache misses of a slice can be
+/// read next to it.
+///
 /// ```ignore
 /// // At the beginning of the program
 /// (layer, guard) = PerfettoLayer::new_from_env().unwrap();
 ///
 /// // guard should be kept alive for the duration of the program
 /// ```
-pub struct Layer {}
+pub struct Layer {
+    mode: EmitMode,
+    /// Spans shorter than this are dropped.
+    min_span_duration_ns: Option<u64>,
+    /// Hardware counters read at the span boundaries.
+    #[cfg(feature = "perf_counters")]
+    perf_counters: Option<SpanPerfCounters>,
+}
+
+/// Per-layer filter of the perfetto layer that disables its callsites while perfetto doesn't
+/// record them, so that the fields are not visited and no event is built. The check reads the
+/// enabled state of the categories exported by perfetto-sys without calling into the SDK, and the
+/// cached interests are rebuilt when a tracing session starts or stops.
+///
+/// Callsites with a `perfetto_category` field are enabled while tracing runs, the category is
+/// checked by perfetto. The other callsites follow the default category.
+///
+/// ```ignore
+/// let layer = layer.with_filter(PerfettoFilter::new());
+/// ```
+pub struct Filter(());
+
+impl Filter {
+    pub fn new() -> Self {
+        extern "C" fn rebuild_interest_cache() {
+            tracing::callsite::rebuild_interest_cache();
+        }
+
+        perfetto_sys::set_enabled_state_callback(Some(rebuild_interest_cache));
+        Self(())
+    }
+
+    fn is_enabled(metadata: &Metadata<'_>) -> bool {
+        if !perfetto_sys::is_tracing_enabled() {
+            return false;
+        }
+
+        metadata.fields().field(PERFETTO_CATEGORY_FIELD).is_some()
+            || perfetto_sys::is_category_enabled(None)
+    }
+}
+
+impl Default for Filter {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<S> tracing_subscriber::layer::Filter<S> for Filter {
+    fn enabled(
+        &self,
+        metadata: &Metadata<'_>,
+        _ctx: &tracing_subscriber::layer::Context<'_, S>,
+    ) -> bool {
+        Self::is_enabled(metadata)
+    }
+
+    fn callsite_enabled(&self, metadata: &'static Metadata<'static>) -> Interest {
+        match Self::is_enabled(metadata) {
+            // the state changes only with the sessions, which rebuild the interests
+            true => Interest::always(),
+            false => Interest::never(),
+        }
+    }
+}
+
+/// How the span and instant events are passed to perfetto.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum EmitMode {
+    /// Every event is emitted immediately.
+    Inline,
+    /// The events are gathered per thread and emitted when a span ends.
+    Batched,
+    /// The events are recorded per thread and emitted by a background thread.
+    Deferred,
+}
 
 impl Layer {
     /// Create a new layer with the settings from the environment.
@@ -95,8 +387,27 @@ impl Layer {
     /// - `PERFETTO_FUSE`: if set, the system backend will be used. Otherwise the in-process backend will be used.
     /// - `PERFETTO_BIN_PATH`: path to the perfetto binaries. If not set, the system path will be used. Is used only with the system backend.
     /// - `PERFETTO_CFG_PATH`: path to the perfetto config file. If not set, the default one `config/system_profiling.cfg` will be used. Is used only with the system backend.
-    /// - `PERFETTO_BUFFER_SIZE_KB`: size of the buffer in kilobytes. Default: 50 * 1024. Is used only with the in-process backend.
+    /// - `PERFETTO_STARTUP_TRACING`: if set, tracing starts immediately and the session of the perfetto process adopts the events once it starts, instead of waiting for it. Is used only with the system backend.
+    /// - `PERFETTO_START_TIMEOUT_MS`: with `PERFETTO_STARTUP_TRACING`, how long the events are kept if no session adopts them, default: 10000. Otherwise how long to wait for the session to start, default: indefinitely. Is used only with the system backend.
+    /// - `PERFETTO_BUFFER_SIZE_KB`: size of the buffer in kilobytes. Default: 50 * 1024, or 8 * 1024 when streaming. Is used only with the in-process backend.
+    /// - `PERFETTO_FILE_WRITE_PERIOD_MS`: if set, the trace is streamed into the output file with this period instead of being kept in memory. Is used only with the in-process backend.
+    /// - `PERFETTO_COMPRESSION`: compression of the trace file, `none` or `gzip`. Default: `none`. Is used only with the in-process backend.
+    /// - `PERFETTO_CHUNK_SIZE_MB`, `PERFETTO_CHUNK_DURATION_S`: if either is set, the trace is rotated into chunk files of at most this size (before compression) or duration while tracing runs, named by the filename builder with the chunk index appended, see `perfetto_sys::RotationConfig`. The default buffer size is at least twice the chunk size then. Takes precedence over `PERFETTO_FILE_WRITE_PERIOD_MS`. Is used only with the in-process backend.
+    /// - `PERFETTO_MAX_CHUNKS`: with the rotation, number of the most recent chunk files kept, the older ones are deleted. Default: all are kept.
+    /// - `PERFETTO_RING_BUFFER`: if set, the flight recorder mode is used: only the most recent data is kept, see `PerfettoGuard::snapshot`. Is used only with the in-process backend.
+    /// - `PERFETTO_FLUSH_PERIOD_MS`: how often the data of the threads is committed into the buffer, 0 to commit only full chunks. Default: 2000. Is used only with the in-process backend.
+    /// - `PERFETTO_THREAD_TIME`: if set, the CPU time of the thread is recorded with every slice, see the thread time of the slices in the UI. Is used only with the in-process backend, enable `enable_thread_time_sampling` in the perfetto config for the system backend.
+    /// - `PERFETTO_CATEGORY_BUFFERS`: additional buffers for some categories in the `size_kb:category,category;size_kb:category` format. Is used only with the in-process backend.
+    /// - `PERFETTO_SHMEM_SIZE_KB`: size hint of the shared memory between the process and the tracing service. Default: 4096 with the in-process backend, 256 with the system backend.
+    /// - `PERFETTO_SHMEM_PAGE_SIZE_KB`: page size hint of the shared memory. Default: 4.
     /// - `PERFETTO_PLATFORM_NAME`: custom platform name. Default: architecture of the CPU that is currently in use.
+    /// - `PERFETTO_FLUSH_TIMEOUT_MS`: maximum time to wait for the trace data to be flushed on shutdown. Default: 5000.
+    /// - `PERFETTO_BATCH`: if set, the batched mode will be used.
+    /// - `PERFETTO_DEFERRED`: if set, the deferred mode will be used. Takes precedence over `PERFETTO_BATCH`.
+    /// - `PERFETTO_DEFERRED_RING_SIZE`: number of events in the ring of each thread in the deferred mode. Default: 4096.
+    /// - `PERFETTO_MIN_SPAN_DURATION_NS`: if set, the spans that last less than this many nanoseconds are not emitted. Default: 0.
+    /// - `PERFETTO_PERF_COUNTERS`: hardware counters to read at the span boundaries, a comma-separated list of `instructions`, `cycles`, `cache_misses` and `branch_misses`. Requires the `perf_counters` feature.
+    /// - `PERFETTO_SAMPLING`: sampling of frequent spans and events by name or category in the `name:span=1/N;category:io=N/s` format, i.e. one event of every N, or at most N events per second and thread. The number of sampled out events is written to the `sampled_out_events` counter.
     pub fn new_from_env() -> Result<(Self, PerfettoGuard), perfetto_sys::Error> {
         // Simply delegate to the builder version
         let builder = crate::filename_builder::TraceFilenameBuilder::from_env();
@@ -134,6 +445,8 @@ impl Layer {
     ) -> Result<(Self, PerfettoGuard), perfetto_sys::Error> {
         use crate::layers::perfetto_utils::compute_trace_path_with_builder;
 
+        let run_metadata = builder.run_metadata();
+        let chunk_builder = builder.clone();
         // Use the new builder-based path computation
         let output_path = compute_trace_path_with_builder(builder).map_err(|e| {
             perfetto_sys::Error::IOError(std::io::Error::new(
@@ -148,28 +461,169 @@ impl Layer {
         let git_info = get_git_info();
 
         // Configure backend (same logic as new_from_env)
+        let shmem_page_size_hint_kb = env_var_parsed("PERFETTO_SHMEM_PAGE_SIZE_KB").unwrap_or(0);
         let backend = match std::env::var("PERFETTO_FUSE") {
             Ok(_) => BackendConfig::System {
                 perfetto_bin_path: std::env::var("PERFETTO_BIN_PATH").ok(),
                 perfetto_cfg_path: std::env::var("PERFETTO_CFG_PATH").ok(),
+                producer: ProducerConfig {
+                    shmem_size_hint_kb: env_var_parsed("PERFETTO_SHMEM_SIZE_KB").unwrap_or(0),
+                    shmem_page_size_hint_kb,
+                },
+                startup_tracing: std::env::var("PERFETTO_STARTUP_TRACING").is_ok(),
+                start_timeout: env_var_parsed("PERFETTO_START_TIMEOUT_MS")
+                    .map(std::time::Duration::from_millis),
             },
             Err(_) => {
+                let compression = match std::env::var("PERFETTO_COMPRESSION").as_deref() {
+                    Ok("gzip") => TraceCompression::Gzip,
+                    Ok("none") | Err(_) => TraceCompression::None,
+                    Ok(value) => {
+                        err_msg!("unknown PERFETTO_COMPRESSION value: {value}");
+                        TraceCompression::None
+                    }
+                };
+                let file_write_period_ms = std::env::var("PERFETTO_FILE_WRITE_PERIOD_MS")
+                    .ok()
+                    .and_then(|period| period.parse().ok());
+                let rotation = rotation_from_env(chunk_builder, &output_path);
+
+                // streaming only needs to buffer the data between two writes, the rotation
+                // needs to buffer a chunk
                 const DEFAULT_BUFFER_SIZE_KB: usize = 50 * 1024;
+                const DEFAULT_STREAMING_BUFFER_SIZE_KB: usize = 8 * 1024;
+                let default_buffer_size_kb = match (&rotation, file_write_period_ms) {
+                    (Some(rotation), _) => rotation
+                        .max_chunk_size_kb
+                        .map_or(DEFAULT_BUFFER_SIZE_KB, |size_kb| {
+                            DEFAULT_BUFFER_SIZE_KB.max(2 * size_kb)
+                        }),
+                    (None, Some(_)) => DEFAULT_STREAMING_BUFFER_SIZE_KB,
+                    (None, None) => DEFAULT_BUFFER_SIZE_KB,
+                };
                 let buffer_size_kb = match std::env::var("PERFETTO_BUFFER_SIZE_KB") {
-                    Ok(size) => size.parse().unwrap_or(DEFAULT_BUFFER_SIZE_KB),
-                    Err(_) => DEFAULT_BUFFER_SIZE_KB,
+                    Ok(size) => size.parse().unwrap_or(default_buffer_size_kb),
+                    Err(_) => default_buffer_size_kb,
                 };
 
-                BackendConfig::InProcess { buffer_size_kb }
+                BackendConfig::InProcess {
+                    buffer_size_kb,
+                    file_write_period_ms,
+                    ring_buffer: std::env::var("PERFETTO_RING_BUFFER").is_ok(),
+                    compression,
+                    flush_period_ms: match env_var_parsed("PERFETTO_FLUSH_PERIOD_MS") {
+                        Some(0) => None,
+                        Some(period) => Some(period),
+                        None => Some(DEFAULT_FLUSH_PERIOD_MS),
+                    },
+                    category_buffers: std::env::var("PERFETTO_CATEGORY_BUFFERS")
+                        .map(|value| parse_category_buffers(&value))
+                        .unwrap_or_default(),
+                    producer: ProducerConfig {
+                        shmem_size_hint_kb: env_var_parsed("PERFETTO_SHMEM_SIZE_KB")
+                            .unwrap_or(DEFAULT_SHMEM_SIZE_KB),
+                        shmem_page_size_hint_kb,
+                    },
+                    thread_time: std::env::var("PERFETTO_THREAD_TIME").is_ok(),
+                    rotation,
+                }
             }
         };
 
         // Start tracing
-        let guard = PerfettoGuard::new(backend, &output_path_str)?;
+        let mut guard = PerfettoGuard::new(backend, &output_path_str)?;
+        if let Some(timeout_ms) = std::env::var("PERFETTO_FLUSH_TIMEOUT_MS")
+            .ok()
+            .and_then(|timeout| timeout.parse().ok())
+        {
+            guard.set_flush_timeout(std::time::Duration::from_millis(timeout_ms));
+        }
+        if let Ok(value) = std::env::var("PERFETTO_SAMPLING") {
+            perfetto_sys::set_sampling_rules(parse_sampling_rules(&value));
+        }
 
-        emit_run_metadata(output_path, timestamp_iso, git_info.as_ref());
+        let mode = if std::env::var("PERFETTO_DEFERRED").is_ok() {
+            EmitMode::Deferred
+        } else if std::env::var("PERFETTO_BATCH").is_ok() {
+            EmitMode::Batched
+        } else {
+            EmitMode::Inline
+        };
+        if mode == EmitMode::Deferred {
+            let mut config = DeferredConfig::default();
+            if let Some(ring_capacity) = std::env::var("PERFETTO_DEFERRED_RING_SIZE")
+                .ok()
+                .and_then(|size| size.parse().ok())
+            {
+                config.ring_capacity = ring_capacity;
+            }
+            guard.start_deferred(config);
+        }
 
-        Ok((Self {}, guard))
+        emit_run_metadata(output_path, timestamp_iso, git_info.as_ref(), &run_metadata);
+
+        let min_span_duration_ns =
+            env_var_parsed("PERFETTO_MIN_SPAN_DURATION_NS").filter(|duration| *duration > 0);
+
+        Ok((
+            Self {
+                mode,
+                min_span_duration_ns,
+                #[cfg(feature = "perf_counters")]
+                perf_counters: std::env::var("PERFETTO_PERF_COUNTERS")
+                    .ok()
+                    .map(|value| parse_perf_events(&value))
+                    .filter(|events| !events.is_empty())
+                    .map(SpanPerfCounters::new),
+            },
+            guard,
+        ))
+    }
+
+    /// Read the `events` hardware counters of the current thread at every span boundary and
+    /// write them to counter tracks of the thread, named after the events.
+    #[cfg(feature = "perf_counters")]
+    pub fn with_perf_counters(mut self, events: Vec<(String, perf_event::events::Event)>) -> Self {
+        self.perf_counters = (!events.is_empty()).then(|| SpanPerfCounters::new(events));
+        self
+    }
+
+    /// Emit `event` as a counter if it is one, `data` is the visitor to record it with.
+    fn emit_counter(&self, event: &tracing::Event<'_>, data: &mut CounterVisitor) -> bool {
+        data.clear();
+        event.record(data);
+        if !data.is_counter {
+            return false;
+        }
+
+        let Some(value) = data.value else {
+            err_msg!(
+                "invalid event(missing either 'name' or 'value'): {:?}",
+                event
+            );
+            return true;
+        };
+
+        let counter = get_counter_handle(
+            event.metadata().name(),
+            (!data.category.is_empty()).then_some(data.category.as_str()),
+            (!data.unit.is_empty()).then_some(data.unit.as_str()),
+            data.is_incremental,
+        );
+        match (value, self.mode) {
+            (CounterValue::Int(value), EmitMode::Batched) => counter.set_u64_batched(value),
+            (CounterValue::Float(value), EmitMode::Batched) => counter.set_f64_batched(value),
+            (CounterValue::Int(value), _) => counter.set_u64(value),
+            (CounterValue::Float(value), _) => counter.set_f64(value),
+        }
+        true
+    }
+
+    fn emit_perf_counters(&self) {
+        #[cfg(feature = "perf_counters")]
+        if let Some(perf_counters) = &self.perf_counters {
+            perf_counters.emit(self.mode == EmitMode::Batched);
+        }
     }
 }
 
@@ -185,44 +639,27 @@ where
         event: &tracing::Event<'_>,
         _ctx: tracing_subscriber::layer::Context<'_, S>,
     ) {
-        let mut data = CounterVisitor::default();
-        event.record(&mut data);
-
+        thread_local! {
+            // reused, so that the strings of the counters are not allocated for every event
+            static COUNTER_VISITOR: RefCell<CounterVisitor> = RefCell::new(CounterVisitor::default());
+        }
         // 1) Counter events: record as counters, then exit.
-        if data.is_counter {
-            match data.value {
-                Some(CounterValue::Int(value)) => {
-                    perfetto_sys::set_counter_u64(
-                        event.metadata().name(),
-                        data.unit.as_deref(),
-                        data.is_incremental,
-                        value,
-                    );
-                }
-                Some(CounterValue::Float(value)) => {
-                    perfetto_sys::set_counter_f64(
-                        event.metadata().name(),
-                        data.unit.as_deref(),
-                        data.is_incremental,
-                        value,
-                    );
-                }
-                None => {
-                    err_msg!(
-                        "invalid event(missing either 'name' or 'value'): {:?}",
-                        event
-                    );
-                    return;
-                }
-            }
+        let is_counter = COUNTER_VISITOR
+            .try_with(|data| self.emit_counter(event, &mut data.borrow_mut()))
+            .unwrap_or_else(|_| self.emit_counter(event, &mut CounterVisitor::default()));
+        if is_counter {
             return;
         }
 
         // 2) Record the event as an instant event with all key/value fields.
         let name = event.metadata().name();
-        let mut event_data = EventData::new(name);
+        let mut event_data = EventData::new_interned(name);
         event.record(&mut SpanVisitor(&mut event_data));
-        create_instant_event(event_data);
+        match self.mode {
+            EmitMode::Inline => create_instant_event(event_data),
+            EmitMode::Batched => create_batched_instant_event(event_data),
+            EmitMode::Deferred => record_deferred_instant_event(event_data),
+        }
     }
 
     fn on_record(
@@ -239,14 +676,35 @@ where
         id: &span::Id,
         ctx: tracing_subscriber::layer::Context<'_, S>,
     ) {
+        // the fields are shared with the other layers that record them
+        let fields = span_fields(attrs, id, ctx.clone());
         match ctx.span(id) {
             Some(span) => {
-                let mut event_data = EventData::new(span.name());
-
-                let mut visitor = SpanVisitor(&mut event_data);
-                attrs.record(&mut visitor);
+                let mut event_data = EventData::new_interned(span.name());
+                SpanVisitor(&mut event_data).add_fields(&fields);
 
-                let storage = PerfettoMetadata::new(event_data);
+                let storage = match (self.mode, self.min_span_duration_ns) {
+                    (mode, Some(min_duration_ns)) => {
+                        let emit = match mode {
+                            EmitMode::Inline => DelayedEmit::Inline,
+                            EmitMode::Batched => DelayedEmit::Batched,
+                            EmitMode::Deferred => DelayedEmit::Deferred,
+                        };
+                        PerfettoMetadata::new_delayed(
+                            span.name(),
+                            event_data,
+                            min_duration_ns,
+                            emit,
+                        )
+                    }
+                    (EmitMode::Inline, None) => PerfettoMetadata::new(span.name(), event_data),
+                    (EmitMode::Batched, None) => {
+                        PerfettoMetadata::new_batched(span.name(), event_data)
+                    }
+                    (EmitMode::Deferred, None) => {
+                        PerfettoMetadata::new_deferred(span.name(), event_data)
+                    }
+                };
                 let mut extensions = span.extensions_mut();
                 extensions.insert(storage);
             }
@@ -257,6 +715,7 @@ where
     }
 
     fn on_enter(&self, id: &span::Id, ctx: tracing_subscriber::layer::Context<'_, S>) {
+        self.emit_perf_counters();
         with_span_storage_mut::<PerfettoMetadata, _>(id, ctx, |storage| {
             storage.start();
         });
@@ -266,5 +725,51 @@ where
         with_span_storage_mut::<PerfettoMetadata, _>(id, ctx, |storage| {
             storage.end();
         });
+        self.emit_perf_counters();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_category_buffers() {
+        let buffers = parse_category_buffers("1024:io, net;256:counters;");
+        assert_eq!(
+            buffers,
+            vec![
+                CategoryBuffer {
+                    size_kb: 1024,
+                    categories: vec!["io".to_string(), "net".to_string()],
+                },
+                CategoryBuffer {
+                    size_kb: 256,
+                    categories: vec!["counters".to_string()],
+                },
+            ]
+        );
+
+        assert!(parse_category_buffers("").is_empty());
+    }
+
+    #[test]
+    fn test_parse_sampling_rules() {
+        let rules = parse_sampling_rules("name:poll=1/100; category:io=500/s;");
+        assert_eq!(
+            rules,
+            vec![
+                SamplingRule {
+                    key: SamplingKey::Name("poll".to_string()),
+                    policy: SamplingPolicy::OneIn(100),
+                },
+                SamplingRule {
+                    key: SamplingKey::Category("io".to_string()),
+                    policy: SamplingPolicy::PerSecond(500),
+                },
+            ]
+        );
+
+        assert!(parse_sampling_rules("").is_empty());
     }
 }
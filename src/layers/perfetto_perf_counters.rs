@@ -0,0 +1,133 @@
+// Copyright 2025 Irreducible Inc.
+
+//! Hardware counters of the perfetto layer. Every thread that enters a span opens its own
+//! `perf_event` group, reads it at the span boundaries and writes the values to counter tracks
+//! under its thread track, so that they can be lined up with the slices of the thread.
+
+use std::cell::RefCell;
+
+use perf_event::{events::Event, Builder, Counter, Group};
+use perfetto_sys::CounterHandle;
+
+use crate::errors::err_msg;
+
+/// Parse a comma-separated list of hardware counter names, e.g. `instructions,cache_misses`.
+pub(crate) fn parse_perf_events(value: &str) -> Vec<(String, Event)> {
+    use perf_event::events::Hardware;
+
+    value
+        .split(',')
+        .map(str::trim)
+        .filter(|name| !name.is_empty())
+        .filter_map(|name| {
+            let event = match name {
+                "instructions" => Hardware::INSTRUCTIONS,
+                "cycles" => Hardware::CPU_CYCLES,
+                "cache_misses" => Hardware::CACHE_MISSES,
+                "branch_misses" => Hardware::BRANCH_MISSES,
+                _ => {
+                    err_msg!("unknown PERFETTO_PERF_COUNTERS counter: {name}");
+                    return None;
+                }
+            };
+            Some((name.to_string(), event.into()))
+        })
+        .collect()
+}
+
+/// Counters read at the span boundaries.
+pub(crate) struct SpanPerfCounters {
+    events: Vec<(String, Event)>,
+}
+
+impl SpanPerfCounters {
+    pub(crate) fn new(events: Vec<(String, Event)>) -> Self {
+        Self { events }
+    }
+
+    /// Read the counters of the current thread and write them to its counter tracks.
+    pub(crate) fn emit(&self, batched: bool) {
+        THREAD_COUNTERS.with_borrow_mut(|counters| {
+            let Some(counters) = counters
+                .get_or_insert_with(|| ThreadCounters::new(&self.events))
+                .as_mut()
+            else {
+                return;
+            };
+
+            let counts = match counters.group.read() {
+                Ok(counts) => counts,
+                Err(error) => {
+                    err_msg!("failed to read perf counters: {error}");
+                    return;
+                }
+            };
+            for (counter, track) in counters.counters.iter().zip(&counters.tracks) {
+                match batched {
+                    true => track.set_u64_batched(counts[counter]),
+                    false => track.set_u64(counts[counter]),
+                }
+            }
+        });
+    }
+}
+
+struct ThreadCounters {
+    group: Group,
+    counters: Vec<Counter>,
+    tracks: Vec<CounterHandle>,
+}
+
+impl ThreadCounters {
+    /// `None` if the group cannot be opened, e.g. because of `perf_event_paranoid`.
+    fn new(events: &[(String, Event)]) -> Option<Self> {
+        let open = || -> std::io::Result<(Group, Vec<Counter>)> {
+            let mut group = Group::new()?;
+            let counters = events
+                .iter()
+                .map(|(_, event)| Builder::new().group(&mut group).kind(event.clone()).build())
+                .collect::<Result<Vec<_>, _>>()?;
+            group.enable()?;
+            Ok((group, counters))
+        };
+
+        let (group, counters) = match open() {
+            Ok(opened) => opened,
+            Err(error) => {
+                err_msg!("failed to open perf counters: {error}");
+                return None;
+            }
+        };
+        let tracks = events
+            .iter()
+            .map(|(name, _)| CounterHandle::new_for_current_thread(None, name, None, false))
+            .collect();
+
+        Some(Self {
+            group,
+            counters,
+            tracks,
+        })
+    }
+}
+
+thread_local! {
+    /// Opened on the first span boundary of the thread, `Some(None)` if it failed.
+    static THREAD_COUNTERS: RefCell<Option<Option<ThreadCounters>>> = const { RefCell::new(None) };
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_perf_events() {
+        let names = parse_perf_events("instructions, cache_misses,")
+            .into_iter()
+            .map(|(name, _)| name)
+            .collect::<Vec<_>>();
+        assert_eq!(names, vec!["instructions", "cache_misses"]);
+
+        assert!(parse_perf_events("").is_empty());
+    }
+}
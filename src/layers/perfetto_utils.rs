@@ -1,11 +1,15 @@
 // Copyright 2024-2025 Irreducible Inc.
 
-use std::path::PathBuf;
+use std::{
+    collections::hash_map::{DefaultHasher, RandomState},
+    hash::{BuildHasher, Hash, Hasher},
+    path::PathBuf,
+};
 
 use crate::filename_builder::TraceFilenameBuilder;
 use crate::filename_utils::GitInfo;
 use gethostname::gethostname;
-use perfetto_sys::{create_instant_event, EventData};
+use perfetto_sys::{clock_snapshot, create_instant_event, EventData};
 
 /// Compute where the .perfetto-trace file should live using TraceFilenameBuilder.
 ///
@@ -34,10 +38,41 @@ pub(crate) fn compute_trace_path_with_builder(
     Ok(output_path)
 }
 
+/// ID of the host, stable across runs: the systemd machine ID if there is one, otherwise
+/// derived from the hostname.
+fn machine_uuid(hostname: Option<&str>) -> String {
+    if let Ok(id) = std::fs::read_to_string("/etc/machine-id") {
+        let id = id.trim();
+        if !id.is_empty() {
+            return id.to_string();
+        }
+    }
+
+    let mut hasher = DefaultHasher::new();
+    hostname.hash(&mut hasher);
+    format!("{:016x}", hasher.finish())
+}
+
+/// Random ID of the process, unique across the hosts.
+fn process_uuid() -> String {
+    // the hashers of `RandomState` are randomly seeded
+    let random = || RandomState::new().hash_one(std::process::id());
+    let (high, low) = (random(), random());
+    format!(
+        "{:08x}-{:04x}-4{:03x}-{:04x}-{:012x}",
+        high >> 32,
+        (high >> 16) & 0xffff,
+        high & 0xfff,
+        ((low >> 48) & 0x3fff) | 0x8000,
+        low & 0xffff_ffff_ffff
+    )
+}
+
 pub(crate) fn emit_run_metadata(
     output_path: PathBuf,
     timestamp_iso: String,
     git_info: Option<&GitInfo>,
+    run_metadata: &[(&'static str, String)],
 ) {
     // Emit metadata
     let mut event_data = EventData::new("metadata:run_info");
@@ -45,6 +80,20 @@ pub(crate) fn emit_run_metadata(
     // Timestamps
     event_data.add_string_arg("timestamp", &timestamp_iso);
 
+    // Clocks and IDs of the process, to identify the trace among the ones of the other
+    // processes of the run. Informational only, `perfetto_sys::merge_traces` aligns the traces
+    // with the clock snapshots written by the service
+    let clocks = clock_snapshot();
+    event_data.add_u64_field("trace_time_ns", clocks.trace_time_ns);
+    event_data.add_u64_field("realtime_ns", clocks.realtime_ns);
+    let hostname = gethostname().into_string().ok();
+    event_data.add_string_arg("machine_uuid", &machine_uuid(hostname.as_deref()));
+    event_data.add_string_arg("process_uuid", &process_uuid());
+    event_data.add_u64_field("pid", std::process::id() as u64);
+    for (key, value) in run_metadata {
+        event_data.add_string_arg(key, value);
+    }
+
     // Trace-file name only (no path)
     if let Some(name) = output_path.file_name().and_then(|os| os.to_str()) {
         event_data.add_string_arg("trace_filename", name);
@@ -71,8 +120,8 @@ pub(crate) fn emit_run_metadata(
     event_data.add_string_arg("os", std::env::consts::OS);
     event_data.add_string_arg("os_family", std::env::consts::FAMILY);
     event_data.add_string_arg("arch", std::env::consts::ARCH);
-    if let Ok(host) = gethostname().into_string() {
-        event_data.add_string_arg("hostname", &host);
+    if let Some(host) = &hostname {
+        event_data.add_string_arg("hostname", host);
     }
 
     create_instant_event(event_data);
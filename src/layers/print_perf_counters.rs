@@ -1,18 +1,27 @@
 // Copyright 2024-2025 Irreducible Inc.
 
 use std::{
+    cell::RefCell,
+    collections::HashMap,
     io::Write,
     ops::{AddAssign, Sub},
-    sync::Mutex,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    thread::{self, ThreadId},
 };
 
 use perf_event::{events::Event, Builder, Counter, Group};
 use tracing::span;
 use tracing_subscriber::{layer, registry::LookupSpan};
 
-use crate::data::{insert_to_span_storage, with_span_storage, with_span_storage_mut};
+use crate::{
+    data::{insert_to_span_storage, with_span_storage, with_span_storage_mut, PerThread},
+    errors::err_msg,
+};
 
-#[derive(Debug, Default)]
+#[derive(Debug, Default, Clone, PartialEq)]
 struct PerfCountersValues(Vec<u64>);
 
 impl Sub<&PerfCountersValues> for &PerfCountersValues {
@@ -23,7 +32,7 @@ impl Sub<&PerfCountersValues> for &PerfCountersValues {
             self.0
                 .iter()
                 .zip(rhs.0.iter())
-                .map(|(a, b)| a - b)
+                .map(|(a, b)| a.saturating_sub(*b))
                 .collect(),
         )
     }
@@ -67,48 +76,136 @@ impl PerfCountersData {
 
 struct SpanData {
     aggregate: PerfCountersValues,
-    last_enter: PerfCountersValues,
+    /// Threads inside the span, the number of their nested entries and their counters when
+    /// they entered it.
+    entries: Vec<(ThreadId, usize, PerfCountersValues)>,
 }
 
 impl SpanData {
     fn new(size: usize) -> Self {
         Self {
             aggregate: PerfCountersValues(vec![0; size]),
-            last_enter: PerfCountersValues(vec![0; size]),
+            entries: Vec::new(),
         }
     }
 
-    fn on_enter(&mut self, counters: PerfCountersValues) {
-        self.last_enter = counters;
+    fn on_enter(&mut self, read: impl FnOnce() -> Option<PerfCountersValues>) {
+        let thread = thread::current().id();
+        if let Some((_, depth, _)) = self.entries.iter_mut().find(|(t, ..)| *t == thread) {
+            *depth += 1;
+            return;
+        }
+
+        if let Some(counters) = read() {
+            self.entries.push((thread, 1, counters));
+        }
     }
 
-    fn on_exit(&mut self, counters: PerfCountersValues) {
-        self.aggregate += &(&counters - &self.last_enter);
+    fn on_exit(&mut self, read: impl FnOnce() -> Option<PerfCountersValues>) {
+        let thread = thread::current().id();
+        let Some(index) = self.entries.iter().position(|(t, ..)| *t == thread) else {
+            return;
+        };
+        let (_, depth, _) = &mut self.entries[index];
+        *depth -= 1;
+        if *depth > 0 {
+            return;
+        }
+
+        let (_, _, entered) = self.entries.swap_remove(index);
+        if let Some(counters) = read() {
+            self.aggregate += &(&counters - &entered);
+        }
     }
 
     fn print_table(&self, field_names: &[String], out: &mut impl Write) -> std::io::Result<()> {
-        for (name, value) in field_names.iter().zip(self.aggregate.0.iter()) {
-            writeln!(out, "    {name}: {value}")?;
+        print_values(&self.aggregate, field_names, out)
+    }
+}
+
+fn print_values(
+    values: &PerfCountersValues,
+    field_names: &[String],
+    out: &mut impl Write,
+) -> std::io::Result<()> {
+    for (name, value) in field_names.iter().zip(values.0.iter()) {
+        writeln!(out, "    {name}: {value}")?;
+    }
+
+    Ok(())
+}
+
+/// Counters of the closed spans merged by span name, see `Layer::merge_by_name`.
+#[derive(Default)]
+struct MergedSpans {
+    /// Index of each span name in `spans`.
+    indices: HashMap<&'static str, usize>,
+    /// Span name, number of closed spans and their counters, in the order of the first close.
+    spans: Vec<(&'static str, usize, PerfCountersValues)>,
+}
+
+impl MergedSpans {
+    fn add(&mut self, name: &'static str, values: &PerfCountersValues) {
+        self.add_spans(name, 1, values);
+    }
+
+    fn add_spans(&mut self, name: &'static str, count: usize, values: &PerfCountersValues) {
+        match self.indices.get(name) {
+            Some(&index) => {
+                let (_, total_count, total) = &mut self.spans[index];
+                *total_count += count;
+                *total += values;
+            }
+            None => {
+                self.indices.insert(name, self.spans.len());
+                self.spans.push((name, count, values.clone()));
+            }
+        }
+    }
+
+    /// Add the spans merged by another thread.
+    fn merge(&mut self, other: &MergedSpans) {
+        for (name, count, values) in &other.spans {
+            self.add_spans(name, *count, values);
+        }
+    }
+
+    fn print(&self, field_names: &[String], out: &mut impl Write) -> std::io::Result<()> {
+        for (name, count, total) in &self.spans {
+            writeln!(out, "{name} ({count} spans):")?;
+            print_values(total, field_names, out)?;
         }
 
         Ok(())
     }
 }
 
-struct PerfCountersInner {
+/// Prints the counters merged by span name when dropped, see `Layer::merge_by_name`.
+pub struct Guard {
+    merged: Arc<PerThread<MergedSpans>>,
     names: Vec<String>,
-    counters: PerfCountersData,
 }
 
-impl PerfCountersInner {
-    pub fn new(events: Vec<(String, Event)>) -> std::io::Result<Self> {
-        Ok(Self {
-            names: events.iter().map(|(name, _)| name.clone()).collect(),
-            counters: PerfCountersData::new(events.into_iter().map(|(_, event)| event).collect())?,
-        })
+impl Drop for Guard {
+    fn drop(&mut self) {
+        let mut merged = MergedSpans::default();
+        self.merged
+            .for_each(|thread_spans| merged.merge(thread_spans));
+        merged
+            .print(&self.names, &mut std::io::stdout())
+            .expect("failed to print table");
     }
 }
 
+static NEXT_LAYER_ID: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    /// Counters of the current thread per layer, opened when the thread first enters a span.
+    /// `None` if they could not be opened.
+    static THREAD_COUNTERS: RefCell<Vec<(usize, Option<PerfCountersData>)>> =
+        const { RefCell::new(Vec::new()) };
+}
+
 /// PrintPerfCountersLayer (internally called layer::print_perf_counters::Layer)
 /// This Layer prints a table with performance counters to stdout
 ///
@@ -133,14 +230,69 @@ impl PerfCountersInner {
 ///     cycles: 738894
 /// test tests::all_layers ... ok
 /// ```
+///
+/// With `merge_by_name` the counters of the spans with the same name are added up per thread
+/// when they close and printed once, when the returned guard is dropped.
 pub struct Layer {
-    inner: Mutex<PerfCountersInner>,
+    id: usize,
+    names: Vec<String>,
+    events: Vec<Event>,
+    /// Set by `merge_by_name`, the spans are merged per thread and these are merged by the guard.
+    merged: Option<Arc<PerThread<MergedSpans>>>,
 }
 
 impl Layer {
+    /// The counters are opened for every thread the first time it enters a span and count the
+    /// events of that thread only. Opening them for the current thread fails if the counters
+    /// are not available, e.g. because of `perf_event_paranoid`.
     pub fn new(events: Vec<(String, Event)>) -> std::io::Result<Self> {
-        Ok(Self {
-            inner: Mutex::new(PerfCountersInner::new(events)?),
+        let (names, events) = events.into_iter().unzip();
+        let layer = Self {
+            id: NEXT_LAYER_ID.fetch_add(1, Ordering::Relaxed),
+            names,
+            events,
+            merged: None,
+        };
+
+        let counters = PerfCountersData::new(layer.events.clone())?;
+        THREAD_COUNTERS.with_borrow_mut(|threads| threads.push((layer.id, Some(counters))));
+
+        Ok(layer)
+    }
+
+    /// Merge the counters of the spans with the same name instead of printing each span when it
+    /// closes, e.g. for spans called many times. The totals are printed when the guard is dropped.
+    pub fn merge_by_name(mut self) -> (Self, Guard) {
+        let merged = Arc::new(PerThread::new());
+        self.merged = Some(merged.clone());
+        let guard = Guard {
+            merged,
+            names: self.names.clone(),
+        };
+
+        (self, guard)
+    }
+
+    /// Read the counters of the current thread with a single read of its group.
+    fn read_counters(&self) -> Option<PerfCountersValues> {
+        THREAD_COUNTERS.with_borrow_mut(|threads| {
+            let index = match threads.iter().position(|(id, _)| *id == self.id) {
+                Some(index) => index,
+                None => {
+                    let counters = PerfCountersData::new(self.events.clone())
+                        .map_err(|e| err_msg!("failed to open perf counters: {e}"))
+                        .ok();
+                    threads.push((self.id, counters));
+                    threads.len() - 1
+                }
+            };
+
+            threads[index]
+                .1
+                .as_mut()?
+                .read()
+                .map_err(|e| err_msg!("failed to read perf counters: {e}"))
+                .ok()
         })
     }
 }
@@ -155,33 +307,68 @@ where
         id: &span::Id,
         ctx: layer::Context<'_, S>,
     ) {
-        insert_to_span_storage(
-            id,
-            ctx,
-            SpanData::new(self.inner.lock().unwrap().names.len()),
-        );
+        insert_to_span_storage(id, ctx, SpanData::new(self.names.len()));
     }
 
     fn on_enter(&self, id: &span::Id, ctx: layer::Context<'_, S>) {
-        let mut inner = self.inner.lock().unwrap();
         with_span_storage_mut::<SpanData, _>(id, ctx, |storage| {
-            storage.on_enter(inner.counters.read().expect("failed to read perf counters"));
+            storage.on_enter(|| self.read_counters());
         });
     }
 
     fn on_exit(&self, id: &span::Id, ctx: layer::Context<'_, S>) {
-        let mut inner = self.inner.lock().unwrap();
         with_span_storage_mut::<SpanData, _>(id, ctx, |storage| {
-            storage.on_exit(inner.counters.read().expect("failed to read perf counters"));
+            storage.on_exit(|| self.read_counters());
         });
     }
 
     fn on_close(&self, id: span::Id, ctx: tracing_subscriber::layer::Context<'_, S>) {
-        println!("{}:", ctx.span(&id).expect("span not found").name());
+        let name = ctx.span(&id).expect("span not found").name();
+        if let Some(merged) = &self.merged {
+            with_span_storage::<SpanData, _>(&id, ctx, |storage| {
+                merged.with(|merged| merged.add(name, &storage.aggregate));
+            });
+            return;
+        }
+
+        println!("{name}:");
         with_span_storage::<SpanData, _>(&id, ctx, |storage| {
             storage
-                .print_table(&self.inner.lock().unwrap().names, &mut std::io::stdout())
+                .print_table(&self.names, &mut std::io::stdout())
                 .expect("failed to print table");
         });
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_merged_spans() {
+        let mut merged = MergedSpans::default();
+        merged.add("outer", &PerfCountersValues(vec![10, 20]));
+        merged.add("inner", &PerfCountersValues(vec![1, 2]));
+        merged.add("inner", &PerfCountersValues(vec![3, 4]));
+
+        // the spans of another thread
+        let mut other = MergedSpans::default();
+        other.add("inner", &PerfCountersValues(vec![5, 6]));
+        other.add("last", &PerfCountersValues(vec![7, 8]));
+        merged.merge(&other);
+
+        let mut out = Vec::new();
+        merged
+            .print(
+                &["instructions".to_string(), "cycles".to_string()],
+                &mut out,
+            )
+            .unwrap();
+        assert_eq!(
+            String::from_utf8(out).unwrap(),
+            "outer (1 spans):\n    instructions: 10\n    cycles: 20\n\
+             inner (3 spans):\n    instructions: 9\n    cycles: 12\n\
+             last (1 spans):\n    instructions: 7\n    cycles: 8\n"
+        );
+    }
+}
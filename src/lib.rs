@@ -95,7 +95,9 @@ pub use {
 };
 
 #[cfg(feature = "perfetto")]
-pub use layers::perfetto::{Layer as PerfettoLayer, PerfettoSettings as PerfettoCategorySettings};
+pub use layers::perfetto::{
+    Filter as PerfettoFilter, Layer as PerfettoLayer, PerfettoSettings as PerfettoCategorySettings,
+};
 #[cfg(feature = "perfetto")]
 pub use perfetto_sys::PerfettoGuard;
 
@@ -212,6 +214,18 @@ mod tests {
                 event!(name: "custom event", Level::DEBUG, {field5 = "value6", counter = true, value = 10});
             }).join().unwrap();
 
+            // entered repeatedly from several threads, like a future polled by different workers
+            let polled_span = debug_span!("polled span", field6 = "value6");
+            for _ in 0..2 {
+                let polled_span = polled_span.clone();
+                thread::spawn(move || {
+                    let _scope = polled_span.enter();
+                    thread::sleep(Duration::from_millis(10));
+                })
+                .join()
+                .unwrap();
+            }
+
             let span = debug_span!("child span4", field4 = "value4", perfetto_flow_id = 10);
             thread::sleep(Duration::from_millis(20));
             event!(name: "custom event", Level::DEBUG, {field5 = "value5", counter = true, value = 40});
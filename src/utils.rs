@@ -1,5 +1,14 @@
 // Copyright 2025 Irreducible Inc.
 
+/// CPU time consumed by the current thread, `None` if the clock is not available.
+pub(crate) fn thread_cpu_time() -> Option<std::time::Duration> {
+    use nix::time::{clock_gettime, ClockId};
+
+    clock_gettime(ClockId::CLOCK_THREAD_CPUTIME_ID)
+        .ok()
+        .map(std::time::Duration::from)
+}
+
 /// Creates a [`tracing`] event with the resident set size at its peak in megabytes.
 ///
 /// The name of the event is `max rss mib`.